@@ -0,0 +1,297 @@
+#include "badblockmap.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QVector>
+
+#include <mtd/mtd-user.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+Q_LOGGING_CATEGORY(badBlockMapDC, "com.ispirata.Hemera.FlashUtility.Logging.BadBlockMap")
+
+namespace {
+
+QByteArray readFile(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    return file.readAll().trimmed();
+}
+
+}
+
+class BadBlockMap::Private
+{
+public:
+    Private()
+        : fd(-1)
+        , size(0)
+        , eraseSize(0)
+        , writeSize(0)
+        , cached(false)
+        , scanTime(0)
+    {}
+
+    QString cachePath() const;
+    QByteArray sysfsBadBlocks() const;
+    bool loadCache();
+    void saveCache() const;
+    bool scan();
+
+    QString device;
+    QString errorString;
+    int fd;
+    qint64 size;
+    qint64 eraseSize;
+    qint64 writeSize;
+    QVector<bool> badBlocks;
+    bool cached;
+    qint64 scanTime;
+};
+
+QString BadBlockMap::Private::cachePath() const
+{
+    return QStringLiteral(BAD_BLOCK_CACHE_PATH "/%1.json").arg(device.mid(device.lastIndexOf(QLatin1Char('/')) + 1));
+}
+
+QByteArray BadBlockMap::Private::sysfsBadBlocks() const
+{
+    // Changes whenever the kernel marks a new bad block, invalidating the cache.
+    return readFile(QStringLiteral("/sys/class/mtd/%1/bad_blocks").arg(device.mid(device.lastIndexOf(QLatin1Char('/')) + 1)));
+}
+
+bool BadBlockMap::Private::loadCache()
+{
+    QFile cacheFile(cachePath());
+    if (!cacheFile.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QJsonObject cache = QJsonDocument::fromJson(cacheFile.readAll()).object();
+    if (cache.value(QStringLiteral("boot_id")).toString() != QString::fromLatin1(readFile(QStringLiteral(BOOT_ID_PATH))) ||
+        cache.value(QStringLiteral("size")).toDouble() != size ||
+        cache.value(QStringLiteral("erase_size")).toDouble() != eraseSize ||
+        cache.value(QStringLiteral("sysfs_bad_blocks")).toString() != QString::fromLatin1(sysfsBadBlocks())) {
+        return false;
+    }
+
+    badBlocks.fill(false, size / eraseSize);
+    for (const QJsonValue &block : cache.value(QStringLiteral("bad_blocks")).toArray()) {
+        int index = block.toInt(-1);
+        if (index < 0 || index >= badBlocks.size()) {
+            return false;
+        }
+        badBlocks[index] = true;
+    }
+
+    return true;
+}
+
+void BadBlockMap::Private::saveCache() const
+{
+    QJsonArray blocks;
+    for (int i = 0; i < badBlocks.size(); ++i) {
+        if (badBlocks.at(i)) {
+            blocks.append(i);
+        }
+    }
+
+    QJsonObject cache { { QStringLiteral("boot_id"), QString::fromLatin1(readFile(QStringLiteral(BOOT_ID_PATH))) },
+                        { QStringLiteral("size"), size },
+                        { QStringLiteral("erase_size"), eraseSize },
+                        { QStringLiteral("sysfs_bad_blocks"), QString::fromLatin1(sysfsBadBlocks()) },
+                        { QStringLiteral("bad_blocks"), blocks } };
+
+    QDir().mkpath(QStringLiteral(BAD_BLOCK_CACHE_PATH));
+    QFile cacheFile(cachePath());
+    if (!cacheFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qCWarning(badBlockMapDC) << "Could not write bad block cache for" << device << ":" << cacheFile.errorString();
+        return;
+    }
+    cacheFile.write(QJsonDocument(cache).toJson(QJsonDocument::Compact));
+}
+
+bool BadBlockMap::Private::scan()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    badBlocks.fill(false, size / eraseSize);
+    for (int block = 0; block < badBlocks.size(); ++block) {
+        loff_t offset = block * eraseSize;
+        int result = ioctl(fd, MEMGETBADBLOCK, &offset);
+        if (result < 0) {
+            if (errno == EOPNOTSUPP) {
+                // NOR and friends: no bad blocks to speak of.
+                badBlocks.fill(false);
+                break;
+            }
+            errorString = QStringLiteral("Could not check bad block %1 of %2: %3").arg(block).arg(device, QString::fromLatin1(strerror(errno)));
+            return false;
+        }
+        badBlocks[block] = result > 0;
+    }
+
+    scanTime = timer.elapsed();
+    return true;
+}
+
+BadBlockMap::BadBlockMap(const QString &device)
+    : d(new Private)
+{
+    d->device = device;
+
+    d->fd = ::open(device.toLatin1().constData(), O_RDONLY);
+    if (d->fd < 0) {
+        d->errorString = QStringLiteral("Could not open %1: %2").arg(device, QString::fromLatin1(strerror(errno)));
+        return;
+    }
+
+    mtd_info_user meminfo;
+    if (ioctl(d->fd, MEMGETINFO, &meminfo) != 0 || meminfo.erasesize == 0) {
+        d->errorString = QStringLiteral("Could not get MTD information for %1").arg(device);
+        ::close(d->fd);
+        d->fd = -1;
+        return;
+    }
+    d->size = meminfo.size;
+    d->eraseSize = meminfo.erasesize;
+    d->writeSize = meminfo.writesize;
+
+    d->cached = d->loadCache();
+    if (!d->cached) {
+        if (!d->scan()) {
+            ::close(d->fd);
+            d->fd = -1;
+            return;
+        }
+        d->saveCache();
+    }
+
+    if (d->cached) {
+        qCInfo(badBlockMapDC) << "Using cached bad block map of" << device << ":" << badBlockCount() << "bad blocks out of" << blockCount();
+    } else {
+        qCInfo(badBlockMapDC) << "Scanned" << device << "in" << d->scanTime << "ms:" << badBlockCount() << "bad blocks out of" << blockCount();
+    }
+}
+
+BadBlockMap::~BadBlockMap()
+{
+    if (d->fd >= 0) {
+        ::close(d->fd);
+    }
+    delete d;
+}
+
+bool BadBlockMap::isValid() const
+{
+    return d->fd >= 0;
+}
+
+QString BadBlockMap::errorString() const
+{
+    return d->errorString;
+}
+
+QString BadBlockMap::device() const
+{
+    return d->device;
+}
+
+qint64 BadBlockMap::size() const
+{
+    return d->size;
+}
+
+qint64 BadBlockMap::eraseSize() const
+{
+    return d->eraseSize;
+}
+
+qint64 BadBlockMap::writeSize() const
+{
+    return d->writeSize;
+}
+
+int BadBlockMap::blockCount() const
+{
+    return d->badBlocks.size();
+}
+
+bool BadBlockMap::isBad(int block) const
+{
+    return block >= 0 && block < d->badBlocks.size() && d->badBlocks.at(block);
+}
+
+bool BadBlockMap::isBadAt(qint64 offset) const
+{
+    return d->eraseSize > 0 && isBad(offset / d->eraseSize);
+}
+
+int BadBlockMap::badBlockCount() const
+{
+    return d->badBlocks.count(true);
+}
+
+int BadBlockMap::badBlockCount(qint64 offset, qint64 length) const
+{
+    int count = 0;
+    for (qint64 block = offset / d->eraseSize; block * d->eraseSize < offset + length && block < d->badBlocks.size(); ++block) {
+        if (d->badBlocks.at(block)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+bool BadBlockMap::markBad(int block)
+{
+    if (!isValid() || block < 0 || block >= d->badBlocks.size()) {
+        return false;
+    }
+
+    // Whatever happens on flash, this run stays away from the block.
+    d->badBlocks[block] = true;
+
+    // mtdchar refuses MEMSETBADBLOCK on descriptors not open for writing, and scanning doesn't need one.
+    int fd = ::open(d->device.toLatin1().constData(), O_RDWR);
+    if (fd < 0) {
+        d->errorString = QStringLiteral("Could not open %1 for writing: %2").arg(d->device, QString::fromLatin1(strerror(errno)));
+        return false;
+    }
+
+    loff_t offset = block * d->eraseSize;
+    if (ioctl(fd, MEMSETBADBLOCK, &offset) != 0) {
+        d->errorString = QStringLiteral("Could not mark block %1 of %2 bad: %3").arg(block).arg(d->device, QString::fromLatin1(strerror(errno)));
+        ::close(fd);
+        return false;
+    }
+    ::close(fd);
+
+    d->saveCache();
+    return true;
+}
+
+bool BadBlockMap::isCached() const
+{
+    return d->cached;
+}
+
+qint64 BadBlockMap::scanTime() const
+{
+    return d->scanTime;
+}
@@ -0,0 +1,44 @@
+#ifndef BADBLOCKMAP_H_
+#define BADBLOCKMAP_H_
+
+#include <QtCore/QString>
+
+// Scans of each MTD device are shared by all operations of a run through files in here.
+#define BAD_BLOCK_CACHE_PATH "/tmp/flashutility-badblocks"
+
+class BadBlockMap
+{
+public:
+    /// Loads the bad block map of @p device, scanning it only if no valid map was cached during this boot.
+    explicit BadBlockMap(const QString &device);
+    ~BadBlockMap();
+
+    bool isValid() const;
+    QString errorString() const;
+
+    QString device() const;
+    qint64 size() const;
+    qint64 eraseSize() const;
+    qint64 writeSize() const;
+    int blockCount() const;
+
+    bool isBad(int block) const;
+    bool isBadAt(qint64 offset) const;
+    int badBlockCount() const;
+    int badBlockCount(qint64 offset, qint64 length) const;
+
+    /// Marks @p block bad on flash, and updates the cached map accordingly.
+    /// If that fails, see errorString(), the block still counts as bad for this map.
+    bool markBad(int block);
+
+    bool isCached() const;
+    qint64 scanTime() const;
+
+private:
+    Q_DISABLE_COPY(BadBlockMap)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "compressedimage.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QLoggingCategory>
+
+#define BUNZIP2_PATH "/usr/bin/bunzip2"
+#define ZSTD_PATH "/usr/bin/zstd"
+#define XZ_PATH "/usr/bin/xz"
+
+Q_LOGGING_CATEGORY(compressedImageDC, "com.ispirata.Hemera.FlashUtility.Logging.CompressedImage")
+
+namespace {
+
+quint64 readLittleEndian(const QByteArray &data, int offset, int size)
+{
+    quint64 value = 0;
+    for (int i = size - 1; i >= 0; --i) {
+        value = (value << 8) | static_cast<quint8>(data.at(offset + i));
+    }
+    return value;
+}
+
+bool readVarInt(const QByteArray &data, int *offset, quint64 *value)
+{
+    *value = 0;
+    for (int i = 0; i < 9 && *offset < data.size(); ++i) {
+        quint8 byte = static_cast<quint8>(data.at((*offset)++));
+        *value |= static_cast<quint64>(byte & 0x7F) << (i * 7);
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sums the Frame_Content_Size of every frame, walking block headers to find where each frame ends.
+qint64 zstdContentSize(QFile &file)
+{
+    qint64 total = 0;
+    qint64 pos = 0;
+
+    while (pos < file.size()) {
+        file.seek(pos);
+        QByteArray header = file.read(18);
+        if (header.size() < 8) {
+            return -1;
+        }
+
+        quint32 magic = readLittleEndian(header, 0, 4);
+        if ((magic & 0xFFFFFFF0) == 0x184D2A50) {
+            // Skippable frame
+            pos += 8 + readLittleEndian(header, 4, 4);
+            continue;
+        } else if (magic != 0xFD2FB528) {
+            return -1;
+        }
+
+        quint8 descriptor = static_cast<quint8>(header.at(4));
+        int fcsFlag = descriptor >> 6;
+        bool singleSegment = (descriptor >> 5) & 1;
+        bool hasChecksum = (descriptor >> 2) & 1;
+        static const int dictionaryIdSizes[] = { 0, 1, 2, 4 };
+        static const int contentSizeSizes[] = { 0, 2, 4, 8 };
+
+        int offset = 5 + (singleSegment ? 0 : 1) + dictionaryIdSizes[descriptor & 3];
+        int contentSizeSize = (fcsFlag == 0 && singleSegment) ? 1 : contentSizeSizes[fcsFlag];
+        if (contentSizeSize == 0) {
+            // Streamed frame, the size is not recorded.
+            return -1;
+        }
+        if (header.size() < offset + contentSizeSize) {
+            return -1;
+        }
+
+        quint64 contentSize = readLittleEndian(header, offset, contentSizeSize);
+        if (contentSizeSize == 2) {
+            contentSize += 256;
+        }
+        total += contentSize;
+        pos += offset + contentSizeSize;
+
+        bool lastBlock = false;
+        while (!lastBlock) {
+            file.seek(pos);
+            QByteArray blockHeader = file.read(3);
+            if (blockHeader.size() < 3) {
+                return -1;
+            }
+            quint32 value = readLittleEndian(blockHeader, 0, 3);
+            lastBlock = value & 1;
+            int blockType = (value >> 1) & 3;
+            if (blockType == 3) {
+                return -1;
+            }
+            // RLE blocks store a single byte, whatever their regenerated size.
+            pos += 3 + (blockType == 1 ? 1 : (value >> 3));
+        }
+
+        if (hasChecksum) {
+            pos += 4;
+        }
+    }
+
+    return total;
+}
+
+// Walks the streams backwards from the end of file, summing the uncompressed sizes in each index.
+qint64 xzContentSize(QFile &file)
+{
+    qint64 total = 0;
+    qint64 pos = file.size();
+
+    while (pos > 0) {
+        // Stream padding
+        while (pos >= 4) {
+            file.seek(pos - 4);
+            if (file.read(4) != QByteArray(4, '\0')) {
+                break;
+            }
+            pos -= 4;
+        }
+
+        if (pos < 24) {
+            return -1;
+        }
+
+        file.seek(pos - 12);
+        QByteArray footer = file.read(12);
+        if (footer.size() != 12 || footer.at(10) != 'Y' || footer.at(11) != 'Z') {
+            return -1;
+        }
+
+        qint64 indexSize = (readLittleEndian(footer, 4, 4) + 1) * 4;
+        qint64 indexPos = pos - 12 - indexSize;
+        if (indexPos < 12) {
+            return -1;
+        }
+
+        file.seek(indexPos);
+        QByteArray index = file.read(indexSize);
+        if (index.size() != indexSize || index.at(0) != '\0') {
+            return -1;
+        }
+
+        int offset = 1;
+        quint64 records;
+        if (!readVarInt(index, &offset, &records)) {
+            return -1;
+        }
+
+        qint64 blocksSize = 0;
+        for (quint64 i = 0; i < records; ++i) {
+            quint64 unpaddedSize;
+            quint64 uncompressedSize;
+            if (!readVarInt(index, &offset, &unpaddedSize) || !readVarInt(index, &offset, &uncompressedSize)) {
+                return -1;
+            }
+            blocksSize += (unpaddedSize + 3) & ~Q_UINT64_C(3);
+            total += uncompressedSize;
+        }
+
+        pos = indexPos - blocksSize - 12;
+        if (pos < 0) {
+            return -1;
+        }
+    }
+
+    return total;
+}
+
+}
+
+class CompressedImage::Private
+{
+public:
+    Private()
+        : format(Format::Raw)
+        , uncompressedSize(-1)
+    {}
+
+    QString path;
+    Format format;
+    qint64 uncompressedSize;
+};
+
+CompressedImage::CompressedImage(const QString &path)
+    : d(new Private)
+{
+    d->path = path;
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(compressedImageDC) << "Could not open" << path;
+        return;
+    }
+
+    QByteArray magic = file.read(6);
+    if (magic.startsWith("BZh")) {
+        d->format = Format::Bzip2;
+        // bzip2 has no notion of the total size.
+    } else if (magic.startsWith("\x28\xB5\x2F\xFD")) {
+        d->format = Format::Zstd;
+        d->uncompressedSize = zstdContentSize(file);
+    } else if (magic == QByteArray("\xFD" "7zXZ\0", 6)) {
+        d->format = Format::Xz;
+        d->uncompressedSize = xzContentSize(file);
+    } else {
+        d->format = Format::Raw;
+        d->uncompressedSize = file.size();
+    }
+
+    qCDebug(compressedImageDC) << path << "format:" << (int) d->format << "uncompressed size:" << d->uncompressedSize;
+}
+
+CompressedImage::~CompressedImage()
+{
+    delete d;
+}
+
+QString CompressedImage::path() const
+{
+    return d->path;
+}
+
+CompressedImage::Format CompressedImage::format() const
+{
+    return d->format;
+}
+
+bool CompressedImage::isCompressed() const
+{
+    return d->format != Format::Raw;
+}
+
+qint64 CompressedImage::uncompressedSize() const
+{
+    return d->uncompressedSize;
+}
+
+QString CompressedImage::decompressorProgram() const
+{
+    switch (d->format) {
+        case Format::Bzip2:
+            return QStringLiteral(BUNZIP2_PATH);
+        case Format::Zstd:
+            return QStringLiteral(ZSTD_PATH);
+        case Format::Xz:
+            return QStringLiteral(XZ_PATH);
+        default:
+            return QString();
+    }
+}
+
+QStringList CompressedImage::decompressorArguments() const
+{
+    switch (d->format) {
+        case Format::Bzip2:
+            return QStringList { QStringLiteral("-c"), d->path };
+        case Format::Zstd:
+        case Format::Xz:
+            return QStringList { QStringLiteral("-d"), QStringLiteral("-c"), d->path };
+        default:
+            return QStringList();
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef COMPRESSEDIMAGE_H_
+#define COMPRESSEDIMAGE_H_
+
+#include <QtCore/QStringList>
+
+class CompressedImage
+{
+public:
+    enum class Format {
+        Raw,
+        Bzip2,
+        Zstd,
+        Xz
+    };
+
+    explicit CompressedImage(const QString &path);
+    ~CompressedImage();
+
+    QString path() const;
+    Format format() const;
+    bool isCompressed() const;
+
+    /// Size of the decompressed data as declared by the container headers, -1 if they don't carry it.
+    qint64 uncompressedSize() const;
+
+    QString decompressorProgram() const;
+    QStringList decompressorArguments() const;
+
+private:
+    Q_DISABLE_COPY(CompressedImage)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "conditionaloperation.h"
+
+class ConditionalOperation::Private
+{
+public:
+    Private()
+        : operation(nullptr)
+    {}
+
+    Hemera::Operation *operation;
+    std::function<bool()> condition;
+};
+
+ConditionalOperation::ConditionalOperation(Hemera::Operation *operation, const std::function<bool()> &condition, QObject *parent)
+    : Operation(Operation::ExplicitStartOption, parent)
+    , d(new Private)
+{
+    d->operation = operation;
+    d->condition = condition;
+}
+
+ConditionalOperation::~ConditionalOperation()
+{
+    delete d;
+}
+
+void ConditionalOperation::startImpl()
+{
+    if (!d->condition()) {
+        setFinished();
+        return;
+    }
+
+    connect(d->operation, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        if (operation->isError()) {
+            setFinishedWithError(operation->errorName(), operation->errorMessage());
+        } else {
+            setFinished();
+        }
+    });
+    d->operation->start();
+}
@@ -0,0 +1,26 @@
+#ifndef CONDITIONAL_OPERATION_
+#define CONDITIONAL_OPERATION_
+
+#include <HemeraCore/Operation>
+
+#include <functional>
+
+/// Runs @p operation only if @p condition, evaluated when this gets started, holds. Otherwise finishes right away.
+class ConditionalOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ConditionalOperation)
+
+public:
+    explicit ConditionalOperation(Hemera::Operation *operation, const std::function<bool()> &condition, QObject *parent = nullptr);
+    virtual ~ConditionalOperation();
+
+protected:
+    virtual void startImpl();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif
@@ -1,31 +1,34 @@
 #include "copyrecoveryoperation.h"
 
+#include "devicewaitoperation.h"
+#include "filecopier.h"
+#include "mountmanager.h"
+
 #include <QtCore/QDebug>
-#include <QtCore/QDir>
 #include <QtCore/QFile>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonObject>
-#include <QtCore/QProcess>
 
 #include <HemeraCore/Literals>
 
 #include <unistd.h>
 
-#define RECOVERY_MOUNTPOINT "/tmp/recovery"
 #define SOURCE_DIR "/ramdisk/boot"
-#define MOUNT_PATH "/bin/mount"
-#define UMOUNT_PATH "/bin/umount"
+#define DEVICE_WAIT_TIMEOUT 10000
 
 Q_LOGGING_CATEGORY(copyRecoveryOperationDC, "com.ispirata.Hemera.FlashUtility.Logging.MkfsOperation")
 
 class CopyRecoveryOperation::Private
 {
 public:
-    Private() {}
+    Private()
+        : mountManager(nullptr)
+    {}
 
     QString device;
     QStringList files;
+    MountManager *mountManager;
 };
 
 CopyRecoveryOperation::CopyRecoveryOperation(const QString &id, QObject *parent)
@@ -41,9 +44,10 @@ CopyRecoveryOperation::~CopyRecoveryOperation()
 
 void CopyRecoveryOperation::startImpl()
 {
-    QString diskByLabel = QStringLiteral("/dev/disk/by-label/%1").arg(parameters().value(QStringLiteral("filesystem_label")).toString());
-    if (parameters().contains(QStringLiteral("filesystem_label")) && QFile::exists(diskByLabel)) {
-        d->device = diskByLabel;
+    // The label link is what we wait for when there is one: udev creates it after the node, if at all.
+    QString label = parameters().value(QStringLiteral("filesystem_label")).toString();
+    if (!label.isEmpty()) {
+        d->device = QStringLiteral("/dev/disk/by-label/%1").arg(label);
     } else {
         d->device = parameters().value(QStringLiteral("target")).toString();
     }
@@ -52,47 +56,55 @@ void CopyRecoveryOperation::startImpl()
         d->files.append(value.toString());
     }
 
-    QDir recoveryDir(QStringLiteral(RECOVERY_MOUNTPOINT));
-    if (!QFile::exists(d->device)) {
-        qCWarning(copyRecoveryOperationDC) << "Device " << d->device << " does not exist!!";
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                             QStringLiteral("Error: Device %1 is not available").arg(d->device));
-        return;
-    }
-    // Create it
-    if (!recoveryDir.mkpath(QStringLiteral(RECOVERY_MOUNTPOINT))) {
-        qDebug() << "Could not create directory" << RECOVERY_MOUNTPOINT << "!!";
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                             QStringLiteral("Could not create recovery partition mountpoint."));
-        return;
-    }
-
-    // Mount the device
-    QProcess *mountRecovery = new QProcess(this);
-    mountRecovery->start(QStringLiteral(MOUNT_PATH), QStringList { d->device, QStringLiteral(RECOVERY_MOUNTPOINT) });
-    // Wait for finished.
-    mountRecovery->waitForFinished();
-    if ((mountRecovery->exitStatus() != QProcess::NormalExit) || (mountRecovery->exitCode() != 0)) {
-        qDebug() << "Could not mount recovery partition!!" << mountRecovery->readAll();
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                             QStringLiteral("Could not mount recovery partition."));
-        return;
-    }
-
-    // List files in our source, and copy them into the target directory.
-    for (const QString &filename : d->files) {
-        QString sourceFile = QStringLiteral("%1/%2").arg(QStringLiteral(SOURCE_DIR), filename);
-        QString destinationFile = QStringLiteral("%1/%2").arg(QStringLiteral(RECOVERY_MOUNTPOINT), filename);
-        if (!QFile::copy(sourceFile, destinationFile)) {
-            qDebug() << "Could not copy files!!" << sourceFile << destinationFile;
+    DeviceWaitOperation *waitOperation = new DeviceWaitOperation(d->device, DEVICE_WAIT_TIMEOUT, this);
+    connect(waitOperation, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        QString fallback = parameters().value(QStringLiteral("target")).toString();
+        if (operation->isError() && !fallback.isEmpty() && fallback != d->device && QFile::exists(fallback)) {
+            qCWarning(copyRecoveryOperationDC) << "Device " << d->device << " does not exist, falling back to" << fallback;
+            d->device = fallback;
+        } else if (operation->isError()) {
+            qCWarning(copyRecoveryOperationDC) << "Device " << d->device << " does not exist!!";
             setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                                 QStringLiteral("Could not copy %1 to recovery partition.").arg(sourceFile));
+                                 QStringLiteral("Error: Device %1 is not available").arg(d->device));
             return;
         }
+
+        // Mount the device
+        d->mountManager = new MountManager(d->device, this);
+        connect(d->mountManager, &MountManager::mountFinished, this, [this] (bool success) {
+            if (!success) {
+                qDebug() << "Could not mount recovery partition!!" << d->mountManager->errorString();
+                setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                                     QStringLiteral("Could not mount recovery partition."));
+                return;
+            }
+
+            copyFiles();
+        });
+        d->mountManager->mount();
+    });
+}
+
+void CopyRecoveryOperation::copyFiles()
+{
+    QString recoveryMountPoint = d->mountManager->mountPoint();
+
+    // List files in our source, and copy them into the target directory, all at once.
+    FileCopier copier;
+    copier.setIncremental(parameters().value(QStringLiteral("incremental")).toBool(false));
+    for (const QString &filename : d->files) {
+        copier.addFile(QStringLiteral("%1/%2").arg(QStringLiteral(SOURCE_DIR), filename),
+                       QStringLiteral("%1/%2").arg(recoveryMountPoint, filename));
+    }
+    if (!copier.copy()) {
+        qDebug() << "Could not copy files!!" << copier.failedFiles();
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                             QStringLiteral("Could not copy %1 to recovery partition.").arg(copier.failedFiles().join(QStringLiteral(", "))));
+        return;
     }
 
     // Create "partial_flash", so that installer will know not to wipe everything!
-    QString partialFlashFile = QStringLiteral("%1/partial_flash").arg(QStringLiteral(RECOVERY_MOUNTPOINT));
+    QString partialFlashFile = QStringLiteral("%1/partial_flash").arg(recoveryMountPoint);
     QFile f(partialFlashFile);
     if (f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
         f.write("created by Hemera installer");
@@ -102,15 +114,11 @@ void CopyRecoveryOperation::startImpl()
         qWarning() << "Could not create partial_flash!! Recovery will wipe away everything!!";
     }
 
-    // Unmount the device, and ignore possible errors.
-    QProcess *unmountRecovery = new QProcess(this);
-    unmountRecovery->start(QStringLiteral(UMOUNT_PATH), QStringList { d->device });
-    // Wait for finished. We don't care about the outcome.
-    unmountRecovery->waitForFinished();
-
-    sync();
-
-    setFinished();
+    // Unmount the device unless the next action needs it too, and ignore possible errors.
+    connect(d->mountManager, &MountManager::releaseFinished, this, [this] {
+        setFinished();
+    });
+    d->mountManager->release(parameters().value(QStringLiteral("keep_mounted")).toBool(false));
 }
 
 ROOT_OPERATION_WORKER(CopyRecoveryOperation, "com.ispirata.Hemera.FlashUtility.CopyRecoveryOperation")
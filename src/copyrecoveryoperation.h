@@ -16,6 +16,8 @@ protected:
     virtual void startImpl();
 
 private:
+    void copyFiles();
+
     class Private;
     Private * const d;
 };
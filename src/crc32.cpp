@@ -0,0 +1,43 @@
+#include "crc32.h"
+
+namespace {
+
+struct Crc32Table
+{
+    Crc32Table()
+    {
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+            }
+            entries[i] = crc;
+        }
+    }
+
+    quint32 entries[256];
+};
+
+}
+
+namespace Crc32
+{
+
+quint32 update(quint32 crc, const void *data, qint64 size)
+{
+    static const Crc32Table table;
+
+    const quint8 *bytes = static_cast<const quint8 *>(data);
+    for (qint64 i = 0; i < size; ++i) {
+        crc = table.entries[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+quint32 checksum(const void *data, qint64 size)
+{
+    return ~update(0xFFFFFFFF, data, size);
+}
+
+}
@@ -0,0 +1,17 @@
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <QtCore/QtGlobal>
+
+namespace Crc32
+{
+
+/// Raw reflected CRC-32 (polynomial 0xEDB88320), without pre or post inversion. This is what UBI calls crc32.
+quint32 update(quint32 crc, const void *data, qint64 size);
+
+/// Standard CRC-32 as computed by zlib, used by U-Boot and GPT.
+quint32 checksum(const void *data, qint64 size);
+
+}
+
+#endif
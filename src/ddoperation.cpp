@@ -1,10 +1,12 @@
 #include "ddoperation.h"
 
+#include "logsink.h"
+#include "udevsettleoperation.h"
+
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
 #include <QtCore/QJsonObject>
 #include <QtCore/QProcess>
-#include <QtCore/QTimer>
 
 #include <HemeraCore/Literals>
 
@@ -12,6 +14,7 @@
 
 #define BUNZIP2_PATH "/usr/bin/bunzip2"
 #define DD_PATH "/bin/dd"
+#define UDEV_SETTLE_TIMEOUT 30000
 
 class DDOperation::Private
 {
@@ -82,16 +85,10 @@ void DDOperation::startImpl()
     args << QStringLiteral("of=") + d->device;
     args << QStringLiteral("bs=8192"); //FIX: find better block size
 
-    connect(d->process, &QProcess::readyReadStandardOutput, this, [this] () {
-        qDebug() << d->process->readAllStandardOutput();
-    });
-    connect(d->process, &QProcess::readyReadStandardError, this, [this] () {
-        qDebug() << d->process->readAllStandardError();
-    });
+    LogSink::instance()->attach(d->process, QStringLiteral("dd"));
     if (bunzip2) {
-        connect(bunzip2, &QProcess::readyReadStandardError, this, [this] () {
-            qDebug() << d->process->readAllStandardError();
-        });
+        // Its output goes to dd, only errors are worth logging.
+        LogSink::instance()->attachErrors(bunzip2, QStringLiteral("bunzip2"));
     }
     QObject::connect(d->process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
                      this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
@@ -103,8 +100,9 @@ void DDOperation::startImpl()
         if (d->success) {
             // flush all pending writes to disk
             sync();
-            // FIXME: worakround useful to give udev some seconds to scan for changes
-            QTimer::singleShot(5000, this, [this] () {
+            // Wait for udev to pick up the changes, e.g. the new by-label links, and not a moment longer.
+            UdevSettleOperation *settleOperation = new UdevSettleOperation(d->device, UDEV_SETTLE_TIMEOUT, 5000, this);
+            connect(settleOperation, &Hemera::Operation::finished, this, [this] {
                 setFinished();
             });
         } else {
@@ -0,0 +1,131 @@
+#include "devicewaitoperation.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QSocketNotifier>
+#include <QtCore/QTimer>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(deviceWaitOperationDC, "com.ispirata.Hemera.FlashUtility.Logging.DeviceWaitOperation")
+
+class DeviceWaitOperation::Private
+{
+public:
+    Private(DeviceWaitOperation *q)
+        : q(q)
+        , timeout(0)
+        , inotifyFd(-1)
+        , watch(-1)
+        , notifier(nullptr)
+        , timer(nullptr)
+    {}
+
+    void check();
+    void cleanup();
+
+    DeviceWaitOperation * const q;
+
+    QString path;
+    int timeout;
+    int inotifyFd;
+    int watch;
+    QString watchedDirectory;
+    QSocketNotifier *notifier;
+    QTimer *timer;
+    QElapsedTimer elapsed;
+};
+
+void DeviceWaitOperation::Private::check()
+{
+    // We only care that something happened, drain the queue.
+    char buffer[4096];
+    while (::read(inotifyFd, buffer, sizeof(buffer)) > 0) {
+    }
+
+    // by-label and friends are created along with their first entry: watch the closest directory which exists already.
+    QString directory = QFileInfo(path).absolutePath();
+    while (!QFileInfo(directory).isDir() && directory != QStringLiteral("/")) {
+        directory = QFileInfo(directory).absolutePath();
+    }
+
+    if (directory != watchedDirectory) {
+        if (watch >= 0) {
+            inotify_rm_watch(inotifyFd, watch);
+        }
+        watch = inotify_add_watch(inotifyFd, QFile::encodeName(directory).constData(), IN_CREATE | IN_MOVED_TO);
+        watchedDirectory = directory;
+        if (watch < 0) {
+            qCWarning(deviceWaitOperationDC) << "Could not watch" << directory << ":" << strerror(errno);
+        }
+    }
+
+    // Checked after arming the watch, so that nothing can slip in between.
+    if (QFile::exists(path)) {
+        qCInfo(deviceWaitOperationDC) << path << "appeared after" << elapsed.elapsed() << "ms";
+        cleanup();
+        q->setFinished();
+    }
+}
+
+void DeviceWaitOperation::Private::cleanup()
+{
+    timer->stop();
+    notifier->setEnabled(false);
+    ::close(inotifyFd);
+    inotifyFd = -1;
+}
+
+DeviceWaitOperation::DeviceWaitOperation(const QString &path, int timeout, QObject *parent)
+    : Operation(parent)
+    , d(new Private(this))
+{
+    d->path = path;
+    d->timeout = timeout;
+}
+
+DeviceWaitOperation::~DeviceWaitOperation()
+{
+    if (d->inotifyFd >= 0) {
+        ::close(d->inotifyFd);
+    }
+    delete d;
+}
+
+void DeviceWaitOperation::startImpl()
+{
+    if (QFile::exists(d->path)) {
+        setFinished();
+        return;
+    }
+
+    qCInfo(deviceWaitOperationDC) << "Waiting up to" << d->timeout << "ms for" << d->path;
+    d->elapsed.start();
+
+    d->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (d->inotifyFd < 0) {
+        setFinishedWithError(QStringLiteral("DeviceWaitFailed"), QStringLiteral("Could not watch for %1: %2").arg(d->path, QString::fromLocal8Bit(strerror(errno))));
+        return;
+    }
+
+    d->notifier = new QSocketNotifier(d->inotifyFd, QSocketNotifier::Read, this);
+    connect(d->notifier, &QSocketNotifier::activated, this, [this] {
+        d->check();
+    });
+
+    d->timer = new QTimer(this);
+    d->timer->setSingleShot(true);
+    connect(d->timer, &QTimer::timeout, this, [this] {
+        qCWarning(deviceWaitOperationDC) << d->path << "did not appear within" << d->timeout << "ms";
+        d->cleanup();
+        setFinishedWithError(QStringLiteral("DeviceWaitTimeout"), QStringLiteral("Device %1 is not available").arg(d->path));
+    });
+    d->timer->start(d->timeout);
+
+    d->check();
+}
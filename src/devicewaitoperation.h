@@ -0,0 +1,24 @@
+#ifndef DEVICEWAIT_OPERATION_
+#define DEVICEWAIT_OPERATION_
+
+#include <HemeraCore/Operation>
+
+/// Finishes as soon as @p path exists, or with an error once @p timeout milliseconds went by without it showing up.
+class DeviceWaitOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(DeviceWaitOperation)
+
+public:
+    explicit DeviceWaitOperation(const QString &path, int timeout, QObject *parent = nullptr);
+    virtual ~DeviceWaitOperation();
+
+protected:
+    virtual void startImpl();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "directoryeraser.h"
+
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QRunnable>
+#include <QtCore/QSet>
+#include <QtCore/QThreadPool>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define GETDENTS_BUFFER_SIZE (32 * 1024)
+
+Q_LOGGING_CATEGORY(directoryEraserDC, "com.ispirata.Hemera.FlashUtility.Logging.DirectoryEraser")
+
+namespace {
+
+// glibc does not expose getdents64, nor its record layout.
+struct LinuxDirent64 {
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct DirectoryNode {
+    QByteArray path;
+    DirectoryNode *parent;
+    // Subdirectories still being removed, plus one while the directory itself is being listed.
+    QAtomicInt pending;
+    bool removeSelf;
+};
+
+}
+
+class DirectoryEraser::Private
+{
+public:
+    class EraseTask;
+
+    Private()
+        : removedFiles(0)
+        , removedDirectories(0)
+        , removedBytes(0)
+        , failures(0)
+        , elapsed(0)
+    {}
+
+    bool run(const QStringList &paths, bool removeSelf, const QStringList &preserve = QStringList());
+    void schedule(DirectoryNode *node);
+    void eraseDirectory(DirectoryNode *node);
+    void release(DirectoryNode *node);
+    void fail(const QByteArray &path, const char *action);
+
+    QThreadPool pool;
+    // Only read by the workers, so it needs no locking.
+    QSet< QByteArray > preserved;
+    QAtomicInteger<qint64> removedFiles;
+    QAtomicInteger<qint64> removedDirectories;
+    QAtomicInteger<qint64> removedBytes;
+    QAtomicInt failures;
+    qint64 elapsed;
+};
+
+class DirectoryEraser::Private::EraseTask : public QRunnable
+{
+public:
+    EraseTask(Private *eraser, DirectoryNode *node)
+        : m_eraser(eraser)
+        , m_node(node)
+    {}
+
+    void run() Q_DECL_OVERRIDE
+    {
+        m_eraser->eraseDirectory(m_node);
+    }
+
+private:
+    Private *m_eraser;
+    DirectoryNode *m_node;
+};
+
+void DirectoryEraser::Private::fail(const QByteArray &path, const char *action)
+{
+    // Don't flood the log if a whole tree is read-only.
+    if (failures.fetchAndAddRelaxed(1) < 10) {
+        qCWarning(directoryEraserDC) << "Could not" << action << path << ":" << strerror(errno);
+    }
+}
+
+void DirectoryEraser::Private::schedule(DirectoryNode *node)
+{
+    pool.start(new EraseTask(this, node));
+}
+
+void DirectoryEraser::Private::eraseDirectory(DirectoryNode *node)
+{
+    int fd = ::openat(AT_FDCWD, node->path.constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        fail(node->path, "open");
+        release(node);
+        return;
+    }
+
+    char buffer[GETDENTS_BUFFER_SIZE];
+    long length;
+    while ((length = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for (long offset = 0; offset < length;) {
+            LinuxDirent64 *entry = reinterpret_cast<LinuxDirent64 *>(buffer + offset);
+            offset += entry->d_reclen;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            if (!node->parent && preserved.contains(QByteArray(entry->d_name))) {
+                continue;
+            }
+
+            struct stat entryStat;
+            if (fstatat(fd, entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0) {
+                fail(node->path + '/' + entry->d_name, "stat");
+                continue;
+            }
+
+            if (S_ISDIR(entryStat.st_mode)) {
+                // Fan subdirectories out, the last one to finish removes its parent.
+                DirectoryNode *child = new DirectoryNode;
+                child->path = node->path + '/' + entry->d_name;
+                child->parent = node;
+                child->pending.store(1);
+                child->removeSelf = true;
+                node->pending.ref();
+                schedule(child);
+            } else if (unlinkat(fd, entry->d_name, 0) == 0) {
+                removedFiles.fetchAndAddRelaxed(1);
+                removedBytes.fetchAndAddRelaxed(entryStat.st_size);
+            } else {
+                fail(node->path + '/' + entry->d_name, "remove");
+            }
+        }
+    }
+
+    if (length < 0) {
+        fail(node->path, "read");
+    }
+
+    ::close(fd);
+    release(node);
+}
+
+void DirectoryEraser::Private::release(DirectoryNode *node)
+{
+    while (node && !node->pending.deref()) {
+        if (node->removeSelf) {
+            if (unlinkat(AT_FDCWD, node->path.constData(), AT_REMOVEDIR) == 0) {
+                removedDirectories.fetchAndAddRelaxed(1);
+            } else {
+                fail(node->path, "remove directory");
+            }
+        }
+
+        DirectoryNode *parent = node->parent;
+        delete node;
+        node = parent;
+    }
+}
+
+bool DirectoryEraser::Private::run(const QStringList &paths, bool removeSelf, const QStringList &preserve)
+{
+    preserved.clear();
+    for (const QString &name : preserve) {
+        preserved.insert(name.toLocal8Bit());
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    int initialFailures = failures.loadAcquire();
+
+    for (const QString &path : paths) {
+        DirectoryNode *root = new DirectoryNode;
+        root->path = path.toLocal8Bit();
+        root->parent = nullptr;
+        root->pending.store(1);
+        root->removeSelf = removeSelf;
+        schedule(root);
+    }
+    pool.waitForDone();
+
+    elapsed += timer.elapsed();
+    return failures.loadAcquire() == initialFailures;
+}
+
+DirectoryEraser::DirectoryEraser(int threadCount)
+    : d(new Private)
+{
+    if (threadCount > 0) {
+        d->pool.setMaxThreadCount(threadCount);
+    }
+}
+
+DirectoryEraser::~DirectoryEraser()
+{
+    qint64 elapsedMs = qMax(d->elapsed, Q_INT64_C(1));
+    qCInfo(directoryEraserDC) << "Removed" << d->removedFiles.loadAcquire() << "files," << d->removedDirectories.loadAcquire()
+                              << "directories and" << d->removedBytes.loadAcquire() << "bytes in" << d->elapsed << "ms ("
+                              << (d->removedFiles.loadAcquire() * 1000) / elapsedMs << "files/s,"
+                              << (d->removedBytes.loadAcquire() * 1000) / elapsedMs << "bytes/s)";
+    delete d;
+}
+
+bool DirectoryEraser::removeTree(const QString &path)
+{
+    return d->run(QStringList { path }, true);
+}
+
+bool DirectoryEraser::removeTrees(const QStringList &paths)
+{
+    return d->run(paths, true);
+}
+
+bool DirectoryEraser::removeContents(const QString &path, const QStringList &preserve)
+{
+    return d->run(QStringList { path }, false, preserve);
+}
+
+qint64 DirectoryEraser::removedFiles() const
+{
+    return d->removedFiles.loadAcquire();
+}
+
+qint64 DirectoryEraser::removedDirectories() const
+{
+    return d->removedDirectories.loadAcquire();
+}
+
+qint64 DirectoryEraser::removedBytes() const
+{
+    return d->removedBytes.loadAcquire();
+}
+
+int DirectoryEraser::failures() const
+{
+    return d->failures.loadAcquire();
+}
+
+qint64 DirectoryEraser::elapsed() const
+{
+    return d->elapsed;
+}
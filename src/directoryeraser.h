@@ -0,0 +1,33 @@
+#ifndef DIRECTORYERASER_H_
+#define DIRECTORYERASER_H_
+
+#include <QtCore/QStringList>
+
+class DirectoryEraser
+{
+public:
+    /// Subdirectories are handed to up to @p threadCount threads, QThread::idealThreadCount() if 0.
+    explicit DirectoryEraser(int threadCount = 0);
+    ~DirectoryEraser();
+
+    /// Removes @p path and everything below it.
+    bool removeTree(const QString &path);
+    /// Removes all of @p paths and everything below them, sharing the thread pool between the trees.
+    bool removeTrees(const QStringList &paths);
+    /// Removes everything below @p path but the top level entries named in @p preserve, leaving the directory itself in place.
+    bool removeContents(const QString &path, const QStringList &preserve = QStringList());
+
+    qint64 removedFiles() const;
+    qint64 removedDirectories() const;
+    qint64 removedBytes() const;
+    int failures() const;
+    qint64 elapsed() const;
+
+private:
+    Q_DISABLE_COPY(DirectoryEraser)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
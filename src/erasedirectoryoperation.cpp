@@ -1,34 +1,91 @@
 #include "erasedirectoryoperation.h"
 
+#include "devicewaitoperation.h"
+#include "directoryeraser.h"
+#include "mountmanager.h"
+#include "processlauncher.h"
+
 #include <QtCore/QDir>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QHash>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonObject>
 #include <QtCore/QLoggingCategory>
-#include <QtCore/QProcess>
-#include <QtCore/QTemporaryDir>
-#include <QtCore/QThread>
+#include <QtCore/QRegExp>
+#include <QtCore/QSharedPointer>
 
 #include <HemeraCore/Literals>
 
 #include <unistd.h>
 
-#define MOUNT_PATH "/bin/mount"
-#define UMOUNT_PATH "/bin/umount"
+#define BLKID_PATH "/sbin/blkid"
+#define MKFS_PATH "/sbin/mkfs."
 
 Q_LOGGING_CATEGORY(eraseDirOperationDC, "com.ispirata.Hemera.FlashUtility.Logging.EraseDirectoryOperation")
 
+#define DEVICE_WAIT_TIMEOUT 10000
+
+namespace {
+
+struct ErasePattern {
+    QList< QRegExp > components;
+    bool directoriesOnly;
+};
+
+// relative_paths entries are shell globs, each component matching files and directories alike.
+ErasePattern globPattern(const QString &pattern)
+{
+    ErasePattern compiled { QList< QRegExp >(), false };
+    for (const QString &component : pattern.split(QDir::separator(), QString::SkipEmptyParts)) {
+        compiled.components.append(QRegExp(component, Qt::CaseSensitive, QRegExp::Wildcard));
+    }
+    return compiled;
+}
+
+// relative_path keeps its historic meaning: '*' in intermediate components only, and the last one names a directory.
+ErasePattern literalPattern(const QString &pattern)
+{
+    ErasePattern compiled { QList< QRegExp >(), true };
+    QStringList components = pattern.split(QDir::separator(), QString::SkipEmptyParts);
+    for (int i = 0; i < components.count(); ++i) {
+        bool wildcard = i < components.count() - 1 && components.at(i).contains(QLatin1Char('*'));
+        compiled.components.append(QRegExp(components.at(i), Qt::CaseSensitive, wildcard ? QRegExp::Wildcard : QRegExp::FixedString));
+    }
+    return compiled;
+}
+
+}
+
 class EraseDirectoryOperation::Private
 {
 public:
-    Private() {}
+    Private(EraseDirectoryOperation *q)
+        : q(q)
+        , mountManager(nullptr)
+    {}
 
-    void removeAll(QDir baseDir, QString path);
+    void removeMatching(DirectoryEraser &eraser, const QString &rootPath);
+    void reformat(const QString &device);
+    void format(const QString &device, const QByteArray &blkidOutput);
+    void onReformatted(bool success);
+
+    void onDeviceReady();
+    void onMounted(bool success);
+
+    EraseDirectoryOperation * const q;
+
+    QString target;
+    QStringList relativePaths;
+    QString relativePath;
+    QStringList preserve;
+    MountManager *mountManager;
+    QMetaObject::Connection reformatConnection;
 };
 
 EraseDirectoryOperation::EraseDirectoryOperation(const QString &id, QObject *parent)
     : RootOperation(id, parent)
-    , d(new Private)
+    , d(new Private(this))
 {
 }
 
@@ -38,136 +95,250 @@ EraseDirectoryOperation::~EraseDirectoryOperation()
 }
 
 
-void EraseDirectoryOperation::Private::removeAll(QDir baseDir, QString path)
+void EraseDirectoryOperation::Private::removeMatching(DirectoryEraser &eraser, const QString &rootPath)
 {
-    QStringList splitPath;
-    QString cleanPath;
-    if (path.startsWith(QDir::separator())) {
-        cleanPath = path.mid(1);
-    } else {
-        cleanPath = path;
+    // Compile every pattern once, one expression per path component.
+    QList< ErasePattern > compiled;
+    for (const QString &pattern : relativePaths) {
+        compiled.append(globPattern(pattern));
+    }
+    if (!relativePath.isEmpty()) {
+        compiled.append(literalPattern(relativePath));
+    }
+    for (int i = compiled.count() - 1; i >= 0; --i) {
+        if (compiled.at(i).components.isEmpty()) {
+            compiled.removeAt(i);
+        }
     }
-    splitPath = cleanPath.split(QDir::separator());
-    QString currentTok = splitPath.at(0);
 
-    if (splitPath.count() == 1) {
-        if (baseDir.exists(currentTok)) {
-            if (!baseDir.cd(currentTok)) {
-                qCWarning(eraseDirOperationDC) << "Failed to change directory from " << baseDir.path() << " to " << currentTok << " for removal.";
-                return;
-            }
-            if (!baseDir.removeRecursively()) {
-                qCWarning(eraseDirOperationDC) << "Cannot remove " << baseDir.absolutePath() << " directory recursively.";
+    // Each directory to visit carries the (pattern, component) pairs its entries still have to match.
+    typedef QPair< int, int > PatternState;
+    QList< PatternState > initialStates;
+    for (int i = 0; i < compiled.count(); ++i) {
+        initialStates.append(qMakePair(i, 0));
+    }
+
+    QList< QPair< QString, QList< PatternState > > > pending { qMakePair(rootPath, initialStates) };
+    QStringList matchedTrees;
+    while (!pending.isEmpty()) {
+        QString path = pending.first().first;
+        QList< PatternState > states = pending.takeFirst().second;
+
+        for (const QFileInfo &entry : QDir(path).entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System)) {
+            QString name = entry.fileName();
+            QList< PatternState > nextStates;
+            bool matched = false;
+
+            bool isDirectory = entry.isDir() && !entry.isSymLink();
+            for (const PatternState &state : states) {
+                const ErasePattern &pattern = compiled.at(state.first);
+                QRegExp &component = compiled[state.first].components[state.second];
+                // Like the shell, wildcards don't match hidden entries.
+                if (name.startsWith(QLatin1Char('.')) && !component.pattern().startsWith(QLatin1Char('.'))) {
+                    continue;
+                }
+                if (!component.exactMatch(name)) {
+                    continue;
+                }
+                if (state.second == pattern.components.count() - 1) {
+                    if (isDirectory || !pattern.directoriesOnly) {
+                        matched = true;
+                        break;
+                    }
+                    continue;
+                }
+                nextStates.append(qMakePair(state.first, state.second + 1));
             }
-            return;
 
-        } else {
-            return;
+            if (matched) {
+                if (isDirectory) {
+                    matchedTrees.append(entry.absoluteFilePath());
+                } else if (!QFile::remove(entry.absoluteFilePath())) {
+                    qCWarning(eraseDirOperationDC) << "Cannot remove " << entry.absoluteFilePath();
+                }
+            } else if (isDirectory && !nextStates.isEmpty()) {
+                pending.append(qMakePair(entry.absoluteFilePath(), nextStates));
+            }
         }
     }
 
-    QStringList dirsList;
-    if (currentTok.contains(QLatin1Char('*'))) {
-        dirsList = baseDir.entryList(QStringList() << currentTok, QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks);
+    qCInfo(eraseDirOperationDC) << compiled.count() << "patterns matched" << matchedTrees.count() << "directories";
+    if (!eraser.removeTrees(matchedTrees)) {
+        qCWarning(eraseDirOperationDC) << "Could not remove" << eraser.failures() << "entries.";
+    }
+}
 
-    } else {
-        if (baseDir.exists(currentTok)) {
-            dirsList << currentTok;
-        } else {
+void EraseDirectoryOperation::Private::reformat(const QString &device)
+{
+    QSharedPointer<QByteArray> output(new QByteArray);
+    ProcessLauncher *blkid = new ProcessLauncher(QStringLiteral(BLKID_PATH), QStringList { QStringLiteral("-o"), QStringLiteral("export"), device }, q);
+    blkid->setOutputObserver([output] (int channel, const QByteArray &data) {
+        if (channel == 0) {
+            output->append(data);
+        }
+    });
+    QObject::connect(blkid, &Hemera::Operation::finished, q, [this, blkid, device, output] {
+        if (blkid->isError()) {
+            qCWarning(eraseDirOperationDC) << "Could not identify filesystem on" << device << ":" << blkid->errorMessage();
+            onReformatted(false);
             return;
         }
+        format(device, *output);
+    });
+    blkid->start();
+}
+
+void EraseDirectoryOperation::Private::format(const QString &device, const QByteArray &blkidOutput)
+{
+    QHash< QString, QString > properties;
+    for (const QByteArray &line : blkidOutput.split('\n')) {
+        int separator = line.indexOf('=');
+        if (separator > 0) {
+            properties.insert(QString::fromLatin1(line.left(separator)), QString::fromUtf8(line.mid(separator + 1)));
+        }
     }
 
-    for (QString item : dirsList) {
-       QDir nextDir(baseDir);
-       if (!nextDir.cd(item)) {
-           qCWarning(eraseDirOperationDC) << "Failed to change directory from " << baseDir << " to " << item;
-           return;
-       }
-       QString newPath = cleanPath.mid(currentTok.length());
+    QString filesystem = properties.value(QStringLiteral("TYPE"));
+    QString label = properties.value(QStringLiteral("LABEL"));
+    QString uuid = properties.value(QStringLiteral("UUID"));
 
-       //TODO: get rid of recursion
-       removeAll(nextDir, newPath);
+    // Recreate the filesystem with the same identity, so that mounts by label or UUID keep working.
+    QStringList mkfsArgs;
+    if (filesystem.startsWith(QStringLiteral("ext"))) {
+        mkfsArgs << QStringLiteral("-F") << QStringLiteral("-q");
+        if (!label.isEmpty()) {
+            mkfsArgs << QStringLiteral("-L") << label;
+        }
+        if (!uuid.isEmpty()) {
+            mkfsArgs << QStringLiteral("-U") << uuid;
+        }
+    } else if (filesystem == QStringLiteral("vfat")) {
+        if (!label.isEmpty()) {
+            mkfsArgs << QStringLiteral("-n") << label;
+        }
+        if (!uuid.isEmpty()) {
+            // blkid reports the volume id as XXXX-XXXX
+            mkfsArgs << QStringLiteral("-i") << uuid.remove(QLatin1Char('-'));
+        }
+    } else {
+        qCInfo(eraseDirOperationDC) << "Can't reformat" << filesystem << "filesystems, falling back to deletion.";
+        onReformatted(false);
+        return;
     }
+    mkfsArgs << device;
+
+    qCInfo(eraseDirOperationDC) << "Reformatting" << device << "as" << filesystem << "with label" << label << "and UUID" << uuid;
+
+    ProcessLauncher *mkfs = new ProcessLauncher(QStringLiteral("%1%2").arg(QStringLiteral(MKFS_PATH), filesystem), mkfsArgs, q);
+    mkfs->setLogTag(QStringLiteral("mkfs"));
+    QObject::connect(mkfs, &Hemera::Operation::finished, q, [this, mkfs, device] {
+        if (mkfs->isError()) {
+            qCWarning(eraseDirOperationDC) << "mkfs failed on" << device << ":" << mkfs->errorMessage();
+        } else {
+            qCInfo(eraseDirOperationDC) << "Reformatted" << device << "in" << mkfs->runTime() << "ms";
+        }
+        onReformatted(!mkfs->isError());
+    });
+    mkfs->start();
 }
 
-void EraseDirectoryOperation::startImpl()
+void EraseDirectoryOperation::Private::onReformatted(bool success)
 {
-    // Create a temporary dir for mounting
-    QTemporaryDir dir(QStringLiteral("/tmp/erasedirectory-XXXXXX"));
-    if (!dir.isValid()) {
-        qCWarning(eraseDirOperationDC) << "Could not create temporary directory: " << dir.errorString();
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                             QStringLiteral("Could not create mountpoint temporary directory."));
+    if (success) {
+        sync();
+        q->setFinished();
         return;
     }
 
-    // Mount the device
-    QProcess *mountDevice = new QProcess(this);
-
-    QString diskByLabel = QStringLiteral("/dev/disk/by-label/%1").arg(parameters().value(QStringLiteral("filesystem_label")).toString());
-    QString target;
-    if (!diskByLabel.endsWith(QStringLiteral("/")) && QFile::exists(diskByLabel)) {
-        target = diskByLabel;
-    } else {
-        target = parameters().value(QStringLiteral("target")).toString();
-    }
+    QObject::connect(mountManager, &MountManager::mountFinished, q, [this] (bool success) { onMounted(success); });
+    mountManager->mount();
+}
 
-    qCInfo(eraseDirOperationDC) << "Going to mount: " << target;
+void EraseDirectoryOperation::Private::onDeviceReady()
+{
+    mountManager = new MountManager(target, q);
 
-    if (!QFile::exists(target)) {
-        qCWarning(eraseDirOperationDC) << "Target disk doesn't exist, trying to wait 10 more seconds";
-        QThread::sleep(10);
+    // Wiping a whole partition is much faster by recreating the filesystem, unless something has to survive.
+    if (relativePaths.isEmpty() && relativePath.isEmpty() && preserve.isEmpty() &&
+        q->parameters().value(QStringLiteral("wipe_mode")).toString() == QStringLiteral("reformat")) {
+        // A previous operation might have left it mounted for us. Falling back to deletion releases it again, hence one shot.
+        reformatConnection = QObject::connect(mountManager, &MountManager::releaseFinished, q, [this] {
+            QObject::disconnect(reformatConnection);
+            reformat(target);
+        });
+        mountManager->release(false);
+        return;
     }
 
-    mountDevice->start(QStringLiteral(MOUNT_PATH), QStringList { target, dir.path() });
-    // Wait for finished.
-    mountDevice->waitForFinished();
-    if ((mountDevice->exitStatus() != QProcess::NormalExit) || (mountDevice->exitCode() != 0)) {
-        qCWarning(eraseDirOperationDC) << "Could not mount target device for erasing!! reason: " << mountDevice->readAllStandardError();
-        qCWarning(eraseDirOperationDC) << "mount exit status: " << mountDevice->exitStatus();
-        qCWarning(eraseDirOperationDC) << "mount exit code: " << mountDevice->exitCode();
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                             QStringLiteral("Could not mount target device for erasing."));
+    // Mount the device
+    QObject::connect(mountManager, &MountManager::mountFinished, q, [this] (bool success) { onMounted(success); });
+    mountManager->mount();
+}
+
+void EraseDirectoryOperation::Private::onMounted(bool success)
+{
+    if (!success) {
+        qCWarning(eraseDirOperationDC) << "Could not mount target device for erasing!! reason: " << mountManager->errorString();
+        q->setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                                QStringLiteral("Could not mount target device for erasing."));
         return;
     }
 
     // Get QDir
-    QString relativePath = parameters().value(QStringLiteral("relative_path")).toString();
-    if (!relativePath.isEmpty()) {
-        qCInfo(eraseDirOperationDC) << "Going to remove: " << relativePath << " from: " << dir.path();
-        // Recursively remove and live happily.
-        d->removeAll(QDir(dir.path()), relativePath);
+    DirectoryEraser eraser;
+    if (!relativePaths.isEmpty() || !relativePath.isEmpty()) {
+        qCInfo(eraseDirOperationDC) << "Going to remove: " << relativePaths << relativePath << " from: " << mountManager->mountPoint();
+        removeMatching(eraser, mountManager->mountPoint());
 
     } else {
-        QDir dirToErase(QStringLiteral("%1/%2").arg(dir.path(), relativePath));
-        qCInfo(eraseDirOperationDC) << "Iteratively erase directory: " << dirToErase.absolutePath();
-        // We can't really erase the mountpoint. Use a different approach.
-        dirToErase.setFilter(QDir::NoDotAndDotDot | QDir::Files);
-        for (const QString &dirItem : dirToErase.entryList()) {
-            dirToErase.remove(dirItem);
+        qCInfo(eraseDirOperationDC) << "Iteratively erase directory: " << mountManager->mountPoint();
+        // We can't really erase the mountpoint, only what's inside.
+        if (!eraser.removeContents(mountManager->mountPoint(), preserve)) {
+            qCWarning(eraseDirOperationDC) << "Could not remove" << eraser.failures() << "entries from" << mountManager->mountPoint();
         }
+    }
 
-        dirToErase.setFilter(QDir::NoDotAndDotDot | QDir::Dirs);
-        for (const QString &dirItem : dirToErase.entryList()) {
-            QDir subDir(dirToErase.absoluteFilePath(dirItem));
-            subDir.removeRecursively();
-        }
+    // Unmount the device unless the next action needs it too, and ignore possible errors.
+    QObject::connect(mountManager, &MountManager::releaseFinished, q, [this] {
+        q->setFinished();
+    });
+    mountManager->release(q->parameters().value(QStringLiteral("keep_mounted")).toBool(false));
+}
+
+void EraseDirectoryOperation::startImpl()
+{
+    // The label link is what we wait for when there is one: udev creates it after the node, if at all.
+    QString label = parameters().value(QStringLiteral("filesystem_label")).toString();
+    if (!label.isEmpty()) {
+        d->target = QStringLiteral("/dev/disk/by-label/%1").arg(label);
+    } else {
+        d->target = parameters().value(QStringLiteral("target")).toString();
     }
 
-    // Unmount the device, and ignore possible errors.
-    QProcess *unmountDevice = new QProcess(this);
-    unmountDevice->start(QStringLiteral(UMOUNT_PATH), QStringList { dir.path() });
-    // Wait for finished. We don't care about the outcome.
-    unmountDevice->waitForFinished();
-    if ((unmountDevice->exitStatus() != QProcess::NormalExit) || (unmountDevice->exitCode() != EXIT_SUCCESS)) {
-        qCWarning(eraseDirOperationDC) << "Umount for " << dir.path() << " has failed with exit code: " << unmountDevice->exitCode();
-        unmountDevice->start(QStringLiteral(UMOUNT_PATH), QStringList { dir.path(), QStringLiteral("-o"), QStringLiteral("remount,ro") });
+    for (const QJsonValue &pattern : parameters().value(QStringLiteral("relative_paths")).toArray()) {
+        d->relativePaths.append(pattern.toString());
     }
+    d->relativePath = parameters().value(QStringLiteral("relative_path")).toString();
 
-    sync();
+    for (const QJsonValue &entry : parameters().value(QStringLiteral("preserve")).toArray()) {
+        d->preserve.append(entry.toString());
+    }
+
+    qCInfo(eraseDirOperationDC) << "Going to mount: " << d->target;
 
-    setFinished();
+    // Resume as soon as the node shows up. If it doesn't, mounting will tell what's wrong.
+    DeviceWaitOperation *waitOperation = new DeviceWaitOperation(d->target, DEVICE_WAIT_TIMEOUT, this);
+    connect(waitOperation, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        if (operation->isError()) {
+            qCWarning(eraseDirOperationDC) << "Target disk doesn't exist:" << operation->errorMessage();
+            QString fallback = parameters().value(QStringLiteral("target")).toString();
+            if (!fallback.isEmpty() && fallback != d->target) {
+                qCInfo(eraseDirOperationDC) << "Falling back to" << fallback;
+                d->target = fallback;
+            }
+        }
+        d->onDeviceReady();
+    });
 }
 
 ROOT_OPERATION_WORKER(EraseDirectoryOperation, "com.ispirata.Hemera.FlashUtility.EraseDirectoryOperation")
@@ -0,0 +1,359 @@
+#include "filecopier.h"
+
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define COPY_CHUNK_SIZE (1024 * 1024)
+#define TEMPORARY_SUFFIX ".flashutility-tmp"
+// Left free on top of the temporary copies, for metadata and whatever else writes to the filesystem.
+#define TEMPORARY_SPACE_MARGIN (1024 * 1024)
+
+Q_LOGGING_CATEGORY(fileCopierDC, "com.ispirata.Hemera.FlashUtility.Logging.FileCopier")
+
+namespace {
+
+enum class CopyMethod {
+    CopyFileRange,
+    SendFile,
+    ReadWrite
+};
+
+// Returns the bytes copied, 0 at end of file, -1 with errno set on failure.
+qint64 copyChunk(CopyMethod method, int sourceFd, int destinationFd, qint64 length, QByteArray &buffer)
+{
+    switch (method) {
+        case CopyMethod::CopyFileRange:
+#ifdef SYS_copy_file_range
+            return syscall(SYS_copy_file_range, sourceFd, nullptr, destinationFd, nullptr, length, 0);
+#else
+            errno = ENOSYS;
+            return -1;
+#endif
+        case CopyMethod::SendFile:
+            return sendfile(destinationFd, sourceFd, nullptr, length);
+        case CopyMethod::ReadWrite:
+        default: {
+            buffer.resize(COPY_CHUNK_SIZE);
+            qint64 readBytes = read(sourceFd, buffer.data(), qMin(length, static_cast<qint64>(buffer.size())));
+            if (readBytes <= 0) {
+                return readBytes;
+            }
+            for (qint64 written = 0; written < readBytes;) {
+                qint64 result = write(destinationFd, buffer.constData() + written, readBytes - written);
+                if (result < 0) {
+                    return -1;
+                }
+                written += result;
+            }
+            return readBytes;
+        }
+    }
+}
+
+QByteArray hashFile(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(&file);
+    return hash.result();
+}
+
+// The kernel refuses the faster paths across some filesystem combinations: try the next one.
+bool isUnsupported(int error)
+{
+    return error == EXDEV || error == ENOSYS || error == EINVAL || error == EOPNOTSUPP;
+}
+
+}
+
+class FileCopier::Private
+{
+public:
+    class CopyTask;
+
+    Private()
+        : incremental(false)
+        , copiedBytes(0)
+        , skippedFiles(0)
+        , elapsed(0)
+        , reservedBytes(0)
+    {}
+
+    bool isUpToDate(const QString &source, const QString &destination) const;
+    bool reserveSpace(const QString &destination, qint64 size);
+    void releaseSpace(qint64 size);
+    /// Returns 0, or the errno the copy failed with.
+    int writeCopy(int sourceFd, qint64 size, const QString &path, mode_t mode, qint64 *copied, CopyMethod *method);
+    bool copyFile(const QString &source, const QString &destination);
+
+    QThreadPool pool;
+    QList< QPair< QString, QString > > files;
+    bool incremental;
+    QMutex failedFilesMutex;
+    QStringList failedFiles;
+    QAtomicInteger<qint64> copiedBytes;
+    QAtomicInt skippedFiles;
+    qint64 elapsed;
+    QMutex reservedBytesMutex;
+    qint64 reservedBytes;
+};
+
+class FileCopier::Private::CopyTask : public QRunnable
+{
+public:
+    CopyTask(Private *copier, const QString &source, const QString &destination)
+        : m_copier(copier)
+        , m_source(source)
+        , m_destination(destination)
+    {}
+
+    void run() Q_DECL_OVERRIDE
+    {
+        if (m_copier->incremental && m_copier->isUpToDate(m_source, m_destination)) {
+            qCDebug(fileCopierDC) << m_destination << "is up to date";
+            m_copier->skippedFiles.ref();
+            return;
+        }
+        if (!m_copier->copyFile(m_source, m_destination)) {
+            QMutexLocker locker(&m_copier->failedFilesMutex);
+            m_copier->failedFiles.append(m_source);
+        }
+    }
+
+private:
+    Private *m_copier;
+    QString m_source;
+    QString m_destination;
+};
+
+bool FileCopier::Private::isUpToDate(const QString &source, const QString &destination) const
+{
+    // Sizes are cheap to compare, only hash when they match.
+    struct stat sourceStat;
+    struct stat destinationStat;
+    if (stat(QFile::encodeName(source).constData(), &sourceStat) != 0 ||
+        stat(QFile::encodeName(destination).constData(), &destinationStat) != 0 ||
+        sourceStat.st_size != destinationStat.st_size) {
+        return false;
+    }
+
+    QByteArray sourceHash = hashFile(source);
+    return !sourceHash.isEmpty() && sourceHash == hashFile(destination);
+}
+
+bool FileCopier::Private::reserveSpace(const QString &destination, qint64 size)
+{
+    struct statvfs filesystem;
+    QByteArray directory = QFile::encodeName(QFileInfo(destination).absolutePath());
+    if (statvfs(directory.constData(), &filesystem) != 0) {
+        return false;
+    }
+
+    // Other copies in flight hold their temporary files too.
+    QMutexLocker locker(&reservedBytesMutex);
+    qint64 available = static_cast<qint64>(filesystem.f_bavail) * filesystem.f_frsize - reservedBytes;
+    if (available < size + TEMPORARY_SPACE_MARGIN) {
+        return false;
+    }
+    reservedBytes += size;
+    return true;
+}
+
+void FileCopier::Private::releaseSpace(qint64 size)
+{
+    QMutexLocker locker(&reservedBytesMutex);
+    reservedBytes -= size;
+}
+
+int FileCopier::Private::writeCopy(int sourceFd, qint64 size, const QString &path, mode_t mode, qint64 *copied, CopyMethod *method)
+{
+    int destinationFd = ::open(QFile::encodeName(path).constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (destinationFd < 0) {
+        return errno;
+    }
+
+    // Reserve the space upfront, so that the filesystem can lay the file out contiguously. It's only a hint.
+    if (size > 0 && fallocate(destinationFd, 0, 0, size) != 0) {
+        qCDebug(fileCopierDC) << "Could not preallocate" << path << ":" << strerror(errno);
+    }
+
+    *method = CopyMethod::CopyFileRange;
+    *copied = 0;
+    QByteArray buffer;
+    int error = 0;
+    while (*copied < size) {
+        qint64 result = copyChunk(*method, sourceFd, destinationFd, qMin(size - *copied, Q_INT64_C(1) << 30), buffer);
+        if (result < 0 && *copied == 0 && isUnsupported(errno) && *method != CopyMethod::ReadWrite) {
+            *method = static_cast<CopyMethod>(static_cast<int>(*method) + 1);
+            continue;
+        } else if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            break;
+        } else if (result == 0) {
+            // Shrunk while copying
+            break;
+        }
+        *copied += result;
+    }
+
+    if (error == 0 && (ftruncate(destinationFd, *copied) != 0 || fsync(destinationFd) != 0)) {
+        error = errno;
+    }
+    if (::close(destinationFd) != 0 && error == 0) {
+        error = errno;
+    }
+    return error;
+}
+
+bool FileCopier::Private::copyFile(const QString &source, const QString &destination)
+{
+    int sourceFd = ::open(QFile::encodeName(source).constData(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0) {
+        qCWarning(fileCopierDC) << "Could not open" << source << ":" << strerror(errno);
+        return false;
+    }
+
+    struct stat sourceStat;
+    if (fstat(sourceFd, &sourceStat) != 0) {
+        qCWarning(fileCopierDC) << "Could not stat" << source << ":" << strerror(errno);
+        ::close(sourceFd);
+        return false;
+    }
+
+    // Never leave a half written destination behind: readers either see the old file or the new one.
+    // That takes room for both meanwhile, small partitions get the file overwritten in place instead.
+    QString temporaryDestination = destination + QStringLiteral(TEMPORARY_SUFFIX);
+    bool replace = reserveSpace(destination, sourceStat.st_size);
+    if (!replace) {
+        qCDebug(fileCopierDC) << "Not enough room for a temporary copy of" << destination << ", overwriting it in place";
+    }
+
+    qint64 copied = 0;
+    CopyMethod method = CopyMethod::CopyFileRange;
+    int error = writeCopy(sourceFd, sourceStat.st_size, replace ? temporaryDestination : destination, sourceStat.st_mode & 0777, &copied, &method);
+    if (replace && error == ENOSPC) {
+        qCDebug(fileCopierDC) << "Ran out of room for a temporary copy of" << destination << ", overwriting it in place";
+        ::unlink(QFile::encodeName(temporaryDestination).constData());
+        releaseSpace(sourceStat.st_size);
+        replace = false;
+        if (lseek(sourceFd, 0, SEEK_SET) == 0) {
+            error = writeCopy(sourceFd, sourceStat.st_size, destination, sourceStat.st_mode & 0777, &copied, &method);
+        }
+    }
+    ::close(sourceFd);
+
+    if (error != 0) {
+        qCWarning(fileCopierDC) << "Could not copy" << source << "to" << destination << ":" << strerror(error);
+    } else if (replace && ::rename(QFile::encodeName(temporaryDestination).constData(), QFile::encodeName(destination).constData()) != 0) {
+        error = errno;
+        qCWarning(fileCopierDC) << "Could not replace" << destination << ":" << strerror(error);
+    } else if (replace) {
+        // The rename itself is only durable once the directory is on disk.
+        int directoryFd = ::open(QFile::encodeName(QFileInfo(destination).absolutePath()).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (directoryFd < 0 || fsync(directoryFd) != 0) {
+            qCWarning(fileCopierDC) << "Could not flush the directory of" << destination << ":" << strerror(errno);
+        }
+        if (directoryFd >= 0) {
+            ::close(directoryFd);
+        }
+    }
+
+    if (replace) {
+        releaseSpace(sourceStat.st_size);
+        if (error != 0) {
+            ::unlink(QFile::encodeName(temporaryDestination).constData());
+        }
+    }
+    if (error != 0) {
+        return false;
+    }
+
+    qCDebug(fileCopierDC) << "Copied" << copied << "bytes from" << source << "to" << destination << "using method" << (int) method;
+    copiedBytes.fetchAndAddRelaxed(copied);
+    return true;
+}
+
+FileCopier::FileCopier(int threadCount)
+    : d(new Private)
+{
+    if (threadCount > 0) {
+        d->pool.setMaxThreadCount(threadCount);
+    }
+}
+
+FileCopier::~FileCopier()
+{
+    delete d;
+}
+
+void FileCopier::addFile(const QString &source, const QString &destination)
+{
+    d->files.append(qMakePair(source, destination));
+}
+
+void FileCopier::setIncremental(bool incremental)
+{
+    d->incremental = incremental;
+}
+
+bool FileCopier::copy()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    for (const QPair< QString, QString > &file : d->files) {
+        d->pool.start(new Private::CopyTask(d, file.first, file.second));
+    }
+    d->files.clear();
+    d->pool.waitForDone();
+
+    d->elapsed += timer.elapsed();
+    qCInfo(fileCopierDC) << "Copied" << d->copiedBytes.loadAcquire() << "bytes in" << d->elapsed << "ms ("
+                         << (d->copiedBytes.loadAcquire() * 1000) / qMax(d->elapsed, Q_INT64_C(1)) << "bytes/s),"
+                         << d->skippedFiles.loadAcquire() << "files were up to date";
+
+    return d->failedFiles.isEmpty();
+}
+
+QStringList FileCopier::failedFiles() const
+{
+    return d->failedFiles;
+}
+
+int FileCopier::skippedFiles() const
+{
+    return d->skippedFiles.loadAcquire();
+}
+
+qint64 FileCopier::copiedBytes() const
+{
+    return d->copiedBytes.loadAcquire();
+}
+
+qint64 FileCopier::elapsed() const
+{
+    return d->elapsed;
+}
@@ -0,0 +1,35 @@
+#ifndef FILECOPIER_H_
+#define FILECOPIER_H_
+
+#include <QtCore/QStringList>
+
+class FileCopier
+{
+public:
+    /// Files are copied by up to @p threadCount threads at once, QThread::idealThreadCount() if 0.
+    explicit FileCopier(int threadCount = 0);
+    ~FileCopier();
+
+    void addFile(const QString &source, const QString &destination);
+
+    /// Leaves alone destinations whose size and content already match their source.
+    void setIncremental(bool incremental);
+
+    /// Copies all the files added so far, in kernel space whenever the filesystems allow it.
+    /// Each destination is written to a temporary file first, and renamed over the old one once complete,
+    /// unless the filesystem has no room for both: then it's overwritten in place.
+    bool copy();
+
+    QStringList failedFiles() const;
+    int skippedFiles() const;
+    qint64 copiedBytes() const;
+    qint64 elapsed() const;
+
+private:
+    Q_DISABLE_COPY(FileCopier)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
@@ -1,11 +1,25 @@
 #include "flasheraseoperation.h"
 
+#include "badblockmap.h"
+#include "processlauncher.h"
+#include "progressreporter.h"
+#include "tooloutputparser.h"
+
 #include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QJsonObject>
-#include <QtCore/QProcess>
+#include <QtCore/QSharedPointer>
 
 #include <HemeraCore/Literals>
 
+#include <mtd/mtd-user.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
 #define FLASH_ERASE_PATH "/usr/sbin/flash_erase"
 
 class FlashEraseOperation::Private
@@ -13,17 +27,77 @@ class FlashEraseOperation::Private
 public:
     Private()
         : isJFFS2(false),
-          success(false),
-          process(nullptr)
+          success(false)
     {}
     bool isJFFS2;
     QString startBlock;
     int blockCount;
     bool success;
     QString device;
-    QProcess *process;
+
+    bool erase(QString *errorMessage);
 };
 
+bool FlashEraseOperation::Private::erase(QString *errorMessage)
+{
+    BadBlockMap badBlocks(device);
+    if (!badBlocks.isValid()) {
+        *errorMessage = badBlocks.errorString();
+        return false;
+    }
+
+    bool ok;
+    qint64 start = startBlock.toLongLong(&ok, 0);
+    if (!ok || start % badBlocks.eraseSize() != 0) {
+        *errorMessage = QStringLiteral("Start offset %1 is not eraseblock aligned").arg(startBlock);
+        return false;
+    }
+
+    // As with flash_erase, a count of 0 means up to the end of the device, and bad blocks count too.
+    int firstBlock = start / badBlocks.eraseSize();
+    int lastBlock = blockCount > 0 ? qMin(firstBlock + blockCount, badBlocks.blockCount()) : badBlocks.blockCount();
+
+    int fd = ::open(device.toLatin1().constData(), O_RDWR);
+    if (fd < 0) {
+        *errorMessage = QStringLiteral("Could not open %1: %2").arg(device, QString::fromLatin1(strerror(errno)));
+        return false;
+    }
+
+    ProgressReporter progress(device);
+    progress.setTotal(lastBlock - firstBlock);
+
+    QElapsedTimer timer;
+    timer.start();
+    int erasedBlocks = 0;
+    int skippedBlocks = 0;
+
+    for (int block = firstBlock; block < lastBlock; ++block) {
+        if (badBlocks.isBad(block)) {
+            ++skippedBlocks;
+            continue;
+        }
+
+        erase_info_user eraseInfo;
+        eraseInfo.start = block * badBlocks.eraseSize();
+        eraseInfo.length = badBlocks.eraseSize();
+        if (ioctl(fd, MEMERASE, &eraseInfo) != 0) {
+            qWarning() << "Failed to erase block" << block << "of" << device << ", marking it bad:" << strerror(errno);
+            if (!badBlocks.markBad(block)) {
+                qWarning() << "Block" << block << "is only skipped for this run:" << badBlocks.errorString();
+            }
+            ++skippedBlocks;
+            continue;
+        }
+
+        ++erasedBlocks;
+        progress.setCompleted(block - firstBlock + 1);
+    }
+
+    ::close(fd);
+    qDebug() << "Erased" << erasedBlocks << "blocks of" << device << "in" << timer.elapsed() << "ms, skipped" << skippedBlocks << "bad blocks.";
+    return true;
+}
+
 FlashEraseOperation::FlashEraseOperation(const QString &id, QObject *parent)
     : RootOperation(id, parent)
     , d(new Private)
@@ -42,7 +116,18 @@ void FlashEraseOperation::startImpl()
     d->blockCount = parameters().value(QStringLiteral("count")).toInt();
     d->device = parameters().value(QStringLiteral("target")).toString();
 
-    d->process = new QProcess(this);
+    // JFFS2 cleanmarkers are left to flash_erase.
+    if (!d->isJFFS2 && parameters().value(QStringLiteral("native")).toBool(true)) {
+        QString errorMessage;
+        d->success = d->erase(&errorMessage);
+        if (d->success) {
+            setFinished();
+        } else {
+            qWarning() << errorMessage;
+            setFinishedWithError(QStringLiteral("flash_erase_failed"), errorMessage);
+        }
+        return;
+    }
 
     QStringList args;
     if (d->isJFFS2) {
@@ -52,9 +137,9 @@ void FlashEraseOperation::startImpl()
     args << d->startBlock;
     args << QString::number(d->blockCount);
 
-    QObject::connect(d->process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-                     this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        d->success = ((exitStatus == QProcess::NormalExit) && (exitCode == 0));
+    ProcessLauncher *launcher = new ProcessLauncher(QStringLiteral(FLASH_ERASE_PATH), args, this);
+    QObject::connect(launcher, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        d->success = !operation->isError();
         if (d->success) {
             setFinished();
         } else {
@@ -63,15 +148,14 @@ void FlashEraseOperation::startImpl()
                                  return;
         }
     });
-    connect(d->process, &QProcess::readyReadStandardOutput, this, [this] () {
-        qDebug() << d->process->readAllStandardOutput();
-    });
-    connect(d->process, &QProcess::readyReadStandardError, this, [this] () {
-        qDebug() << d->process->readAllStandardError();
+    // flash_erase prints how far it got, which the progress bar can show.
+    QSharedPointer<ToolOutputParser> parser(ToolOutputParser::create(QStringLiteral("flash_erase"), d->device));
+    launcher->setOutputObserver([parser] (int channel, const QByteArray &data) {
+        parser->feed(channel, data);
     });
 
     qDebug() << "Launching: " FLASH_ERASE_PATH " " << args;
-    d->process->start(QStringLiteral(FLASH_ERASE_PATH), args);
+    launcher->start();
 }
 
 ROOT_OPERATION_WORKER(FlashEraseOperation, "com.ispirata.Hemera.FlashUtility.FlashEraseOperation")
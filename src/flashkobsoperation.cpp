@@ -1,9 +1,13 @@
 #include "flashkobsoperation.h"
 
+#include "badblockmap.h"
+#include "processlauncher.h"
+#include "tooloutputparser.h"
+
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
 #include <QtCore/QJsonObject>
-#include <QtCore/QProcess>
+#include <QtCore/QSharedPointer>
 
 #include <HemeraCore/Literals>
 
@@ -13,13 +17,11 @@ class FlashKobsOperation::Private
 {
 public:
     Private()
-        : process(nullptr),
-          searchExponent(2),
+        : searchExponent(2),
           success(false)
     {}
     QString device;
     QString image;
-    QProcess *process;
     int searchExponent;
     bool success;
 };
@@ -53,20 +55,42 @@ void FlashKobsOperation::startImpl()
         return;
     }
 
-    d->process = new QProcess(this);
-    d->process->setWorkingDirectory(QStringLiteral("/tmp"));
+    // kobs-ng does its own scan, but the shared map lets us refuse early if a boot stream copy can't fit.
+    BadBlockMap badBlocks(d->device);
+    if (badBlocks.isValid() && badBlocks.size() > 4 * (Q_INT64_C(1) << d->searchExponent) * badBlocks.eraseSize()) {
+        qint64 searchAreaSize = (Q_INT64_C(1) << d->searchExponent) * badBlocks.eraseSize();
+        qint64 firstBootStream = 2 * searchAreaSize;
+        qint64 maxBootStreamSize = ((badBlocks.size() - firstBootStream) / 2 / badBlocks.eraseSize()) * badBlocks.eraseSize();
+        qint64 bootStreamBlocks = (QFile(d->image).size() + 1024 + badBlocks.eraseSize() - 1) / badBlocks.eraseSize();
+
+        qDebug() << "Bad blocks in" << d->device << ": FCB/DBBT" << badBlocks.badBlockCount(0, firstBootStream)
+                 << ", first boot stream" << badBlocks.badBlockCount(firstBootStream, maxBootStreamSize)
+                 << ", second boot stream" << badBlocks.badBlockCount(firstBootStream + maxBootStreamSize, maxBootStreamSize);
+
+        for (qint64 bootStream = firstBootStream; bootStream < firstBootStream + 2 * maxBootStreamSize; bootStream += maxBootStreamSize) {
+            qint64 goodBlocks = (maxBootStreamSize / badBlocks.eraseSize()) - badBlocks.badBlockCount(bootStream, maxBootStreamSize);
+            if (goodBlocks < bootStreamBlocks) {
+                setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                                     QStringLiteral("Not enough good blocks for the boot stream at %1").arg(bootStream));
+                return;
+            }
+        }
+    } else if (!badBlocks.isValid()) {
+        qWarning() << "Could not read bad block map:" << badBlocks.errorString();
+    }
 
     QStringList args {QStringLiteral("init"), QStringLiteral("-x"), d->image, QStringLiteral("--search_exponent=%1").arg(d->searchExponent), QStringLiteral("-v") };
 
-    connect(d->process, &QProcess::readyReadStandardOutput, this, [this] () {
-        qDebug() << d->process->readAllStandardOutput();
-    });
-    connect(d->process, &QProcess::readyReadStandardError, this, [this] () {
-        qDebug() << d->process->readAllStandardError();
+    // Each search area block gets a copy of the FCB and of the DBBT, then come both boot streams.
+    QSharedPointer<ToolOutputParser> parser(ToolOutputParser::create(QStringLiteral("kobs-ng"), d->device));
+    parser->setTotal(2 * (1 << d->searchExponent) + 2);
+    ProcessLauncher *launcher = new ProcessLauncher(QStringLiteral(KOBS_PATH), args, this);
+    launcher->setWorkingDirectory(QStringLiteral("/tmp"));
+    launcher->setOutputObserver([parser] (int channel, const QByteArray &data) {
+        parser->feed(channel, data);
     });
-    QObject::connect(d->process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-                     this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        d->success = ((exitStatus == QProcess::NormalExit) && (exitCode == 0));
+    QObject::connect(launcher, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        d->success = !operation->isError();
         if (d->success) {
             setFinished();
         } else {
@@ -76,7 +100,7 @@ void FlashKobsOperation::startImpl()
         }
     });
     qDebug() << "Launching: " KOBS_PATH " " << args;
-    d->process->start(QStringLiteral(KOBS_PATH), args);
+    launcher->start();
 }
 
 ROOT_OPERATION_WORKER(FlashKobsOperation, "com.ispirata.Hemera.FlashUtility.FlashKobsOperation")
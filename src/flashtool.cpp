@@ -1,9 +1,16 @@
 #include "flashtool.h"
 
+#include "conditionaloperation.h"
 #include "imagechecksumoperation.h"
+#include "logsink.h"
+#include "progressmonitor.h"
+#include "scriptscheduler.h"
+#include "udevsettleoperation.h"
 
 #include <QtCore/QDebug>
+#include <QtCore/QDir>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QJsonDocument>
 #include <QtCore/QJsonObject>
@@ -20,14 +27,65 @@
 
 #include <unistd.h>
 
+// Extra blocks erased past each boot stream copy, kobs-ng skips bad blocks while writing it.
+#define KOBS_SPARE_BLOCKS 4
+#define REBOOT_SETTLE_TIMEOUT 10000
+#define REBOOT_MESSAGE_DELAY 2000
+
 Q_LOGGING_CATEGORY(flashToolDC, "com.ispirata.Hemera.FlashUtility.Logging.FlashTool")
 
+namespace {
+
+// The disk a partition belongs to according to sysfs, or the device itself if it's not a partition.
+QString parentDisk(const QString &device)
+{
+    QString canonicalPath = QFileInfo(device).canonicalFilePath();
+    QString name = QFileInfo(canonicalPath.isEmpty() ? device : canonicalPath).fileName();
+    QString sysPath = QStringLiteral("/sys/class/block/%1").arg(name);
+    if (!QFile::exists(QStringLiteral("%1/partition").arg(sysPath))) {
+        return QStringLiteral("/dev/%1").arg(name);
+    }
+    return QStringLiteral("/dev/%1").arg(QFileInfo(QFileInfo(sysPath).canonicalFilePath()).dir().dirName());
+}
+
+qint64 readMtdAttribute(const QString &device, const QString &attribute)
+{
+    QFile attributeFile(QStringLiteral("/sys/class/mtd/%1/%2").arg(device.mid(device.lastIndexOf(QLatin1Char('/')) + 1), attribute));
+    if (!attributeFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return -1;
+    }
+
+    bool ok;
+    qint64 value = attributeFile.readAll().trimmed().toLongLong(&ok);
+    return ok ? value : -1;
+}
+
+}
+
 FlashTool::FlashTool(Mode mode, QObject *parent)
     : QObject(parent)
     , m_rebootWhenFinished(false)
     , m_mode(mode)
     , m_installMediaType(InstallMediaType::Other)
+    , m_progressMonitor(new ProgressMonitor(this))
 {
+    // Progress reported by root operations is shown along with the message of the running step.
+    connect(this, &FlashTool::statusUpdate, this, [this] (const QJsonObject &jsonMessage) {
+        if (!jsonMessage.contains(QStringLiteral("progress"))) {
+            m_currentMessage = jsonMessage.value(QStringLiteral("message")).toString();
+        }
+    });
+    connect(m_progressMonitor, &ProgressMonitor::event, this, [this] (const QJsonObject &event) {
+        if (event.value(QStringLiteral("unchanged")).toBool(false)) {
+            m_unchangedDisks.append(event.value(QStringLiteral("target")).toString());
+        }
+        if (event.contains(QStringLiteral("progress"))) {
+            Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), m_currentMessage },
+                                             { QStringLiteral("busy"), true },
+                                             { QStringLiteral("progress"), event.value(QStringLiteral("progress")) } });
+        }
+    });
+
     qInfo(flashToolDC) << "Reboot when finished: " << m_rebootWhenFinished;
     qInfo(flashToolDC) << "Running in mode: " << (int) m_mode;
     qInfo(flashToolDC) << "Install media type: " << (int) m_installMediaType;
@@ -38,38 +96,144 @@ FlashTool::~FlashTool()
 
 }
 
+void FlashTool::appendEraseOperation(QList<Hemera::Operation *> &operations, const QString &device, qint64 start, int blockCount)
+{
+    QJsonObject args {{QStringLiteral("start"),QString::number(start)},{QStringLiteral("count"),blockCount},
+                      {QStringLiteral("target"),device},{QStringLiteral("jffs2"),false}};
+    Hemera::RootOperationClient *eraseOp = new Hemera::RootOperationClient(QStringLiteral("com.ispirata.Hemera.FlashUtility.FlashEraseOperation"),
+                                                                           args, Hemera::Operation::ExplicitStartOption, this);
+    operations.append(eraseOp);
+    connect(eraseOp, &Hemera::Operation::started, this, [this] {
+        Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Erasing flash...") },
+                                         { QStringLiteral("busy"), true } });
+    });
+    connect(eraseOp, &Hemera::Operation::finished, this, [this] {
+        Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Flash erased successfully.") } });
+    });
+}
+
+bool FlashTool::isActionEnabled(const QJsonObject &action) const
+{
+    switch (m_mode) {
+        case Mode::FullFlash:
+            if (!action.value(QStringLiteral("run_on_full_flash")).toBool(true)) {
+                return false;
+            }
+            break;
+        case Mode::PartialFlash:
+            if (!action.value(QStringLiteral("run_on_partial_flash")).toBool(false)) {
+                return false;
+            }
+            break;
+    }
+
+    switch (m_installMediaType) {
+        case InstallMediaType::RecoveryPartition:
+            if (!action.value(QStringLiteral("run_in_recovery_mode")).toBool(true)) {
+                qDebug() << "Skipping action since in recovery mode:" << action;
+                return false;
+            }
+            break;
+        default:
+            break;
+    }
+
+    return true;
+}
+
+bool FlashTool::mergeEraseDirectoryAction(QJsonObject &previous, const QJsonObject &action)
+{
+    static const QString eraseDirectoryType = QStringLiteral("erase_directory");
+    if (previous.value(QStringLiteral("type")).toString() != eraseDirectoryType ||
+        action.value(QStringLiteral("type")).toString() != eraseDirectoryType) {
+        return false;
+    }
+
+    // Only the patterns may differ: anything else, e.g. preserve or wipe_mode, would be lost in the merge.
+    auto withoutPatterns = [] (QJsonObject eraseAction) {
+        eraseAction.remove(QStringLiteral("relative_path"));
+        eraseAction.remove(QStringLiteral("relative_paths"));
+        return eraseAction;
+    };
+    if (withoutPatterns(previous) != withoutPatterns(action)) {
+        return false;
+    }
+
+    // Whole partition wipes have their own semantics, leave them alone.
+    QString relativePath = previous.value(QStringLiteral("relative_path")).toString();
+    QString newRelativePath = action.value(QStringLiteral("relative_path")).toString();
+    QJsonArray patterns = previous.value(QStringLiteral("relative_paths")).toArray();
+    QJsonArray newPatterns = action.value(QStringLiteral("relative_paths")).toArray();
+    if ((relativePath.isEmpty() && patterns.isEmpty()) || (newRelativePath.isEmpty() && newPatterns.isEmpty())) {
+        return false;
+    }
+
+    // relative_path doesn't mean the same as a relative_paths glob, and there's room for one only.
+    if (!relativePath.isEmpty() && !newRelativePath.isEmpty()) {
+        return false;
+    }
+
+    for (const QJsonValue &pattern : newPatterns) {
+        patterns.append(pattern);
+    }
+    if (!newRelativePath.isEmpty()) {
+        previous.insert(QStringLiteral("relative_path"), newRelativePath);
+    }
+    if (!patterns.isEmpty()) {
+        previous.insert(QStringLiteral("relative_paths"), patterns);
+    }
+    return true;
+}
+
 QList<Hemera::Operation *> FlashTool::prepareActions(const QJsonArray &actions)
 {
     QList<Hemera::Operation *> operations;
     qDebug() << "Preparing actions!";
 
+    // Consecutive erase_directory actions on the same device share a single mount and traversal.
+    QList<QJsonObject> enabledActions;
     for (const QJsonValue &jsonValue : actions) {
         QJsonObject action = jsonValue.toObject();
-
-        switch (m_mode) {
-            case Mode::FullFlash:
-                if (!action.value(QStringLiteral("run_on_full_flash")).toBool(true)) {
-                    continue;
-                }
-                break;
-            case Mode::PartialFlash:
-                if (!action.value(QStringLiteral("run_on_partial_flash")).toBool(false)) {
-                    continue;
-                }
-                break;
+        if (!isActionEnabled(action)) {
+            continue;
+        }
+        if (!enabledActions.isEmpty() && mergeEraseDirectoryAction(enabledActions.last(), action)) {
+            qCInfo(flashToolDC) << "Merged erase_directory action into the previous one:" << enabledActions.last();
+            continue;
         }
+        enabledActions.append(action);
+    }
 
-        switch (m_installMediaType) {
-            case InstallMediaType::RecoveryPartition:
-                if (!action.value(QStringLiteral("run_in_recovery_mode")).toBool(true)) {
-                    qDebug() << "Skipping action since in recovery mode:" << action;
-                    continue;
-                }
-                break;
-            default:
+    // Keep filesystems mounted while the actions right after need them, up to the first one touching raw devices.
+    auto mountKey = [] (const QJsonObject &action) -> QString {
+        static const QStringList filesystemActions { QStringLiteral("erase_directory"), QStringLiteral("copy_recovery") };
+        if (!filesystemActions.contains(action.value(QStringLiteral("type")).toString())) {
+            return QString();
+        }
+        // Actions may name the same partition by label or by node: compare the block devices behind them.
+        QString label = action.value(QStringLiteral("filesystem_label")).toString();
+        QString device = label.isEmpty() ? action.value(QStringLiteral("target")).toString()
+                                         : QStringLiteral("/dev/disk/by-label/%1").arg(label);
+        QString canonicalPath = QFileInfo(device).canonicalFilePath();
+        return canonicalPath.isEmpty() ? device : canonicalPath;
+    };
+    for (int i = 0; i < enabledActions.count(); ++i) {
+        QString key = mountKey(enabledActions.at(i));
+        if (key.isEmpty()) {
+            continue;
+        }
+        bool keepMounted = false;
+        for (int j = i + 1; j < enabledActions.count() && !keepMounted; ++j) {
+            QString nextKey = mountKey(enabledActions.at(j));
+            if (nextKey.isEmpty()) {
                 break;
+            }
+            keepMounted = nextKey == key;
         }
+        enabledActions[i].insert(QStringLiteral("keep_mounted"), keepMounted);
+    }
 
+    for (QJsonObject action : enabledActions) {
         QString actionType = action.value(QStringLiteral("type")).toString();
         qDebug() << "Will run action of type" << actionType;
 
@@ -113,6 +277,10 @@ QList<Hemera::Operation *> FlashTool::prepareActions(const QJsonArray &actions)
             operationId = QStringLiteral("com.ispirata.Hemera.FlashUtility.UBIUpdateVolOperation");
             progressMessage = QStringLiteral("Writing image to NAND...");
             successMessage = QStringLiteral("Image written successfully.");
+        } else if (actionType == QStringLiteral("ubi_volumes")) {
+            operationId = QStringLiteral("com.ispirata.Hemera.FlashUtility.UBIUpdateVolOperation");
+            progressMessage = QStringLiteral("Writing UBI volumes to NAND...");
+            successMessage = QStringLiteral("UBI volumes written successfully.");
         } else if (actionType == QStringLiteral("nandwrite")) {
             // Do we need to erase just a portion?
             QString device = action.value(QStringLiteral("target")).toString();
@@ -129,18 +297,7 @@ QList<Hemera::Operation *> FlashTool::prepareActions(const QJsonArray &actions)
                 start = QStringLiteral("0");
             }
 
-            QJsonObject args {{QStringLiteral("start"),start},{QStringLiteral("count"),blockCount},
-                              {QStringLiteral("target"),device},{QStringLiteral("jffs2"),false}};
-            Hemera::RootOperationClient *eraseOp = new Hemera::RootOperationClient(QStringLiteral("com.ispirata.Hemera.FlashUtility.FlashEraseOperation"),
-                                                                                   args, Hemera::Operation::ExplicitStartOption, this);
-            operations.append(eraseOp);
-            connect(eraseOp, &Hemera::Operation::started, this, [this] {
-                Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Erasing flash...") },
-                                                 { QStringLiteral("busy"), true } });
-            });
-            connect(eraseOp, &Hemera::Operation::finished, this, [this] {
-                Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Flash erased successfully.") } });
-            });
+            appendEraseOperation(operations, device, start.toLongLong(nullptr, 0), blockCount);
 
             operationId = QStringLiteral("com.ispirata.Hemera.FlashUtility.NANDWriteOperation");
             progressMessage = QStringLiteral("Writing image to NAND...");
@@ -151,21 +308,35 @@ QList<Hemera::Operation *> FlashTool::prepareActions(const QJsonArray &actions)
                 continue;
             }
 
-            // Set up the flasherase part, just wipe as it's always like that.
+            // Set up the flasherase part: only wipe what kobs-ng is going to write.
             QString device = action.value(QStringLiteral("target")).toString();
-
-            QJsonObject args {{QStringLiteral("start"), QStringLiteral("0")},{QStringLiteral("count"),0},
-                              {QStringLiteral("target"),device},{QStringLiteral("jffs2"),false}};
-            Hemera::RootOperationClient *eraseOp = new Hemera::RootOperationClient(QStringLiteral("com.ispirata.Hemera.FlashUtility.FlashEraseOperation"),
-                                                                                   args, Hemera::Operation::ExplicitStartOption, this);
-            operations.append(eraseOp);
-            connect(eraseOp, &Hemera::Operation::started, this, [this] {
-                Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Erasing flash...") },
-                                                 { QStringLiteral("busy"), true } });
-            });
-            connect(eraseOp, &Hemera::Operation::finished, this, [this] {
-                Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Flash erased successfully.") } });
-            });
+            qint64 eraseSize = readMtdAttribute(device, QStringLiteral("erasesize"));
+            qint64 deviceSize = readMtdAttribute(device, QStringLiteral("size"));
+            // kobs-ng -x adds 1k of padding in front of the image.
+            qint64 bootStreamSize = QFile(action.value(QStringLiteral("source")).toString()).size() + 1024;
+
+            if (eraseSize <= 0 || deviceSize <= 0) {
+                qCWarning(flashToolDC) << "Could not read geometry of" << device << ", erasing it entirely.";
+                appendEraseOperation(operations, device, 0, 0);
+            } else {
+                // FCB and DBBT search areas come first, each one stride (a block) times 2^search_exponent.
+                // The rest of the partition is split in two halves, one for each boot stream copy.
+                qint64 searchAreaSize = (Q_INT64_C(1) << action.value(QStringLiteral("search_exponent")).toInt(2)) * eraseSize;
+                qint64 firstBootStream = 2 * searchAreaSize;
+                qint64 maxBootStreamSize = ((deviceSize - firstBootStream) / 2 / eraseSize) * eraseSize;
+                qint64 bootStreamBlocks = qMin(((bootStreamSize + eraseSize - 1) / eraseSize) + KOBS_SPARE_BLOCKS,
+                                               maxBootStreamSize / eraseSize);
+
+                if (maxBootStreamSize <= 0) {
+                    appendEraseOperation(operations, device, 0, 0);
+                } else {
+                    qCInfo(flashToolDC) << "Erasing" << (2 * searchAreaSize / eraseSize) + (2 * bootStreamBlocks)
+                                        << "of" << deviceSize / eraseSize << "blocks of" << device << "for kobs-ng";
+                    appendEraseOperation(operations, device, 0, 2 * searchAreaSize / eraseSize);
+                    appendEraseOperation(operations, device, firstBootStream, bootStreamBlocks);
+                    appendEraseOperation(operations, device, firstBootStream + maxBootStreamSize, bootStreamBlocks);
+                }
+            }
 
             operationId = QStringLiteral("com.ispirata.Hemera.FlashUtility.FlashKobsOperation");
             progressMessage = QStringLiteral("Writing First-level Bootloader...");
@@ -181,6 +352,8 @@ QList<Hemera::Operation *> FlashTool::prepareActions(const QJsonArray &actions)
         } else if (actionType == QStringLiteral("restore_u-boot_environment")) {
             operationId = QStringLiteral("com.ispirata.Hemera.FlashUtility.UBootEnvUpdateOperation");
             action.insert(QStringLiteral("file"), QStringLiteral("/tmp/u-boot_backup"));
+            // Merged into the current environment, unless the action sets replace_environment or that is not valid.
+            action.insert(QStringLiteral("raw_file"), QStringLiteral("/tmp/u-boot_backup.bin"));
             progressMessage = QStringLiteral("Restoring boot environment...");
             successMessage = QStringLiteral("Environment restored successfully.");
         } else if (actionType == QStringLiteral("checksum")) {
@@ -205,7 +378,26 @@ QList<Hemera::Operation *> FlashTool::prepareActions(const QJsonArray &actions)
         }
 
         Hemera::RootOperationClient *clientOp = new Hemera::RootOperationClient(operationId, action, Hemera::Operation::ExplicitStartOption, this);
-        operations.append(clientOp);
+        if (actionType == QStringLiteral("mkfs") && m_mode == Mode::PartialFlash &&
+            action.value(QStringLiteral("skip_if_table_unchanged")).toBool(false)) {
+            // An unchanged table doesn't mean the filesystem is there: a previous run might have stopped right before it,
+            // so this is only for actions which ask for it.
+            QString target = action.value(QStringLiteral("target")).toString();
+            operations.append(new ConditionalOperation(clientOp, [this, target] {
+                // The partition table operation may have finished before we read its event.
+                m_progressMonitor->poll();
+                QString targetDisk = parentDisk(target);
+                for (const QString &disk : m_unchangedDisks) {
+                    if (!disk.isEmpty() && parentDisk(disk) == targetDisk) {
+                        qCInfo(flashToolDC) << "Partition table of" << disk << "is unchanged, not formatting" << target;
+                        return false;
+                    }
+                }
+                return true;
+            }, this));
+        } else {
+            operations.append(clientOp);
+        }
         connect(clientOp, &Hemera::Operation::started, this, [this, progressMessage] {
             Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), progressMessage },
                                              { QStringLiteral("busy"),true } });
@@ -277,16 +469,16 @@ void FlashTool::parseConfig()
 
     qDebug() << "Loaded operations:" << operations;
 
-    for (const QJsonValue &scriptValue : settings.value(QStringLiteral("scripts")).toArray()) {
-        QJsonObject script = scriptValue.toObject();
-        Hemera::RootOperationClient *toolOp = new Hemera::RootOperationClient(QStringLiteral("com.ispirata.Hemera.FlashUtility.ToolOperation"),
-                                                                                script, Hemera::Operation::ExplicitStartOption, this);
-        QString message = script.value(QStringLiteral("message")).toString();
-        operations.append(toolOp);
-        connect(toolOp, &Hemera::Operation::started, this, [this, message]() {
-            Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), message }, { QStringLiteral("busy"),true } });
+    // Scripts may run concurrently, each one's message shows up as it starts.
+    QJsonArray scripts = settings.value(QStringLiteral("scripts")).toArray();
+    if (!scripts.isEmpty()) {
+        ScriptScheduler *scriptScheduler = new ScriptScheduler(scripts, settings.value(QStringLiteral("script_timeout")).toInt(0), this);
+        operations.append(scriptScheduler);
+        connect(scriptScheduler, &ScriptScheduler::scriptStarted, this, [this] (const QJsonObject &script) {
+            Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), script.value(QStringLiteral("message")).toString() },
+                                             { QStringLiteral("busy"),true } });
         });
-        connect(toolOp, &Hemera::Operation::finished, this, [this] {
+        connect(scriptScheduler, &ScriptScheduler::scriptFinished, this, [this] {
             Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("OK") } });
         });
     }
@@ -297,38 +489,61 @@ void FlashTool::parseConfig()
     operations.append(new Hemera::SetSystemConfigOperation(QStringLiteral("hemera_recovery_boot"), QString::number(0),
                                                            Hemera::Operation::ExplicitStartOption, this));
 
+    qCInfo(flashToolDC) << "Tool output goes to" << LogSink::startRun();
+    m_progressMonitor->start();
+
     Hemera::SequentialOperation *flashSequence = new Hemera::SequentialOperation(operations, this);
     connect(flashSequence, &Hemera::Operation::finished, this, [this](Hemera::Operation *operation) {
-        if (!operation->isError()) {
-            sync();
-            Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Appliance correctly installed.") },
-                                             { QStringLiteral("busy"), false },
-                                             { QStringLiteral("iconUrl"), QStringLiteral("resource:///images/ok.png") } });
-
-            qCInfo(flashToolDC) << "Appliance correctly installed.";
-
-            if (m_rebootWhenFinished) {
-                QTimer::singleShot(10000, []() {
-                    qCInfo(flashToolDC) << "Rebooting.";
-                    // just to be sure...
-                    ::sync();
-                    Hemera::DeviceManagement::reboot();
-                });
+        m_progressMonitor->stop();
+
+        bool failed = operation->isError();
+        QString errorName = operation->errorName();
+        QString errorMessage = operation->errorMessage();
+
+        // Mounts kept for a following action are left behind if the run stopped before it: release them either way.
+        Hemera::RootOperationClient *releaseMounts = new Hemera::RootOperationClient(QStringLiteral("com.ispirata.Hemera.FlashUtility.ReleaseMountsOperation"),
+                                                                                     QJsonObject(), Hemera::Operation::ExplicitStartOption, this);
+        connect(releaseMounts, &Hemera::Operation::finished, this, [this, failed, errorName, errorMessage] (Hemera::Operation *operation) {
+            if (operation->isError()) {
+                qCWarning(flashToolDC) << "Could not release leftover mounts:" << operation->errorMessage();
             }
 
-        } else {
-            if (operation->errorMessage().isEmpty()) {
-                qWarning(flashToolDC) << "Failed due to error.";
-                Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Failed due to error.") },
+            if (!failed) {
+                sync();
+                Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Appliance correctly installed.") },
                                                  { QStringLiteral("busy"), false },
-                                                 { QStringLiteral("iconUrl"), QStringLiteral("resource:///images/error.png") } });
+                                                 { QStringLiteral("iconUrl"), QStringLiteral("resource:///images/ok.png") } });
+
+                qCInfo(flashToolDC) << "Appliance correctly installed.";
+
+                if (m_rebootWhenFinished) {
+                    // Let the last device events go through, then leave the message up just long enough to be read.
+                    UdevSettleOperation *settleOperation = new UdevSettleOperation(QString(), REBOOT_SETTLE_TIMEOUT, 10000 - REBOOT_MESSAGE_DELAY, this);
+                    connect(settleOperation, &Hemera::Operation::finished, this, [] {
+                        QTimer::singleShot(REBOOT_MESSAGE_DELAY, []() {
+                            qCInfo(flashToolDC) << "Rebooting.";
+                            // just to be sure...
+                            ::sync();
+                            Hemera::DeviceManagement::reboot();
+                        });
+                    });
+                }
+
             } else {
-                qWarning(flashToolDC) << "Failed due to error: " << operation->errorName() << " " << operation->errorMessage();
-                Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"),
-                                                   QStringLiteral("Failed: %1, %2.").arg(operation->errorName(), operation->errorMessage()) },
-                                                 { QStringLiteral("busy"), false },
-                                                 { QStringLiteral("iconUrl"), QStringLiteral("resource:///images/error.png") } });
+                if (errorMessage.isEmpty()) {
+                    qWarning(flashToolDC) << "Failed due to error.";
+                    Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"), QStringLiteral("Failed due to error.") },
+                                                     { QStringLiteral("busy"), false },
+                                                     { QStringLiteral("iconUrl"), QStringLiteral("resource:///images/error.png") } });
+                } else {
+                    qWarning(flashToolDC) << "Failed due to error: " << errorName << " " << errorMessage;
+                    Q_EMIT statusUpdate(QJsonObject{ { QStringLiteral("message"),
+                                                       QStringLiteral("Failed: %1, %2.").arg(errorName, errorMessage) },
+                                                     { QStringLiteral("busy"), false },
+                                                     { QStringLiteral("iconUrl"), QStringLiteral("resource:///images/error.png") } });
+                }
             }
-        }
+        });
+        releaseMounts->start();
     });
 }
@@ -2,8 +2,10 @@
 #define FLASHTOOL_H_
 
 #include <QtCore/QObject>
+#include <QtCore/QStringList>
 
 class QJsonObject;
+class ProgressMonitor;
 
 namespace Hemera
 {
@@ -33,11 +35,17 @@ Q_SIGNALS:
     void statusUpdate(const QJsonObject &jsonMessage);
 
 private:
+    bool isActionEnabled(const QJsonObject &action) const;
+    static bool mergeEraseDirectoryAction(QJsonObject &previous, const QJsonObject &action);
     QList<Hemera::Operation *> prepareActions(const QJsonArray &actions);
+    void appendEraseOperation(QList<Hemera::Operation *> &operations, const QString &device, qint64 start, int blockCount);
 
     Mode m_mode;
     InstallMediaType m_installMediaType;
     bool m_rebootWhenFinished;
+    ProgressMonitor *m_progressMonitor;
+    QString m_currentMessage;
+    QStringList m_unchangedDisks;
 };
 
 #endif
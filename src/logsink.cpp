@@ -0,0 +1,295 @@
+#include "logsink.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QProcess>
+#include <QtCore/QQueue>
+#include <QtCore/QThread>
+#include <QtCore/QWaitCondition>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Output kept in memory while the writer catches up, beyond this the oldest goes.
+#define LOG_SINK_CAPACITY (1024 * 1024)
+
+class LogSink::Private
+{
+public:
+    struct Record {
+        qint64 timestamp;
+        QByteArray tag;
+        QByteArray data;
+        // The producer is done: whatever is left of its last line can go.
+        bool endOfStream;
+    };
+
+    class Writer : public QThread
+    {
+    public:
+        Writer(LogSink::Private *d)
+            : d(d)
+        {}
+
+    protected:
+        virtual void run();
+
+    private:
+        LogSink::Private * const d;
+    };
+
+    Private()
+        : writer(this)
+        , queuedBytes(0)
+        , droppedBytes(0)
+        , unreportedDroppedBytes(0)
+        , writing(false)
+        , stopping(false)
+    {}
+
+    void enqueue(const Record &record);
+    QByteArray format(const Record &record);
+    QByteArray formatLine(qint64 timestamp, const QByteArray &tag, const QByteArray &line) const;
+    QByteArray formatPartialLines();
+
+    Writer writer;
+    mutable QMutex mutex;
+    QWaitCondition pending;
+    QWaitCondition idle;
+    QQueue<Record> queue;
+    qint64 queuedBytes;
+    qint64 droppedBytes;
+    qint64 unreportedDroppedBytes;
+    bool writing;
+    bool stopping;
+
+    // Only touched by the writer: lines still waiting for their end, by tag.
+    QHash<QByteArray, Record> partialLines;
+};
+
+void LogSink::Private::enqueue(const Record &record)
+{
+    QMutexLocker locker(&mutex);
+    queue.enqueue(record);
+    queuedBytes += record.data.size();
+    while (queuedBytes > LOG_SINK_CAPACITY && queue.count() > 1) {
+        qint64 size = queue.dequeue().data.size();
+        queuedBytes -= size;
+        droppedBytes += size;
+        unreportedDroppedBytes += size;
+    }
+    pending.wakeOne();
+}
+
+QByteArray LogSink::Private::format(const Record &record)
+{
+    // A line may come in several reads: only complete ones are written, the rest waits for more of the same tag.
+    QByteArray result;
+    Record &partial = partialLines[record.tag];
+    if (partial.data.isEmpty()) {
+        partial.timestamp = record.timestamp;
+    }
+    partial.data.append(record.data);
+
+    int lineStart = 0;
+    for (int i = 0; i < partial.data.size(); ++i) {
+        // Progress bars redraw with carriage returns, they read better as lines of their own.
+        if (partial.data.at(i) == '\n' || partial.data.at(i) == '\r') {
+            result.append(formatLine(partial.timestamp, record.tag, partial.data.mid(lineStart, i - lineStart)));
+            lineStart = i + 1;
+            partial.timestamp = record.timestamp;
+        }
+    }
+    partial.data.remove(0, lineStart);
+
+    if (record.endOfStream || partial.data.isEmpty()) {
+        result.append(formatLine(partial.timestamp, record.tag, partial.data));
+        partialLines.remove(record.tag);
+    }
+    return result;
+}
+
+QByteArray LogSink::Private::formatLine(qint64 timestamp, const QByteArray &tag, const QByteArray &line) const
+{
+    if (line.isEmpty()) {
+        return QByteArray();
+    }
+
+    QByteArray result = QDateTime::fromMSecsSinceEpoch(timestamp).toString(QStringLiteral("hh:mm:ss.zzz ")).toLatin1();
+    result.append(tag).append(": ").append(line).append('\n');
+    return result;
+}
+
+QByteArray LogSink::Private::formatPartialLines()
+{
+    QByteArray result;
+    for (QHash<QByteArray, Record>::const_iterator it = partialLines.constBegin(); it != partialLines.constEnd(); ++it) {
+        result.append(formatLine(it.value().timestamp, it.key(), it.value().data));
+    }
+    partialLines.clear();
+    return result;
+}
+
+void LogSink::Private::Writer::run()
+{
+    QDir().mkpath(QStringLiteral(LOG_SINK_PATH));
+    int fd = ::open(LOG_SINK_PATH "/current.log", O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+    // One write per batch, so that concurrent operations appending to the same log don't interleave within a line.
+    auto writeOutput = [fd] (const QByteArray &output) {
+        qint64 written = 0;
+        while (fd >= 0 && written < output.size()) {
+            ssize_t result = ::write(fd, output.constData() + written, output.size() - written);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            } else if (result <= 0) {
+                break;
+            }
+            written += result;
+        }
+    };
+
+    QMutexLocker locker(&d->mutex);
+    while (true) {
+        while (d->queue.isEmpty() && !d->stopping) {
+            d->pending.wait(&d->mutex);
+        }
+        if (d->queue.isEmpty()) {
+            break;
+        }
+
+        QQueue<Record> records;
+        records.swap(d->queue);
+        d->queuedBytes = 0;
+        qint64 dropped = d->unreportedDroppedBytes;
+        d->unreportedDroppedBytes = 0;
+        d->writing = true;
+        locker.unlock();
+
+        QByteArray output;
+        if (dropped > 0) {
+            output.append(QStringLiteral("%1 flashutility: %2 bytes of output dropped\n")
+                              .arg(QDateTime::currentDateTime().toString(QStringLiteral("hh:mm:ss.zzz"))).arg(dropped).toLatin1());
+        }
+        for (const Record &record : records) {
+            output.append(d->format(record));
+        }
+        writeOutput(output);
+
+        locker.relock();
+        d->writing = false;
+        d->idle.wakeAll();
+    }
+
+    locker.unlock();
+
+    // Nothing else is coming: lines their producers didn't get to end are still worth having.
+    writeOutput(d->formatPartialLines());
+
+    locker.relock();
+    d->idle.wakeAll();
+    locker.unlock();
+
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+LogSink::LogSink()
+    : d(new Private)
+{
+    d->writer.start(QThread::LowPriority);
+}
+
+LogSink::~LogSink()
+{
+    // The writer drains the queue before it stops, so the last output of the run makes it to disk.
+    flush();
+    {
+        QMutexLocker locker(&d->mutex);
+        d->stopping = true;
+        d->pending.wakeAll();
+    }
+    d->writer.wait();
+    delete d;
+}
+
+LogSink *LogSink::instance()
+{
+    static LogSink sink;
+    return &sink;
+}
+
+QString LogSink::startRun()
+{
+    QDir().mkpath(QStringLiteral(LOG_SINK_PATH));
+
+    QString fileName = QStringLiteral("run-%1.log").arg(QDateTime::currentDateTime().toString(QStringLiteral("yyyyMMdd-hhmmss")));
+    QString path = QStringLiteral(LOG_SINK_PATH "/%1").arg(fileName);
+    QFile runLog(path);
+    runLog.open(QIODevice::WriteOnly | QIODevice::Append);
+    runLog.close();
+
+    // Relative, so that the link keeps working wherever the directory is looked at from.
+    QFile::remove(QStringLiteral(LOG_SINK_PATH "/current.log"));
+    QFile::link(fileName, QStringLiteral(LOG_SINK_PATH "/current.log"));
+    return path;
+}
+
+void LogSink::attach(QProcess *process, const QString &tag, const std::function<void(int channel, const QByteArray &data)> &observer)
+{
+    QObject::connect(process, &QProcess::readyReadStandardOutput, process, [this, process, tag, observer] {
+        QByteArray data = process->readAllStandardOutput();
+        if (observer) {
+            observer(0, data);
+        }
+        append(tag, data);
+    });
+    attachErrors(process, tag, observer);
+}
+
+void LogSink::attachErrors(QProcess *process, const QString &tag, const std::function<void(int channel, const QByteArray &data)> &observer)
+{
+    QObject::connect(process, &QProcess::readyReadStandardError, process, [this, process, tag, observer] {
+        QByteArray data = process->readAllStandardError();
+        if (observer) {
+            observer(1, data);
+        }
+        append(tag, data);
+    });
+    QObject::connect(process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished), process, [this, tag] {
+        endStream(tag);
+    });
+}
+
+void LogSink::append(const QString &tag, const QByteArray &data)
+{
+    if (data.isEmpty()) {
+        return;
+    }
+
+    d->enqueue(Private::Record { QDateTime::currentMSecsSinceEpoch(), tag.toLatin1(), data, false });
+}
+
+void LogSink::endStream(const QString &tag)
+{
+    d->enqueue(Private::Record { QDateTime::currentMSecsSinceEpoch(), tag.toLatin1(), QByteArray(), true });
+}
+
+void LogSink::flush()
+{
+    QMutexLocker locker(&d->mutex);
+    while (!d->queue.isEmpty() || d->writing) {
+        d->idle.wait(&d->mutex);
+    }
+}
+
+qint64 LogSink::droppedBytes() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->droppedBytes;
+}
@@ -0,0 +1,46 @@
+#ifndef LOGSINK_H_
+#define LOGSINK_H_
+
+#include <QtCore/QString>
+
+#include <functional>
+
+class QProcess;
+
+// Output of every tool run by root operations ends up in current.log in here, which points to the log of the latest run.
+#define LOG_SINK_PATH "/tmp/flashutility-logs"
+
+/// Collects child process output in a bounded queue, written out with timestamps by a thread of its own.
+/// Appending never waits for the disk: if the writer falls behind, the oldest output is dropped and accounted for.
+class LogSink
+{
+public:
+    static LogSink *instance();
+
+    /// Starts a new log file for a flashing run and points current.log to it.
+    static QString startRun();
+
+    /// Logs both output channels of @p process under @p tag, showing everything to @p observer first if given,
+    /// along with the channel it came from: 0 for standard output, 1 for standard error.
+    void attach(QProcess *process, const QString &tag, const std::function<void(int channel, const QByteArray &data)> &observer = nullptr);
+    /// Logs only the standard error of @p process, for processes whose output is data.
+    void attachErrors(QProcess *process, const QString &tag, const std::function<void(int channel, const QByteArray &data)> &observer = nullptr);
+
+    void append(const QString &tag, const QByteArray &data);
+    /// Writes out the unterminated last line of @p tag, if any: its producer is done.
+    void endStream(const QString &tag);
+    /// Blocks until everything appended so far is on disk.
+    void flush();
+
+    qint64 droppedBytes() const;
+
+private:
+    LogSink();
+    ~LogSink();
+    Q_DISABLE_COPY(LogSink)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
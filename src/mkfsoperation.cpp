@@ -1,12 +1,12 @@
 #include "mkfsoperation.h"
 
+#include "processlauncher.h"
+
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QJsonObject>
 
-#include <QtCore/QProcess>
-
 #include <HemeraCore/Literals>
 
 #define MKFS_PATH "/sbin/mkfs."
@@ -48,24 +48,6 @@ void MkfsOperation::startImpl()
         return;
     }
 
-    // Detach and ignore output.
-    QProcess *mkfs = new QProcess(this);
-    connect(mkfs, &QProcess::readyReadStandardOutput, [mkfs] () {
-        qDebug() << mkfs->readAllStandardOutput();
-    });
-    connect(mkfs, &QProcess::readyReadStandardError, [mkfs] () {
-        qDebug() << mkfs->readAllStandardError();
-    });
-    QObject::connect(mkfs, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-                     this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        if ((exitStatus == QProcess::NormalExit) && (exitCode == 0)) {
-            setFinished();
-        } else {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                                 QStringLiteral("Failed to flash image."));
-        }
-    });
-
     QStringList mkfsArgs;
 
     if (parameters().contains(QStringLiteral("filesystem_label"))) {
@@ -79,8 +61,19 @@ void MkfsOperation::startImpl()
 
     mkfsArgs.append(d->device);
 
+    ProcessLauncher *mkfs = new ProcessLauncher(QStringLiteral("%1%2").arg(QStringLiteral(MKFS_PATH), d->filesystem), mkfsArgs, this);
+    mkfs->setLogTag(QStringLiteral("mkfs"));
+    QObject::connect(mkfs, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        if (!operation->isError()) {
+            setFinished();
+        } else {
+            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                                 QStringLiteral("Failed to flash image."));
+        }
+    });
+
     qDebug() << "Launching: " MKFS_PATH << d->filesystem << " " << mkfsArgs;
-    mkfs->start(QStringLiteral("%1%2").arg(QStringLiteral(MKFS_PATH), d->filesystem), mkfsArgs);
+    mkfs->start();
 }
 
 ROOT_OPERATION_WORKER(MkfsOperation, "com.ispirata.Hemera.FlashUtility.MkfsOperation")
@@ -0,0 +1,277 @@
+#include "mountmanager.h"
+
+#include "processlauncher.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QSharedPointer>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#define MOUNT_PATH "/bin/mount"
+#define UMOUNT_PATH "/bin/umount"
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define MOUNT_TIMINGS_PATH MOUNT_MANAGER_PATH "/timings.json"
+
+Q_LOGGING_CATEGORY(mountManagerDC, "com.ispirata.Hemera.FlashUtility.Logging.MountManager")
+
+namespace {
+
+// mountinfo escapes blanks and backslashes as octal sequences.
+QString unescapeMountInfo(const QByteArray &field)
+{
+    QByteArray result;
+    for (int i = 0; i < field.size(); ++i) {
+        if (field.at(i) == '\\' && i + 3 < field.size()) {
+            result.append(static_cast<char>(field.mid(i + 1, 3).toInt(nullptr, 8)));
+            i += 3;
+        } else {
+            result.append(field.at(i));
+        }
+    }
+    return QFile::decodeName(result);
+}
+
+QJsonObject loadTimings()
+{
+    QFile timingsFile(QStringLiteral(MOUNT_TIMINGS_PATH));
+    if (!timingsFile.open(QIODevice::ReadOnly)) {
+        return QJsonObject();
+    }
+    return QJsonDocument::fromJson(timingsFile.readAll()).object();
+}
+
+void saveTimings(const QJsonObject &timings)
+{
+    QFile timingsFile(QStringLiteral(MOUNT_TIMINGS_PATH));
+    if (timingsFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        timingsFile.write(QJsonDocument(timings).toJson(QJsonDocument::Compact));
+    }
+}
+
+}
+
+class MountManager::Private
+{
+public:
+    Private()
+        : owned(false)
+        , reused(false)
+    {}
+
+    QString deviceName() const;
+    QString findMountPoint() const;
+    void recordTiming(const QString &key, qint64 milliseconds) const;
+
+    QString device;
+    QString mountPoint;
+    QString errorString;
+    bool owned;
+    bool reused;
+};
+
+QString MountManager::Private::deviceName() const
+{
+    QString canonicalPath = QFileInfo(device).canonicalFilePath();
+    return QFileInfo(canonicalPath.isEmpty() ? device : canonicalPath).fileName();
+}
+
+QString MountManager::Private::findMountPoint() const
+{
+    struct stat deviceStat;
+    if (stat(QFile::encodeName(device).constData(), &deviceStat) != 0 || !S_ISBLK(deviceStat.st_mode)) {
+        return QString();
+    }
+
+    QFile mountInfo(QStringLiteral(MOUNTINFO_PATH));
+    if (!mountInfo.open(QIODevice::ReadOnly)) {
+        return QString();
+    }
+
+    QByteArray deviceNumber = QByteArray::number(major(deviceStat.st_rdev)) + ':' + QByteArray::number(minor(deviceStat.st_rdev));
+    // mount ID, parent ID, major:minor, root, mount point, ...
+    for (const QByteArray &line : mountInfo.readAll().split('\n')) {
+        QList<QByteArray> fields = line.split(' ');
+        if (fields.size() > 4 && fields.at(2) == deviceNumber && fields.at(3) == "/") {
+            return unescapeMountInfo(fields.at(4));
+        }
+    }
+
+    return QString();
+}
+
+void MountManager::Private::recordTiming(const QString &key, qint64 milliseconds) const
+{
+    QJsonObject timings = loadTimings();
+    QJsonObject deviceTimings = timings.value(deviceName()).toObject();
+    deviceTimings.insert(key, milliseconds);
+    timings.insert(deviceName(), deviceTimings);
+    saveTimings(timings);
+}
+
+MountManager::MountManager(const QString &device, QObject *parent)
+    : QObject(parent)
+    , d(new Private)
+{
+    d->device = device;
+}
+
+MountManager::~MountManager()
+{
+    delete d;
+}
+
+void MountManager::mount()
+{
+    QDir().mkpath(QStringLiteral(MOUNT_MANAGER_PATH));
+
+    d->mountPoint = d->findMountPoint();
+    if (!d->mountPoint.isEmpty()) {
+        // A previous operation kept it around for us: account for the round trip we skipped.
+        QJsonObject timings = loadTimings();
+        QJsonObject deviceTimings = timings.value(d->deviceName()).toObject();
+        qint64 saved = deviceTimings.value(QStringLiteral("mount_ms")).toInt() + deviceTimings.value(QStringLiteral("umount_ms")).toInt();
+        qint64 totalSaved = timings.value(QStringLiteral("saved_ms")).toInt() + saved;
+        timings.insert(QStringLiteral("saved_ms"), totalSaved);
+        saveTimings(timings);
+
+        qCInfo(mountManagerDC) << "Reusing mount of" << d->device << "at" << d->mountPoint << ", saved about" << saved
+                               << "ms (" << totalSaved << "ms in this run)";
+        d->reused = true;
+        d->owned = d->mountPoint.startsWith(QStringLiteral(MOUNT_MANAGER_PATH "/"));
+        Q_EMIT mountFinished(true);
+        return;
+    }
+
+    d->mountPoint = QStringLiteral(MOUNT_MANAGER_PATH "/%1").arg(d->deviceName());
+    if (!QDir().mkpath(d->mountPoint)) {
+        d->errorString = QStringLiteral("Could not create mountpoint %1").arg(d->mountPoint);
+        Q_EMIT mountFinished(false);
+        return;
+    }
+
+    QSharedPointer<QByteArray> errors(new QByteArray);
+    ProcessLauncher *mountProcess = new ProcessLauncher(QStringLiteral(MOUNT_PATH), QStringList { d->device, d->mountPoint }, this);
+    mountProcess->setOutputObserver([errors] (int channel, const QByteArray &data) {
+        if (channel == 1) {
+            errors->append(data);
+        }
+    });
+    connect(mountProcess, &Hemera::Operation::finished, this, [this, mountProcess, errors] {
+        if (mountProcess->isError()) {
+            d->errorString = QString::fromLocal8Bit(*errors).trimmed();
+            if (d->errorString.isEmpty()) {
+                d->errorString = mountProcess->errorMessage();
+            }
+            qCWarning(mountManagerDC) << "Could not mount" << d->device << "on" << d->mountPoint << ":" << d->errorString;
+            QDir().rmdir(d->mountPoint);
+            Q_EMIT mountFinished(false);
+            return;
+        }
+
+        d->recordTiming(QStringLiteral("mount_ms"), mountProcess->runTime());
+        d->owned = true;
+        qCDebug(mountManagerDC) << "Mounted" << d->device << "on" << d->mountPoint << "in" << mountProcess->runTime() << "ms";
+        Q_EMIT mountFinished(true);
+    });
+    mountProcess->start();
+}
+
+void MountManager::release(bool keepMounted)
+{
+    if (d->mountPoint.isEmpty()) {
+        d->mountPoint = d->findMountPoint();
+        d->owned = d->mountPoint.startsWith(QStringLiteral(MOUNT_MANAGER_PATH "/"));
+        if (d->mountPoint.isEmpty()) {
+            Q_EMIT releaseFinished(true);
+            return;
+        }
+    }
+
+    // Mounts we didn't make, e.g. by the system, are left alone.
+    if (keepMounted || !d->owned) {
+        // Whatever comes next, what we wrote must be on disk by now.
+        int fd = ::open(QFile::encodeName(d->mountPoint).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            syncfs(fd);
+            ::close(fd);
+        }
+        qCDebug(mountManagerDC) << "Keeping" << d->device << "mounted on" << d->mountPoint;
+        Q_EMIT releaseFinished(true);
+        return;
+    }
+
+    ProcessLauncher *umountProcess = new ProcessLauncher(QStringLiteral(UMOUNT_PATH), QStringList { d->mountPoint }, this);
+    connect(umountProcess, &Hemera::Operation::finished, this, [this, umountProcess] {
+        if (umountProcess->isError()) {
+            qCWarning(mountManagerDC) << "Umount for" << d->mountPoint << "has failed:" << umountProcess->errorMessage();
+            // Best effort, at least make sure nothing else gets written.
+            ProcessLauncher *remountProcess = new ProcessLauncher(QStringLiteral(UMOUNT_PATH),
+                                                                  QStringList { d->mountPoint, QStringLiteral("-o"), QStringLiteral("remount,ro") }, this);
+            remountProcess->start();
+            d->errorString = QStringLiteral("Could not unmount %1").arg(d->mountPoint);
+            Q_EMIT releaseFinished(false);
+            return;
+        }
+
+        d->recordTiming(QStringLiteral("umount_ms"), umountProcess->runTime());
+        if (d->owned) {
+            QDir().rmdir(d->mountPoint);
+        }
+        d->mountPoint.clear();
+        Q_EMIT releaseFinished(true);
+    });
+    umountProcess->start();
+}
+
+bool MountManager::isMounted() const
+{
+    return !d->findMountPoint().isEmpty();
+}
+
+QStringList MountManager::ownedMountPoints()
+{
+    QFile mountInfo(QStringLiteral(MOUNTINFO_PATH));
+    if (!mountInfo.open(QIODevice::ReadOnly)) {
+        return QStringList();
+    }
+
+    QStringList mountPoints;
+    for (const QByteArray &line : mountInfo.readAll().split('\n')) {
+        QList<QByteArray> fields = line.split(' ');
+        if (fields.size() > 4) {
+            QString mountPoint = unescapeMountInfo(fields.at(4));
+            if (mountPoint.startsWith(QStringLiteral(MOUNT_MANAGER_PATH "/"))) {
+                mountPoints.append(mountPoint);
+            }
+        }
+    }
+    return mountPoints;
+}
+
+QString MountManager::device() const
+{
+    return d->device;
+}
+
+QString MountManager::mountPoint() const
+{
+    return d->mountPoint;
+}
+
+QString MountManager::errorString() const
+{
+    return d->errorString;
+}
+
+bool MountManager::isReused() const
+{
+    return d->reused;
+}
@@ -0,0 +1,44 @@
+#ifndef MOUNTMANAGER_H_
+#define MOUNTMANAGER_H_
+
+#include <QtCore/QObject>
+#include <QtCore/QStringList>
+
+// Stable mountpoints, and the mount timings shared by all operations of a run.
+#define MOUNT_MANAGER_PATH "/tmp/flashutility-mounts"
+
+class MountManager : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MountManager)
+
+public:
+    explicit MountManager(const QString &device, QObject *parent = nullptr);
+    virtual ~MountManager();
+
+    /// Makes the filesystem on the device available, reusing a mount left behind by a previous operation if any.
+    void mount();
+    /// Unmounts the filesystem, or only flushes it if @p keepMounted because the next operation needs it too.
+    void release(bool keepMounted);
+
+    /// Whether the device is mounted anywhere, regardless of who mounted it.
+    bool isMounted() const;
+
+    /// Mountpoints of ours still mounted, e.g. kept for an action that never got to run.
+    static QStringList ownedMountPoints();
+
+    QString device() const;
+    QString mountPoint() const;
+    QString errorString() const;
+    bool isReused() const;
+
+Q_SIGNALS:
+    void mountFinished(bool success);
+    void releaseFinished(bool success);
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif
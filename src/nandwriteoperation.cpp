@@ -1,28 +1,200 @@
 #include "nandwriteoperation.h"
 
+#include "badblockmap.h"
+#include "processlauncher.h"
+#include "progressreporter.h"
+#include "tooloutputparser.h"
+
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
 #include <QtCore/QJsonObject>
-#include <QtCore/QProcess>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QThread>
 
 #include <HemeraCore/Literals>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <functional>
+
 #define NANDWRITE_PATH "/usr/sbin/nandwrite"
 
+namespace {
+
+// Vector type used to scan pages 16 bytes at a time. GCC lowers it to SSE2 or NEON where available.
+typedef quint8 PageVector __attribute__((vector_size(16)));
+
+bool isErasedPage(const char *data, int size)
+{
+    PageVector erased;
+    memset(&erased, 0xFF, sizeof(erased));
+
+    int offset = 0;
+    // Unrolled by 4: AND together 64 bytes, then check the accumulator once.
+    for (; offset + 4 * (int) sizeof(PageVector) <= size; offset += 4 * sizeof(PageVector)) {
+        PageVector v0, v1, v2, v3;
+        memcpy(&v0, data + offset, sizeof(PageVector));
+        memcpy(&v1, data + offset + sizeof(PageVector), sizeof(PageVector));
+        memcpy(&v2, data + offset + 2 * sizeof(PageVector), sizeof(PageVector));
+        memcpy(&v3, data + offset + 3 * sizeof(PageVector), sizeof(PageVector));
+        PageVector accumulator = v0 & v1 & v2 & v3;
+        if (memcmp(&accumulator, &erased, sizeof(PageVector)) != 0) {
+            return false;
+        }
+    }
+
+    for (; offset < size; ++offset) {
+        if (static_cast<quint8>(data[offset]) != 0xFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Runs the whole page loop, so that the worker's event loop keeps going meanwhile.
+class WriteThread : public QThread
+{
+public:
+    explicit WriteThread(const std::function<void()> &work)
+        : m_work(work)
+    {}
+
+    void run() Q_DECL_OVERRIDE
+    {
+        m_work();
+    }
+
+private:
+    std::function<void()> m_work;
+};
+
+}
+
 class NANDWriteOperation::Private
 {
 public:
     Private()
-        : process(nullptr),
-          success(false)
+        : success(false),
+          native(false),
+          skipEmptyPages(false),
+          skippedPages(0),
+          writtenPages(0),
+          writeThread(nullptr)
     {}
+
+    bool writeImage(QString *errorMessage);
+
     QString device;
     QString image;
     QString startOffset;
-    QProcess *process;
     bool success;
+    bool native;
+    bool skipEmptyPages;
+    qint64 skippedPages;
+    qint64 writtenPages;
+
+    QThread *writeThread;
+    QString writeError;
 };
 
+bool NANDWriteOperation::Private::writeImage(QString *errorMessage)
+{
+    QFile imageFile(image);
+    if (!imageFile.open(QIODevice::ReadOnly)) {
+        *errorMessage = QStringLiteral("Could not open image file %1").arg(image);
+        return false;
+    }
+
+    BadBlockMap badBlocks(device);
+    if (!badBlocks.isValid()) {
+        *errorMessage = badBlocks.errorString();
+        return false;
+    }
+
+    int fd = ::open(device.toLatin1().constData(), O_RDWR);
+    if (fd < 0) {
+        *errorMessage = QStringLiteral("Could not open NAND device %1: %2").arg(device, QString::fromLatin1(strerror(errno)));
+        return false;
+    }
+
+    qint64 pageSize = badBlocks.writeSize();
+    qint64 blockSize = badBlocks.eraseSize();
+
+    bool ok = true;
+    qint64 offset = startOffset.isEmpty() ? 0 : startOffset.toLongLong(&ok, 0);
+    if (!ok || (offset % pageSize) != 0) {
+        *errorMessage = QStringLiteral("Start offset %1 is not page aligned").arg(startOffset);
+        ::close(fd);
+        return false;
+    }
+
+    ProgressReporter progress(device);
+    progress.setTotal(imageFile.size());
+
+    QByteArray page(pageSize, '\xFF');
+    qint64 checkedBlock = -1;
+    qint64 blockImagePosition = 0;
+
+    while (!imageFile.atEnd()) {
+        if (offset >= badBlocks.size()) {
+            *errorMessage = QStringLiteral("Image %1 does not fit in %2").arg(image, device);
+            ::close(fd);
+            return false;
+        }
+
+        // Like nandwrite, skip bad blocks and keep writing in the next good one.
+        qint64 blockStart = offset - (offset % blockSize);
+        if (blockStart != checkedBlock) {
+            if (badBlocks.isBadAt(blockStart)) {
+                qDebug() << "Skipping bad block at" << blockStart;
+                offset = blockStart + blockSize;
+                continue;
+            }
+            checkedBlock = blockStart;
+            blockImagePosition = imageFile.pos();
+        }
+
+        // Pad the last page, as nandwrite -p would do.
+        page.fill('\xFF');
+        if (imageFile.read(page.data(), page.size()) < 0) {
+            *errorMessage = QStringLiteral("Could not read from image file %1").arg(image);
+            ::close(fd);
+            return false;
+        }
+
+        if (skipEmptyPages && isErasedPage(page.constData(), page.size())) {
+            ++skippedPages;
+        } else if (pwrite(fd, page.constData(), page.size(), offset) != page.size()) {
+            if (errno != EIO) {
+                *errorMessage = QStringLiteral("Failed to write page at %1: %2").arg(offset).arg(QString::fromLatin1(strerror(errno)));
+                ::close(fd);
+                return false;
+            }
+
+            // The block went bad under us: mark it, and rewrite its contents in the next one.
+            qWarning() << "Write failed at" << offset << ", marking block" << blockStart / blockSize << "bad";
+            if (!badBlocks.markBad(blockStart / blockSize)) {
+                qWarning() << "Block" << blockStart / blockSize << "is only skipped for this run:" << badBlocks.errorString();
+            }
+            imageFile.seek(blockImagePosition);
+            offset = blockStart + blockSize;
+            continue;
+        } else {
+            ++writtenPages;
+        }
+
+        offset += pageSize;
+        progress.setCompleted(imageFile.pos());
+    }
+
+    ::close(fd);
+    return true;
+}
+
 NANDWriteOperation::NANDWriteOperation(const QString &id, QObject *parent)
     : RootOperation(id, parent)
     , d(new Private)
@@ -31,6 +203,10 @@ NANDWriteOperation::NANDWriteOperation(const QString &id, QObject *parent)
 
 NANDWriteOperation::~NANDWriteOperation()
 {
+    if (d->writeThread) {
+        d->writeThread->wait();
+        delete d->writeThread;
+    }
     delete d;
 }
 
@@ -39,6 +215,9 @@ void NANDWriteOperation::startImpl()
     d->device = parameters().value(QStringLiteral("target")).toString();
     d->image = parameters().value(QStringLiteral("source")).toString();
     d->startOffset = parameters().value(QStringLiteral("start")).toString();
+    d->skipEmptyPages = parameters().value(QStringLiteral("skip_empty_pages")).toBool(false);
+    // nandwrite stays the default: the native writer is opt-in, and needed to skip empty pages.
+    d->native = parameters().value(QStringLiteral("native")).toBool(false) || d->skipEmptyPages;
 
     if (!QFile::exists(d->image)) {
         setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
@@ -52,7 +231,25 @@ void NANDWriteOperation::startImpl()
         return;
     }
 
-    d->process = new QProcess(this);
+    if (d->native) {
+        // Write the pages ourselves: bad blocks come from the shared map instead of yet another scan,
+        // and we know which empty pages have been skipped.
+        d->writeThread = new WriteThread([this] {
+            d->success = d->writeImage(&d->writeError);
+        });
+        connect(d->writeThread, &QThread::finished, this, [this] {
+            if (!d->success) {
+                qWarning() << d->writeError;
+                setFinishedWithError(QStringLiteral("nandwrite_failed"), d->writeError);
+                return;
+            }
+
+            qDebug() << "Written" << d->writtenPages << "pages, skipped" << d->skippedPages << "empty pages.";
+            setFinished();
+        }, Qt::QueuedConnection);
+        d->writeThread->start();
+        return;
+    }
 
     QStringList args;
     args << QStringLiteral("-p"); //It looks like a good idea to autopad images to blocksize. If the image is not padded it will fail.
@@ -63,15 +260,15 @@ void NANDWriteOperation::startImpl()
     }
     args << d->image;
 
-    connect(d->process, &QProcess::readyReadStandardOutput, this, [this] () {
-        qDebug() << d->process->readAllStandardOutput();
-    });
-    connect(d->process, &QProcess::readyReadStandardError, this, [this] () {
-        qDebug() << d->process->readAllStandardError();
+    // nandwrite prints the offset of each block it writes, but not where it will stop.
+    QSharedPointer<ToolOutputParser> parser(ToolOutputParser::create(QStringLiteral("nandwrite"), d->device));
+    parser->setTotal(QFile(d->image).size());
+    ProcessLauncher *launcher = new ProcessLauncher(QStringLiteral(NANDWRITE_PATH), args, this);
+    launcher->setOutputObserver([parser] (int channel, const QByteArray &data) {
+        parser->feed(channel, data);
     });
-    QObject::connect(d->process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-                     this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        d->success = ((exitStatus == QProcess::NormalExit) && (exitCode == 0));
+    QObject::connect(launcher, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        d->success = !operation->isError();
         if (d->success) {
             setFinished();
         } else {
@@ -81,7 +278,7 @@ void NANDWriteOperation::startImpl()
         }
     });
     qDebug() << "Launching: " NANDWRITE_PATH " " << args;
-    d->process->start(QStringLiteral(NANDWRITE_PATH), args);
+    launcher->start();
 }
 
 ROOT_OPERATION_WORKER(NANDWriteOperation, "com.ispirata.Hemera.FlashUtility.NANDWriteOperation")
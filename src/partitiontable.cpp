@@ -0,0 +1,843 @@
+#include "partitiontable.h"
+
+#include "crc32.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QHash>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonObject>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QRegExp>
+#include <QtCore/QUuid>
+#include <QtCore/QtEndian>
+
+#include <algorithm>
+
+#include <linux/blkpg.h>
+#include <linux/fs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define MBR_SIGNATURE_OFFSET 510
+#define MBR_PARTITION_OFFSET 446
+#define MBR_DISK_SIGNATURE_OFFSET 440
+#define MBR_EXTENDED_TYPE 0x05
+#define MBR_PROTECTIVE_TYPE 0xEE
+#define MBR_DEFAULT_TYPE 0x83
+
+#define GPT_HEADER_SIZE 92
+#define GPT_ENTRY_SIZE 128
+#define GPT_ENTRY_COUNT 128
+#define GPT_DEFAULT_TYPE "0FC63DAF-8483-4772-8E79-3D69D8477DE4"
+
+// Where fdisk and gdisk put partitions by default.
+#define DEFAULT_ALIGNMENT (1024 * 1024)
+// Past this, hints are more likely bogus than worth the wasted space.
+#define MAX_ALIGNMENT (64 * 1024 * 1024)
+
+Q_LOGGING_CATEGORY(partitionTableDC, "com.ispirata.Hemera.FlashUtility.Logging.PartitionTable")
+
+namespace {
+
+// GPT header, as laid out on disk (all fields little endian).
+struct GptHeader {
+    char signature[8];
+    quint32 revision;
+    quint32 headerSize;
+    quint32 headerCrc;
+    quint32 reserved;
+    quint64 currentLba;
+    quint64 backupLba;
+    quint64 firstUsableLba;
+    quint64 lastUsableLba;
+    quint8 diskGuid[16];
+    quint64 entriesLba;
+    quint32 entryCount;
+    quint32 entrySize;
+    quint32 entriesCrc;
+} __attribute__((packed));
+
+static_assert(sizeof(GptHeader) == GPT_HEADER_SIZE, "GPT header must be 92 bytes");
+
+struct GptEntry {
+    quint8 typeGuid[16];
+    quint8 uniqueGuid[16];
+    quint64 firstLba;
+    quint64 lastLba;
+    quint64 attributes;
+    quint16 name[36];
+} __attribute__((packed));
+
+static_assert(sizeof(GptEntry) == GPT_ENTRY_SIZE, "GPT entry must be 128 bytes");
+
+// gdisk type codes, and the fdisk ones people are used to.
+QString gptTypeGuid(const QString &type)
+{
+    static const QHash<QString, QString> aliases {
+        { QStringLiteral("8300"), QStringLiteral(GPT_DEFAULT_TYPE) },
+        { QStringLiteral("83"), QStringLiteral(GPT_DEFAULT_TYPE) },
+        { QStringLiteral("linux"), QStringLiteral(GPT_DEFAULT_TYPE) },
+        { QStringLiteral("8200"), QStringLiteral("0657FD6D-A4AB-43C4-84E5-0933C84B4F4F") },
+        { QStringLiteral("82"), QStringLiteral("0657FD6D-A4AB-43C4-84E5-0933C84B4F4F") },
+        { QStringLiteral("swap"), QStringLiteral("0657FD6D-A4AB-43C4-84E5-0933C84B4F4F") },
+        { QStringLiteral("ef00"), QStringLiteral("C12A7328-F81F-11D2-BA4B-00A0C93EC93B") },
+        { QStringLiteral("ef"), QStringLiteral("C12A7328-F81F-11D2-BA4B-00A0C93EC93B") },
+        { QStringLiteral("efi"), QStringLiteral("C12A7328-F81F-11D2-BA4B-00A0C93EC93B") },
+        { QStringLiteral("ef02"), QStringLiteral("21686148-6449-6E6F-744E-656564454649") },
+        { QStringLiteral("0700"), QStringLiteral("EBD0A0A2-B9E5-4433-87C0-68B6B72699C7") },
+        { QStringLiteral("b"), QStringLiteral("EBD0A0A2-B9E5-4433-87C0-68B6B72699C7") },
+        { QStringLiteral("c"), QStringLiteral("EBD0A0A2-B9E5-4433-87C0-68B6B72699C7") },
+        { QStringLiteral("8e00"), QStringLiteral("E6D6D379-F507-44C2-A23C-238F2A3DF928") },
+        { QStringLiteral("fd00"), QStringLiteral("A19D880F-05FC-4D3B-A006-743F0F84911E") }
+    };
+
+    if (type.isEmpty()) {
+        return QStringLiteral(GPT_DEFAULT_TYPE);
+    }
+    return aliases.value(type.toLower(), type);
+}
+
+// GPT stores the first three GUID fields little endian, QUuid gives them big endian.
+void guidToDisk(const QUuid &uuid, quint8 *out)
+{
+    QByteArray bytes = uuid.toRfc4122();
+    static const int order[] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+    for (int i = 0; i < 16; ++i) {
+        out[i] = static_cast<quint8>(bytes.at(order[i]));
+    }
+}
+
+QUuid guidFromDisk(const quint8 *in)
+{
+    static const int order[] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+    QByteArray bytes(16, '\0');
+    for (int i = 0; i < 16; ++i) {
+        bytes[order[i]] = static_cast<char>(in[i]);
+    }
+    return QUuid::fromRfc4122(bytes);
+}
+
+bool isMbrExtendedType(quint8 type)
+{
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+void lbaToChs(qint64 lba, quint8 *chs)
+{
+    static const int heads = 255;
+    static const int sectors = 63;
+    qint64 cylinder = lba / (heads * sectors);
+    if (cylinder > 1023) {
+        chs[0] = 0xFE;
+        chs[1] = 0xFF;
+        chs[2] = 0xFF;
+        return;
+    }
+    chs[0] = (lba / sectors) % heads;
+    chs[1] = ((lba % sectors) + 1) | ((cylinder >> 2) & 0xC0);
+    chs[2] = cylinder & 0xFF;
+}
+
+void setMbrEntry(char *sector, int slot, quint8 type, qint64 absoluteStart, qint64 relativeStart, qint64 count)
+{
+    quint8 *entry = reinterpret_cast<quint8 *>(sector + MBR_PARTITION_OFFSET + slot * 16);
+    entry[0] = 0;
+    lbaToChs(absoluteStart, entry + 1);
+    entry[4] = type;
+    lbaToChs(absoluteStart + count - 1, entry + 5);
+    qToLittleEndian<quint32>(relativeStart, entry + 8);
+    qToLittleEndian<quint32>(count, entry + 12);
+}
+
+qint64 alignUp(qint64 value, qint64 alignment)
+{
+    return ((value + alignment - 1) / alignment) * alignment;
+}
+
+qint64 leastCommonMultiple(qint64 a, qint64 b)
+{
+    qint64 x = a;
+    qint64 y = b;
+    while (y != 0) {
+        qint64 remainder = x % y;
+        x = y;
+        y = remainder;
+    }
+    return a / x * b;
+}
+
+}
+
+class PartitionTable::Private
+{
+public:
+    Private()
+        : fd(-1)
+        , sectorSize(512)
+        , sectorCount(0)
+        , type(Type::Mbr)
+        , alignment(0)
+    {}
+
+    QByteArray readSectors(qint64 sector, int count) const;
+    bool writeSectors(qint64 sector, const QByteArray &data);
+    int entriesSectors() const;
+    QByteArray buildMbr() const;
+    QList<QByteArray> buildEbrs() const;
+    bool writeMbr();
+    bool writeGpt();
+    QList<int> kernelPartitions() const;
+    bool readMbr(QList<Partition> *current) const;
+    bool readGpt(QList<Partition> *current) const;
+
+    QString device;
+    QString errorString;
+    int fd;
+    qint64 sectorSize;
+    qint64 sectorCount;
+    Type type;
+    QList<Partition> partitions;
+    qint64 alignment;
+    QStringList alignmentWarnings;
+};
+
+QByteArray PartitionTable::Private::readSectors(qint64 sector, int count) const
+{
+    QByteArray data(count * sectorSize, '\0');
+    if (pread(fd, data.data(), data.size(), sector * sectorSize) != data.size()) {
+        return QByteArray();
+    }
+    return data;
+}
+
+bool PartitionTable::Private::writeSectors(qint64 sector, const QByteArray &data)
+{
+    if (pwrite(fd, data.constData(), data.size(), sector * sectorSize) != data.size()) {
+        errorString = QStringLiteral("Could not write sector %1 of %2: %3").arg(sector).arg(device, QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+int PartitionTable::Private::entriesSectors() const
+{
+    return (GPT_ENTRY_COUNT * GPT_ENTRY_SIZE + sectorSize - 1) / sectorSize;
+}
+
+QByteArray PartitionTable::Private::buildMbr() const
+{
+    // Keep the boot code and, so that PARTUUIDs survive, the disk signature.
+    QByteArray mbr = readSectors(0, 1);
+    if (mbr.isEmpty()) {
+        mbr = QByteArray(sectorSize, '\0');
+    }
+    memset(mbr.data() + MBR_PARTITION_OFFSET, 0, 4 * 16);
+    if (qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(mbr.constData()) + MBR_DISK_SIGNATURE_OFFSET) == 0) {
+        QByteArray signature = QUuid::createUuid().toRfc4122().left(4);
+        memcpy(mbr.data() + MBR_DISK_SIGNATURE_OFFSET, signature.constData(), 4);
+    }
+    mbr[MBR_SIGNATURE_OFFSET] = '\x55';
+    mbr[MBR_SIGNATURE_OFFSET + 1] = '\xAA';
+
+    if (type == Type::Gpt) {
+        qint64 count = qMin(sectorCount - 1, Q_INT64_C(0xFFFFFFFF));
+        setMbrEntry(mbr.data(), 0, MBR_PROTECTIVE_TYPE, 1, 1, count);
+        return mbr;
+    }
+
+    for (const Partition &partition : partitions) {
+        if (!partition.logical) {
+            setMbrEntry(mbr.data(), partition.number - 1, partition.extended ? MBR_EXTENDED_TYPE : partition.mbrType,
+                        partition.startSector, partition.startSector, partition.sectorCount);
+        }
+    }
+    return mbr;
+}
+
+QList<QByteArray> PartitionTable::Private::buildEbrs() const
+{
+    QList<QByteArray> ebrs;
+    qint64 extendedStart = 0;
+    QList<Partition> logicals;
+    for (const Partition &partition : partitions) {
+        if (partition.extended) {
+            extendedStart = partition.startSector;
+        } else if (partition.logical) {
+            logicals.append(partition);
+        }
+    }
+
+    // Each EBR describes its logical partition relative to itself, and links the next EBR relative to the extended partition.
+    for (int i = 0; i < logicals.count(); ++i) {
+        const Partition &logical = logicals.at(i);
+        QByteArray ebr(sectorSize, '\0');
+        setMbrEntry(ebr.data(), 0, logical.mbrType, logical.startSector, logical.startSector - logical.ebrSector, logical.sectorCount);
+        if (i + 1 < logicals.count()) {
+            const Partition &next = logicals.at(i + 1);
+            setMbrEntry(ebr.data(), 1, MBR_EXTENDED_TYPE, next.ebrSector, next.ebrSector - extendedStart,
+                        next.startSector + next.sectorCount - next.ebrSector);
+        }
+        ebr[MBR_SIGNATURE_OFFSET] = '\x55';
+        ebr[MBR_SIGNATURE_OFFSET + 1] = '\xAA';
+        ebrs.append(ebr);
+    }
+    return ebrs;
+}
+
+bool PartitionTable::Private::writeMbr()
+{
+    // EBRs first: until the MBR points to them, they are just unused sectors.
+    QList<QByteArray> ebrs = buildEbrs();
+    int ebrIndex = 0;
+    for (const Partition &partition : partitions) {
+        if (partition.logical && !writeSectors(partition.ebrSector, ebrs.at(ebrIndex++))) {
+            return false;
+        }
+    }
+
+    // An empty extended partition still gets an EBR, or a stale chain at its start would come back to life.
+    for (const Partition &partition : partitions) {
+        if (partition.extended && ebrs.isEmpty() && !writeSectors(partition.startSector, QByteArray(sectorSize, '\0'))) {
+            return false;
+        }
+    }
+
+    if (!writeSectors(0, buildMbr())) {
+        return false;
+    }
+
+    // A stale GPT would take precedence over our table for some tools.
+    QByteArray primaryHeader = readSectors(1, 1);
+    QByteArray backupHeader = readSectors(sectorCount - 1, 1);
+    if (primaryHeader.startsWith("EFI PART") && !writeSectors(1, QByteArray(sectorSize, '\0'))) {
+        return false;
+    }
+    if (backupHeader.startsWith("EFI PART") && !writeSectors(sectorCount - 1, QByteArray(sectorSize, '\0'))) {
+        return false;
+    }
+    return true;
+}
+
+bool PartitionTable::Private::writeGpt()
+{
+    QByteArray entries(entriesSectors() * sectorSize, '\0');
+    for (const Partition &partition : partitions) {
+        GptEntry *entry = reinterpret_cast<GptEntry *>(entries.data() + (partition.number - 1) * GPT_ENTRY_SIZE);
+        guidToDisk(QUuid(gptTypeGuid(partition.gptType)), entry->typeGuid);
+        guidToDisk(QUuid::createUuid(), entry->uniqueGuid);
+        entry->firstLba = qToLittleEndian<quint64>(partition.startSector);
+        entry->lastLba = qToLittleEndian<quint64>(partition.startSector + partition.sectorCount - 1);
+        entry->attributes = 0;
+        for (int i = 0; i < partition.name.size() && i < 36; ++i) {
+            entry->name[i] = qToLittleEndian<quint16>(partition.name.at(i).unicode());
+        }
+    }
+    quint32 entriesCrc = Crc32::checksum(entries.constData(), GPT_ENTRY_COUNT * GPT_ENTRY_SIZE);
+
+    // Keep the disk GUID of an existing table.
+    QByteArray oldHeader = readSectors(1, 1);
+    QUuid diskGuid = QUuid::createUuid();
+
+    qint64 lastLba = sectorCount - 1;
+    auto buildHeader = [&] (qint64 currentLba, qint64 backupLba, qint64 entriesLba) {
+        QByteArray sector(sectorSize, '\0');
+        GptHeader *header = reinterpret_cast<GptHeader *>(sector.data());
+        memcpy(header->signature, "EFI PART", 8);
+        header->revision = qToLittleEndian<quint32>(0x00010000);
+        header->headerSize = qToLittleEndian<quint32>(GPT_HEADER_SIZE);
+        header->currentLba = qToLittleEndian<quint64>(currentLba);
+        header->backupLba = qToLittleEndian<quint64>(backupLba);
+        header->firstUsableLba = qToLittleEndian<quint64>(2 + entriesSectors());
+        header->lastUsableLba = qToLittleEndian<quint64>(lastLba - 1 - entriesSectors());
+        if (oldHeader.startsWith("EFI PART")) {
+            memcpy(header->diskGuid, reinterpret_cast<const GptHeader *>(oldHeader.constData())->diskGuid, 16);
+        } else {
+            guidToDisk(diskGuid, header->diskGuid);
+        }
+        header->entriesLba = qToLittleEndian<quint64>(entriesLba);
+        header->entryCount = qToLittleEndian<quint32>(GPT_ENTRY_COUNT);
+        header->entrySize = qToLittleEndian<quint32>(GPT_ENTRY_SIZE);
+        header->entriesCrc = qToLittleEndian<quint32>(entriesCrc);
+        header->headerCrc = qToLittleEndian<quint32>(Crc32::checksum(header, GPT_HEADER_SIZE));
+        return sector;
+    };
+
+    // Backup first, so that an interruption leaves at least one consistent copy around.
+    qint64 backupEntriesLba = lastLba - entriesSectors();
+    return writeSectors(backupEntriesLba, entries) &&
+           writeSectors(lastLba, buildHeader(lastLba, 1, backupEntriesLba)) &&
+           writeSectors(2, entries) &&
+           writeSectors(1, buildHeader(1, lastLba, 2)) &&
+           writeSectors(0, buildMbr());
+}
+
+bool PartitionTable::Private::readMbr(QList<Partition> *current) const
+{
+    QByteArray mbr = readSectors(0, 1);
+    if (mbr.size() < 512 || mbr.at(MBR_SIGNATURE_OFFSET) != '\x55' || mbr.at(MBR_SIGNATURE_OFFSET + 1) != '\xAA') {
+        return false;
+    }
+
+    for (int slot = 0; slot < 4; ++slot) {
+        const uchar *entry = reinterpret_cast<const uchar *>(mbr.constData()) + MBR_PARTITION_OFFSET + slot * 16;
+        if (entry[4] == 0) {
+            continue;
+        }
+
+        Partition partition;
+        partition.number = slot + 1;
+        partition.mbrType = entry[4];
+        partition.extended = isMbrExtendedType(entry[4]);
+        partition.startSector = qFromLittleEndian<quint32>(entry + 8);
+        partition.sectorCount = qFromLittleEndian<quint32>(entry + 12);
+        current->append(partition);
+
+        if (!partition.extended) {
+            continue;
+        }
+
+        // Follow the EBR chain, bounded in case it loops.
+        qint64 ebrSector = partition.startSector;
+        for (int number = 5; ebrSector > 0 && number < 5 + 128; ++number) {
+            QByteArray ebr = readSectors(ebrSector, 1);
+            if (ebr.size() < 512 || ebr.at(MBR_SIGNATURE_OFFSET) != '\x55' || ebr.at(MBR_SIGNATURE_OFFSET + 1) != '\xAA') {
+                return false;
+            }
+            const uchar *logicalEntry = reinterpret_cast<const uchar *>(ebr.constData()) + MBR_PARTITION_OFFSET;
+            if (logicalEntry[4] != 0) {
+                Partition logical;
+                logical.number = number;
+                logical.logical = true;
+                logical.mbrType = logicalEntry[4];
+                logical.ebrSector = ebrSector;
+                logical.startSector = ebrSector + qFromLittleEndian<quint32>(logicalEntry + 8);
+                logical.sectorCount = qFromLittleEndian<quint32>(logicalEntry + 12);
+                current->append(logical);
+            }
+            const uchar *nextEntry = logicalEntry + 16;
+            ebrSector = isMbrExtendedType(nextEntry[4]) ? partition.startSector + qFromLittleEndian<quint32>(nextEntry + 8) : 0;
+        }
+    }
+
+    return true;
+}
+
+bool PartitionTable::Private::readGpt(QList<Partition> *current) const
+{
+    QByteArray headerSector = readSectors(1, 1);
+    if (!headerSector.startsWith("EFI PART")) {
+        return false;
+    }
+
+    GptHeader header;
+    memcpy(&header, headerSector.constData(), GPT_HEADER_SIZE);
+    quint32 headerCrc = qFromLittleEndian(header.headerCrc);
+    header.headerCrc = 0;
+    if (Crc32::checksum(&header, GPT_HEADER_SIZE) != headerCrc) {
+        qCDebug(partitionTableDC) << "GPT header of" << device << "is damaged";
+        return false;
+    }
+
+    quint32 entryCount = qFromLittleEndian(header.entryCount);
+    quint32 entrySize = qFromLittleEndian(header.entrySize);
+    if (entrySize < GPT_ENTRY_SIZE || entryCount > 1024) {
+        return false;
+    }
+    qint64 entriesBytes = static_cast<qint64>(entryCount) * entrySize;
+    QByteArray entries = readSectors(qFromLittleEndian(header.entriesLba), (entriesBytes + sectorSize - 1) / sectorSize);
+    if (entries.isEmpty() || Crc32::checksum(entries.constData(), entriesBytes) != qFromLittleEndian(header.entriesCrc)) {
+        qCDebug(partitionTableDC) << "GPT entries of" << device << "are damaged";
+        return false;
+    }
+
+    for (quint32 i = 0; i < entryCount; ++i) {
+        const GptEntry *entry = reinterpret_cast<const GptEntry *>(entries.constData() + i * entrySize);
+        QUuid typeGuid = guidFromDisk(entry->typeGuid);
+        if (typeGuid.isNull()) {
+            continue;
+        }
+
+        Partition partition;
+        partition.number = i + 1;
+        partition.gptType = typeGuid.toString();
+        partition.startSector = qFromLittleEndian(entry->firstLba);
+        partition.sectorCount = qFromLittleEndian(entry->lastLba) - partition.startSector + 1;
+        for (int c = 0; c < 36 && entry->name[c] != 0; ++c) {
+            partition.name.append(QChar(qFromLittleEndian(entry->name[c])));
+        }
+        current->append(partition);
+    }
+
+    return true;
+}
+
+QList<int> PartitionTable::Private::kernelPartitions() const
+{
+    QList<int> numbers;
+    QString canonicalPath = QFileInfo(device).canonicalFilePath();
+    QString diskName = QFileInfo(canonicalPath.isEmpty() ? device : canonicalPath).fileName();
+    QDir diskDir(QStringLiteral("/sys/class/block/%1").arg(diskName));
+    for (const QString &entry : diskDir.entryList(QStringList { diskName + QLatin1Char('*') }, QDir::Dirs | QDir::NoDotAndDotDot)) {
+        QFile partitionFile(diskDir.filePath(entry + QStringLiteral("/partition")));
+        if (partitionFile.open(QIODevice::ReadOnly)) {
+            numbers.append(partitionFile.readAll().trimmed().toInt());
+        }
+    }
+    return numbers;
+}
+
+PartitionTable::PartitionTable(const QString &device)
+    : d(new Private)
+{
+    d->device = device;
+}
+
+PartitionTable::~PartitionTable()
+{
+    if (d->fd >= 0) {
+        ::close(d->fd);
+    }
+    delete d;
+}
+
+bool PartitionTable::open()
+{
+    d->fd = ::open(QFile::encodeName(d->device).constData(), O_RDWR | O_CLOEXEC);
+    if (d->fd < 0) {
+        d->errorString = QStringLiteral("Could not open %1: %2").arg(d->device, QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+
+    int sectorSize = 0;
+    quint64 size = 0;
+    if (ioctl(d->fd, BLKSSZGET, &sectorSize) != 0 || ioctl(d->fd, BLKGETSIZE64, &size) != 0 || sectorSize <= 0) {
+        d->errorString = QStringLiteral("Could not read geometry of %1: %2").arg(d->device, QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+
+    d->sectorSize = sectorSize;
+    d->sectorCount = size / sectorSize;
+    qCDebug(partitionTableDC) << d->device << "has" << d->sectorCount << "sectors of" << d->sectorSize << "bytes";
+    return true;
+}
+
+QString PartitionTable::errorString() const
+{
+    return d->errorString;
+}
+
+qint64 PartitionTable::sectorSize() const
+{
+    return d->sectorSize;
+}
+
+qint64 PartitionTable::sectorCount() const
+{
+    return d->sectorCount;
+}
+
+qint64 PartitionTable::detectAlignment() const
+{
+    QString canonicalPath = QFileInfo(d->device).canonicalFilePath();
+    QString diskName = QFileInfo(canonicalPath.isEmpty() ? d->device : canonicalPath).fileName();
+    QString sysfsPath = QStringLiteral("/sys/class/block/%1").arg(diskName);
+
+    // preferred_erase_size is only there for MMC, and is what matters most for eMMC write speed.
+    static const QStringList hints { QStringLiteral("device/preferred_erase_size"), QStringLiteral("queue/optimal_io_size"),
+                                     QStringLiteral("queue/minimum_io_size"), QStringLiteral("queue/discard_granularity") };
+    qint64 alignment = DEFAULT_ALIGNMENT;
+    qint64 largestHint = DEFAULT_ALIGNMENT;
+    for (const QString &hint : hints) {
+        QFile hintFile(QStringLiteral("%1/%2").arg(sysfsPath, hint));
+        if (!hintFile.open(QIODevice::ReadOnly)) {
+            continue;
+        }
+        qint64 value = hintFile.readAll().trimmed().toLongLong();
+        qCDebug(partitionTableDC) << d->device << hint << "is" << value;
+        if (value <= 0) {
+            continue;
+        }
+        if (value > MAX_ALIGNMENT) {
+            qCWarning(partitionTableDC) << "Ignoring" << hint << "of" << value << "bytes for" << d->device;
+            continue;
+        }
+        largestHint = qMax(largestHint, value);
+        alignment = leastCommonMultiple(alignment, value);
+    }
+
+    // Hints are powers of two in practice, but odd erase units could multiply into something unusable.
+    if (alignment > MAX_ALIGNMENT) {
+        qCWarning(partitionTableDC) << "Hints for" << d->device << "add up to" << alignment << "bytes, aligning to" << largestHint << "instead";
+        alignment = largestHint;
+    }
+
+    return alignUp(alignment, d->sectorSize);
+}
+
+bool PartitionTable::setAlignment(qint64 bytes)
+{
+    if (bytes <= 0 || d->sectorSize <= 0 || bytes % d->sectorSize != 0) {
+        d->errorString = QStringLiteral("Alignment of %1 bytes is not a multiple of the %2 bytes sector size").arg(bytes).arg(d->sectorSize);
+        return false;
+    }
+
+    // As with the detected one, never below the 1 MiB fdisk would use.
+    qint64 alignment = leastCommonMultiple(DEFAULT_ALIGNMENT, bytes);
+    if (alignment > MAX_ALIGNMENT) {
+        d->errorString = QStringLiteral("Alignment of %1 bytes combined with 1 MiB exceeds %2 bytes").arg(bytes).arg(MAX_ALIGNMENT);
+        return false;
+    }
+    d->alignment = alignment;
+    return true;
+}
+
+QStringList PartitionTable::alignmentWarnings() const
+{
+    return d->alignmentWarnings;
+}
+
+bool PartitionTable::layout(Type type, const QJsonArray &partitions)
+{
+    d->type = type;
+    d->partitions.clear();
+    d->alignmentWarnings.clear();
+
+    bool alignSizes = d->alignment > 0;
+    qint64 alignment = qMax(Q_INT64_C(1), (alignSizes ? d->alignment : DEFAULT_ALIGNMENT) / d->sectorSize);
+    qint64 firstUsable = type == Type::Gpt ? 2 + d->entriesSectors() : 1;
+    qint64 lastUsable = type == Type::Gpt ? d->sectorCount - 2 - d->entriesSectors() : d->sectorCount - 1;
+    if (type == Type::Mbr) {
+        lastUsable = qMin(lastUsable, Q_INT64_C(0xFFFFFFFF));
+    }
+
+    qint64 nextFree = alignUp(qMax(firstUsable, alignment), alignment);
+    QList<int> usedPrimaryNumbers;
+    int nextLogicalNumber = 5;
+    int nextGptNumber = 1;
+    Partition extended;
+    qint64 nextLogicalFree = 0;
+
+    for (const QJsonValue &partitionValue : partitions) {
+        QJsonObject description = partitionValue.toObject();
+        Partition partition;
+        QString partitionType = description.value(QStringLiteral("partition_type")).toString();
+
+        // The partition number is what the target node ends with, e.g. /dev/mmcblk0p2
+        QRegExp numberSuffix(QStringLiteral("(\\d+)$"));
+        int requestedNumber = 0;
+        if (numberSuffix.indexIn(description.value(QStringLiteral("target")).toString()) >= 0) {
+            requestedNumber = numberSuffix.cap(1).toInt();
+        }
+
+        if (type == Type::Gpt) {
+            partition.number = requestedNumber > 0 ? requestedNumber : nextGptNumber;
+            nextGptNumber = partition.number + 1;
+            if (partition.number > GPT_ENTRY_COUNT) {
+                d->errorString = QStringLiteral("GPT partition number %1 is out of range").arg(partition.number);
+                return false;
+            }
+            partition.gptType = gptTypeGuid(partitionType);
+            partition.name = description.value(QStringLiteral("name")).toString(description.value(QStringLiteral("filesystem_label")).toString());
+        } else if (partitionType == QStringLiteral("msdos_extended")) {
+            if (extended.extended) {
+                d->errorString = QStringLiteral("Only one extended partition is allowed");
+                return false;
+            }
+            partition.extended = true;
+        } else if (extended.extended) {
+            partition.logical = true;
+            partition.number = nextLogicalNumber++;
+        }
+
+        if (type == Type::Mbr && !partition.logical) {
+            if (requestedNumber >= 1 && requestedNumber <= 4 && !usedPrimaryNumbers.contains(requestedNumber) && !partition.extended) {
+                partition.number = requestedNumber;
+            } else {
+                for (int number = 1; number <= 4 && partition.number == 0; ++number) {
+                    if (!usedPrimaryNumbers.contains(number)) {
+                        partition.number = number;
+                    }
+                }
+            }
+            if (partition.number == 0) {
+                d->errorString = QStringLiteral("No primary partition slot left");
+                return false;
+            }
+            usedPrimaryNumbers.append(partition.number);
+        }
+
+        if (type == Type::Mbr && !partition.extended) {
+            bool ok = false;
+            partition.mbrType = partitionType.isEmpty() ? MBR_DEFAULT_TYPE : partitionType.toUInt(&ok, 16);
+            if (!partitionType.isEmpty() && !ok) {
+                d->errorString = QStringLiteral("Invalid partition type %1").arg(partitionType);
+                return false;
+            }
+        }
+
+        // Where it starts: logical partitions sit after their EBR, inside the extended one.
+        qint64 lowerBound = partition.logical ? nextLogicalFree : nextFree;
+        qint64 upperBound = partition.logical ? extended.startSector + extended.sectorCount - 1 : lastUsable;
+        if (description.contains(QStringLiteral("start_sector"))) {
+            partition.startSector = static_cast<qint64>(description.value(QStringLiteral("start_sector")).toDouble());
+        } else if (partition.logical) {
+            partition.startSector = alignUp(lowerBound + 1, alignment);
+        } else {
+            partition.startSector = alignUp(lowerBound, alignment);
+        }
+        if (partition.logical) {
+            // The chain starts at the beginning of the extended partition, wherever the first logical one is.
+            bool firstLogical = nextLogicalFree == extended.startSector;
+            partition.ebrSector = firstLogical ? extended.startSector : qMax(lowerBound, partition.startSector - alignment);
+            if (partition.ebrSector >= partition.startSector) {
+                d->errorString = QStringLiteral("No room for the EBR of partition %1").arg(partition.number);
+                return false;
+            }
+        }
+
+        qint64 size = static_cast<qint64>(description.value(QStringLiteral("size")).toDouble());
+        // No size means all the space that's left.
+        partition.sectorCount = size > 0 ? (size * 1024 * 1024) / d->sectorSize : upperBound - partition.startSector + 1;
+
+        if (alignSizes) {
+            if (partition.startSector % alignment != 0) {
+                d->alignmentWarnings.append(QStringLiteral("Partition %1 starts at sector %2, not a multiple of %3")
+                                                          .arg(partition.number).arg(partition.startSector).arg(alignment));
+            }
+            if (size > 0 && partition.sectorCount % alignment != 0) {
+                d->alignmentWarnings.append(QStringLiteral("Partition %1 is %2 MiB, rounded up to a multiple of %3 KiB")
+                                                          .arg(partition.number).arg(size).arg(alignment * d->sectorSize / 1024));
+                partition.sectorCount = alignUp(partition.sectorCount, alignment);
+            }
+        }
+
+        if (partition.startSector < lowerBound || partition.startSector + partition.sectorCount - 1 > upperBound || partition.sectorCount <= 0) {
+            d->errorString = QStringLiteral("Partition %1 (sectors %2 to %3) does not fit in sectors %4 to %5")
+                                            .arg(partition.number).arg(partition.startSector)
+                                            .arg(partition.startSector + partition.sectorCount - 1).arg(lowerBound).arg(upperBound);
+            return false;
+        }
+
+        if (partition.extended) {
+            extended = partition;
+            nextLogicalFree = partition.startSector;
+            nextFree = partition.startSector + partition.sectorCount;
+        } else if (partition.logical) {
+            nextLogicalFree = partition.startSector + partition.sectorCount;
+        } else {
+            nextFree = partition.startSector + partition.sectorCount;
+        }
+
+        qCInfo(partitionTableDC) << "Partition" << partition.number << "from sector" << partition.startSector << "for"
+                                 << partition.sectorCount << "sectors" << (partition.extended ? "(extended)" : "");
+        d->partitions.append(partition);
+    }
+
+    return true;
+}
+
+PartitionTable::Type PartitionTable::type() const
+{
+    return d->type;
+}
+
+QList<PartitionTable::Partition> PartitionTable::partitions() const
+{
+    return d->partitions;
+}
+
+bool PartitionTable::isUnchanged() const
+{
+    // A protective MBR means the real table is the GPT.
+    QList<Partition> current;
+    QByteArray mbr = d->readSectors(0, 1);
+    bool isGpt = mbr.size() >= 512 && static_cast<quint8>(mbr.at(MBR_PARTITION_OFFSET + 4)) == MBR_PROTECTIVE_TYPE;
+    if ((d->type == Type::Gpt) != isGpt) {
+        qCInfo(partitionTableDC) << d->device << "has a different partition table type";
+        return false;
+    }
+    if (!(isGpt ? d->readGpt(&current) : d->readMbr(&current))) {
+        qCInfo(partitionTableDC) << d->device << "has no valid partition table";
+        return false;
+    }
+
+    if (current.count() != d->partitions.count()) {
+        qCInfo(partitionTableDC) << d->device << "has" << current.count() << "partitions instead of" << d->partitions.count();
+        return false;
+    }
+
+    for (const Partition &requested : d->partitions) {
+        auto existing = std::find_if(current.constBegin(), current.constEnd(), [&requested] (const Partition &partition) {
+            return partition.number == requested.number;
+        });
+        bool matches = existing != current.constEnd() &&
+                       existing->startSector == requested.startSector &&
+                       existing->extended == requested.extended &&
+                       existing->logical == requested.logical;
+        if (matches && isGpt) {
+            matches = existing->sectorCount == requested.sectorCount &&
+                      QUuid(existing->gptType) == QUuid(requested.gptType) &&
+                      existing->name == requested.name;
+        } else if (matches && !requested.extended) {
+            // The extended partition's type byte and size are ours to pick as long as the logical ones match.
+            matches = existing->sectorCount == requested.sectorCount && existing->mbrType == requested.mbrType;
+        }
+
+        if (!matches) {
+            qCInfo(partitionTableDC) << "Partition" << requested.number << "of" << d->device << "differs from the requested layout";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool PartitionTable::write()
+{
+    bool success = d->type == Type::Gpt ? d->writeGpt() : d->writeMbr();
+    if (success && fsync(d->fd) != 0) {
+        d->errorString = QStringLiteral("Could not flush %1: %2").arg(d->device, QString::fromLocal8Bit(strerror(errno)));
+        return false;
+    }
+    return success;
+}
+
+bool PartitionTable::notifyKernel()
+{
+    struct blkpg_partition blkpgPartition;
+    struct blkpg_ioctl_arg argument;
+    argument.flags = 0;
+    argument.datalen = sizeof(blkpgPartition);
+    argument.data = &blkpgPartition;
+
+    for (int number : d->kernelPartitions()) {
+        memset(&blkpgPartition, 0, sizeof(blkpgPartition));
+        blkpgPartition.pno = number;
+        argument.op = BLKPG_DEL_PARTITION;
+        if (ioctl(d->fd, BLKPG, &argument) != 0 && errno != ENXIO) {
+            d->errorString = QStringLiteral("Could not remove partition %1 of %2: %3").arg(number).arg(d->device, QString::fromLocal8Bit(strerror(errno)));
+            return false;
+        }
+    }
+
+    for (const Partition &partition : d->partitions) {
+        memset(&blkpgPartition, 0, sizeof(blkpgPartition));
+        blkpgPartition.pno = partition.number;
+        blkpgPartition.start = partition.startSector * d->sectorSize;
+        // Like the kernel's own parser, only expose the first sectors of an extended partition.
+        blkpgPartition.length = partition.extended ? qMax(d->sectorSize, Q_INT64_C(1024)) : partition.sectorCount * d->sectorSize;
+        argument.op = BLKPG_ADD_PARTITION;
+        if (ioctl(d->fd, BLKPG, &argument) != 0) {
+            d->errorString = QStringLiteral("Could not add partition %1 of %2: %3").arg(partition.number).arg(d->device, QString::fromLocal8Bit(strerror(errno)));
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef PARTITIONTABLE_H_
+#define PARTITIONTABLE_H_
+
+#include <QtCore/QList>
+#include <QtCore/QStringList>
+
+class QJsonArray;
+
+class PartitionTable
+{
+public:
+    enum class Type {
+        Mbr,
+        Gpt
+    };
+
+    struct Partition {
+        Partition()
+            : number(0)
+            , startSector(0)
+            , sectorCount(0)
+            , ebrSector(0)
+            , mbrType(0)
+            , extended(false)
+            , logical(false)
+        {}
+
+        int number;
+        qint64 startSector;
+        qint64 sectorCount;
+        /// Sector holding the EBR describing a logical partition.
+        qint64 ebrSector;
+        quint8 mbrType;
+        QString gptType;
+        QString name;
+        bool extended;
+        bool logical;
+    };
+
+    explicit PartitionTable(const QString &device);
+    ~PartitionTable();
+
+    /// Opens the disk and reads its geometry.
+    bool open();
+    QString errorString() const;
+
+    qint64 sectorSize() const;
+    qint64 sectorCount() const;
+
+    /// Least common multiple of 1 MiB and the erase unit and I/O size hints the kernel exports for the disk.
+    qint64 detectAlignment() const;
+    /// Aligns partition starts and sizes to @p bytes, combined with 1 MiB, from now on, instead of only placing starts
+    /// on 1 MiB boundaries. False if @p bytes is not a whole number of sectors.
+    bool setAlignment(qint64 bytes);
+    /// Configured partitions that layout() found not to respect the alignment.
+    QStringList alignmentWarnings() const;
+
+    /// Computes where each partition of @p partitions goes, the way fdisk would place them by default.
+    bool layout(Type type, const QJsonArray &partitions);
+    Type type() const;
+    QList<Partition> partitions() const;
+
+    /// Whether the table on disk already describes exactly the partitions computed by layout().
+    bool isUnchanged() const;
+
+    /// Writes the table to disk. For GPT, the protective MBR and backup table are written as well.
+    bool write();
+    /// Replaces the kernel's view of the partitions with the new table, one partition at a time.
+    bool notifyKernel();
+
+private:
+    Q_DISABLE_COPY(PartitionTable)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
@@ -1,11 +1,16 @@
 #include "partitiontableoperation.h"
 
+#include "logsink.h"
+#include "partitiontable.h"
+#include "progressreporter.h"
+#include "udevsettleoperation.h"
+
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonObject>
+#include <QtCore/QLoggingCategory>
 #include <QtCore/QProcess>
-#include <QtCore/QTimer>
 
 #include <HemeraCore/Literals>
 
@@ -13,15 +18,24 @@
 
 #define FDISK_PATH "/sbin/fdisk"
 #define GDISK_PATH "/sbin/gdisk"
+#define UDEV_SETTLE_TIMEOUT 30000
+
+Q_LOGGING_CATEGORY(partitionTableOperationDC, "com.ispirata.Hemera.FlashUtility.Logging.PartitionTableOperation")
 
 class PartitionTableOperation::Private
 {
 public:
-    Private() {}
+    Private()
+        : compareFirst(false)
+    {}
+
+    bool writeNative(QString *errorMessage, bool *unchanged);
 
     QString device;
     QString type;
     QJsonArray partitions;
+    QJsonValue align;
+    bool compareFirst;
 };
 
 PartitionTableOperation::PartitionTableOperation(const QString &id, QObject *parent)
@@ -35,6 +49,69 @@ PartitionTableOperation::~PartitionTableOperation()
     delete d;
 }
 
+bool PartitionTableOperation::Private::writeNative(QString *errorMessage, bool *unchanged)
+{
+    PartitionTable::Type tableType;
+    if (type == QStringLiteral("msdos") || type == QStringLiteral("mbr")) {
+        tableType = PartitionTable::Type::Mbr;
+    } else if (type == QStringLiteral("gpt")) {
+        tableType = PartitionTable::Type::Gpt;
+    } else {
+        *errorMessage = QStringLiteral("Partition table type %1 is not supported!").arg(type);
+        return false;
+    }
+
+    PartitionTable table(device);
+    if (!table.open()) {
+        *errorMessage = table.errorString();
+        return false;
+    }
+
+    // Either "auto" to follow the device's erase unit and I/O hints, or a size in bytes.
+    if (align.toString() == QStringLiteral("auto")) {
+        qint64 alignment = table.detectAlignment();
+        qCInfo(partitionTableOperationDC) << "Aligning partitions on" << device << "to" << alignment << "bytes";
+        if (!table.setAlignment(alignment)) {
+            qCWarning(partitionTableOperationDC) << table.errorString() << ", keeping the default alignment";
+        }
+    } else if (!align.isUndefined() && !align.isNull()) {
+        qint64 alignment = align.isString() ? align.toString().toLongLong() : static_cast<qint64>(align.toDouble());
+        if (!table.setAlignment(alignment)) {
+            *errorMessage = table.errorString();
+            return false;
+        }
+    }
+
+    if (!table.layout(tableType, partitions)) {
+        *errorMessage = table.errorString();
+        return false;
+    }
+    for (const QString &warning : table.alignmentWarnings()) {
+        qCWarning(partitionTableOperationDC) << device << "is misaligned:" << warning;
+    }
+
+    // Rewriting an identical table would still make the kernel drop and recreate every partition.
+    *unchanged = compareFirst && table.isUnchanged();
+    if (*unchanged) {
+        qCInfo(partitionTableOperationDC) << "Partition table of" << device << "is already up to date, not writing it.";
+        return true;
+    }
+
+    if (!table.write()) {
+        *errorMessage = table.errorString();
+        return false;
+    }
+
+    // No full rescan: the kernel learns about each partition right away.
+    if (!table.notifyKernel()) {
+        *errorMessage = table.errorString();
+        return false;
+    }
+
+    qCInfo(partitionTableOperationDC) << "Wrote" << type << "partition table with" << table.partitions().count() << "partitions to" << device;
+    return true;
+}
+
 void PartitionTableOperation::startImpl()
 {
     d->device = parameters().value(QStringLiteral("target")).toString();
@@ -47,6 +124,34 @@ void PartitionTableOperation::startImpl()
         return;
     }
 
+    d->compareFirst = parameters().value(QStringLiteral("compare_first")).toBool(false);
+    d->align = parameters().value(QStringLiteral("align"));
+    if (parameters().value(QStringLiteral("native")).toBool(true) || d->compareFirst || !d->align.isUndefined()) {
+        QString errorMessage;
+        bool unchanged = false;
+        if (!d->writeNative(&errorMessage, &unchanged)) {
+            qCWarning(partitionTableOperationDC) << "Could not write partition table:" << errorMessage;
+            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                                 QStringLiteral("Failed to write partition table: %1").arg(errorMessage));
+            return;
+        }
+
+        if (unchanged) {
+            // Lets FlashTool skip whatever depended on the table being new.
+            ProgressReporter(QStringLiteral("partition_table")).sendEvent(QJsonObject { { QStringLiteral("unchanged"), true },
+                                                                                        { QStringLiteral("target"), d->device } });
+            setFinished();
+            return;
+        }
+
+        // The new nodes exist already, udev just has to create the links.
+        UdevSettleOperation *settleOperation = new UdevSettleOperation(QString(), UDEV_SETTLE_TIMEOUT, 5000, this);
+        connect(settleOperation, &Hemera::Operation::finished, this, [this] {
+            setFinished();
+        });
+        return;
+    }
+
     QStringList commands;
     commands.append(QStringLiteral("o"));
     bool extendedCreated = false;
@@ -106,19 +211,15 @@ void PartitionTableOperation::startImpl()
 
     // Detach and ignore output.
     QProcess *fdisk = new QProcess(this);
-    connect(fdisk, &QProcess::readyReadStandardOutput, [fdisk] () {
-        qDebug() << fdisk->readAllStandardOutput();
-    });
-    connect(fdisk, &QProcess::readyReadStandardError, [fdisk] () {
-        qDebug() << fdisk->readAllStandardError();
-    });
+    LogSink::instance()->attach(fdisk, QStringLiteral("fdisk"));
     QObject::connect(fdisk, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
                      this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
         if ((exitStatus == QProcess::NormalExit) && (exitCode == 0)) {
             // flush all pending writes to disk
             sync();
-            // FIXME: worakround useful to give udev some seconds to scan for changes
-            QTimer::singleShot(5000, this, [this] () {
+            // Wait for udev to pick up the changes, e.g. the new by-label links, and not a moment longer.
+            UdevSettleOperation *settleOperation = new UdevSettleOperation(QString(), UDEV_SETTLE_TIMEOUT, 5000, this);
+            connect(settleOperation, &Hemera::Operation::finished, this, [this] {
                 setFinished();
             });
         } else {
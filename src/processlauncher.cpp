@@ -0,0 +1,454 @@
+#include "processlauncher.h"
+
+#include "logsink.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QSocketNotifier>
+#include <QtCore/QTimer>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <vector>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_ADDCHDIR 1
+#endif
+
+extern char **environ;
+
+Q_LOGGING_CATEGORY(processLauncherDC, "com.ispirata.Hemera.FlashUtility.Logging.ProcessLauncher")
+
+namespace {
+
+int childSignalPipe[2] = { -1, -1 };
+struct sigaction previousChildAction;
+
+// Wakes up the event loop through a pipe, then chains to whatever handled SIGCHLD before (e.g. QProcess).
+void childSignalHandler(int signal, siginfo_t *info, void *context)
+{
+    int savedErrno = errno;
+    char byte = 0;
+    if (::write(childSignalPipe[1], &byte, 1) < 0) {
+        // The pipe is full: a wake up is pending anyway.
+    }
+
+    if (previousChildAction.sa_flags & SA_SIGINFO) {
+        if (previousChildAction.sa_sigaction) {
+            previousChildAction.sa_sigaction(signal, info, context);
+        }
+    } else if (previousChildAction.sa_handler != SIG_DFL && previousChildAction.sa_handler != SIG_IGN) {
+        previousChildAction.sa_handler(signal);
+    }
+    errno = savedErrno;
+}
+
+// Shared by all launchers without a pidfd: each of them checks on its own child when it fires.
+QSocketNotifier *childSignalNotifier()
+{
+    static QSocketNotifier *notifier = nullptr;
+    if (notifier) {
+        return notifier;
+    }
+
+    if (pipe2(childSignalPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        qCWarning(processLauncherDC) << "Could not create the SIGCHLD pipe:" << strerror(errno);
+        return nullptr;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = childSignalHandler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, &previousChildAction) != 0) {
+        qCWarning(processLauncherDC) << "Could not install the SIGCHLD handler:" << strerror(errno);
+        ::close(childSignalPipe[0]);
+        ::close(childSignalPipe[1]);
+        return nullptr;
+    }
+
+    notifier = new QSocketNotifier(childSignalPipe[0], QSocketNotifier::Read);
+    // Connected first, so the pipe is drained before any launcher gets to reap.
+    QObject::connect(notifier, &QSocketNotifier::activated, [] {
+        char buffer[64];
+        while (::read(childSignalPipe[0], buffer, sizeof(buffer)) > 0) {
+        }
+    });
+    return notifier;
+}
+
+}
+
+class ProcessLauncher::Private
+{
+public:
+    Private(ProcessLauncher *q)
+        : q(q)
+        , timeout(0)
+        , pid(-1)
+        , pidFd(-1)
+        , exitCode(-1)
+        , timedOut(false)
+        , spawnLatency(0)
+        , runTime(0)
+        , pidNotifier(nullptr)
+        , timeoutTimer(nullptr)
+    {
+        outputFds[0] = -1;
+        outputFds[1] = -1;
+        outputNotifiers[0] = nullptr;
+        outputNotifiers[1] = nullptr;
+    }
+
+    bool spawn(QString *errorMessage);
+    void readOutput(int channel);
+    void reap();
+    void cleanup();
+
+    ProcessLauncher * const q;
+
+    QString program;
+    QStringList arguments;
+    QString logTag;
+    QString workingDirectory;
+    std::function<void(int channel, const QByteArray &data)> observer;
+    int timeout;
+
+    pid_t pid;
+    int pidFd;
+    int outputFds[2];
+    int exitCode;
+    bool timedOut;
+    qint64 spawnLatency;
+    qint64 runTime;
+    QElapsedTimer timer;
+
+    QSocketNotifier *pidNotifier;
+    QSocketNotifier *outputNotifiers[2];
+    QMetaObject::Connection childSignalConnection;
+    QTimer *timeoutTimer;
+};
+
+bool ProcessLauncher::Private::spawn(QString *errorMessage)
+{
+#ifndef HAVE_SPAWN_ADDCHDIR
+    // posix_spawn can't be told where to start the child, and moving the whole multi-threaded process isn't an option.
+    if (!workingDirectory.isEmpty()) {
+        *errorMessage = QStringLiteral("working directories need glibc 2.29 or later");
+        return false;
+    }
+#endif
+
+    // Everything the child needs is built before spawning, so that nothing but the exec happens in between.
+    QList<QByteArray> argumentData { QFile::encodeName(program) };
+    for (const QString &argument : arguments) {
+        argumentData.append(argument.toLocal8Bit());
+    }
+    std::vector<char *> argv;
+    for (QByteArray &argument : argumentData) {
+        argv.push_back(argument.data());
+    }
+    argv.push_back(nullptr);
+
+    int stdoutPipe[2];
+    int stderrPipe[2];
+    if (pipe2(stdoutPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        *errorMessage = QString::fromLatin1(strerror(errno));
+        return false;
+    }
+    if (pipe2(stderrPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        *errorMessage = QString::fromLatin1(strerror(errno));
+        ::close(stdoutPipe[0]);
+        ::close(stdoutPipe[1]);
+        return false;
+    }
+
+    // The child gets blocking ends, as it would from a shell.
+    fcntl(stdoutPipe[1], F_SETFL, 0);
+    fcntl(stderrPipe[1], F_SETFL, 0);
+
+    posix_spawn_file_actions_t fileActions;
+    posix_spawn_file_actions_init(&fileActions);
+    posix_spawn_file_actions_addopen(&fileActions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fileActions, stdoutPipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fileActions, stderrPipe[1], STDERR_FILENO);
+
+#ifdef HAVE_SPAWN_ADDCHDIR
+    QByteArray directory = QFile::encodeName(workingDirectory);
+    if (!directory.isEmpty()) {
+        posix_spawn_file_actions_addchdir_np(&fileActions, directory.constData());
+    }
+#endif
+
+    // Children start with default signal handling and mask, whatever the event loop set up.
+    // SIGKILL and SIGSTOP can't be reset: glibc before 2.24 fails the spawn if asked to.
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    sigfillset(&signals);
+    sigdelset(&signals, SIGKILL);
+    sigdelset(&signals, SIGSTOP);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    timer.start();
+    int result = posix_spawn(&pid, argv.front(), &fileActions, &attributes, argv.data(), environ);
+    spawnLatency = timer.nsecsElapsed() / 1000;
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&fileActions);
+    ::close(stdoutPipe[1]);
+    ::close(stderrPipe[1]);
+
+    if (result != 0) {
+        *errorMessage = QString::fromLatin1(strerror(result));
+        pid = -1;
+        ::close(stdoutPipe[0]);
+        ::close(stderrPipe[0]);
+        return false;
+    }
+
+    outputFds[0] = stdoutPipe[0];
+    outputFds[1] = stderrPipe[0];
+    return true;
+}
+
+void ProcessLauncher::Private::readOutput(int channel)
+{
+    if (outputFds[channel] < 0) {
+        return;
+    }
+
+    char buffer[16384];
+    while (true) {
+        ssize_t size = ::read(outputFds[channel], buffer, sizeof(buffer));
+        if (size < 0 && errno == EINTR) {
+            continue;
+        } else if (size <= 0) {
+            if (size == 0 || errno != EAGAIN) {
+                // EOF: the child and whatever inherited the pipe are gone.
+                outputNotifiers[channel]->setEnabled(false);
+                ::close(outputFds[channel]);
+                outputFds[channel] = -1;
+            }
+            return;
+        }
+
+        QByteArray data(buffer, size);
+        if (observer) {
+            observer(channel, data);
+        }
+        LogSink::instance()->append(logTag, data);
+    }
+}
+
+void ProcessLauncher::Private::reap()
+{
+    if (pid <= 0) {
+        return;
+    }
+
+    int status = 0;
+    pid_t result = waitpid(pid, &status, WNOHANG);
+    if (result == 0 || (result < 0 && errno == EINTR)) {
+        return;
+    }
+
+    runTime = timer.elapsed();
+    bool exited = result == pid && WIFEXITED(status);
+    if (exited) {
+        exitCode = WEXITSTATUS(status);
+    }
+    pid = -1;
+
+    // Whatever the child wrote last may still sit in the pipes.
+    readOutput(0);
+    readOutput(1);
+    cleanup();
+
+    // The worker may go away as soon as the operation reports back: get the output on disk first.
+    LogSink::instance()->endStream(logTag);
+    LogSink::instance()->flush();
+
+    qCDebug(processLauncherDC) << program << "spawned in" << spawnLatency << "us, reaped after" << runTime << "ms with exit code" << exitCode;
+
+    if (timedOut) {
+        q->setFinishedWithError(QStringLiteral("process_timeout"), QStringLiteral("%1 did not finish within %2 ms").arg(program).arg(timeout));
+    } else if (!exited) {
+        q->setFinishedWithError(QStringLiteral("process_crashed"), QStringLiteral("%1 did not exit normally").arg(program));
+    } else if (exitCode != 0) {
+        q->setFinishedWithError(QStringLiteral("process_failed"), QStringLiteral("%1 exited with code %2").arg(program).arg(exitCode));
+    } else {
+        q->setFinished();
+    }
+}
+
+void ProcessLauncher::Private::cleanup()
+{
+    // This runs from their own signals, hence deleteLater.
+    for (int channel = 0; channel < 2; ++channel) {
+        if (outputNotifiers[channel]) {
+            outputNotifiers[channel]->setEnabled(false);
+            outputNotifiers[channel]->deleteLater();
+            outputNotifiers[channel] = nullptr;
+        }
+        if (outputFds[channel] >= 0) {
+            ::close(outputFds[channel]);
+            outputFds[channel] = -1;
+        }
+    }
+
+    if (pidNotifier) {
+        pidNotifier->setEnabled(false);
+        pidNotifier->deleteLater();
+        pidNotifier = nullptr;
+    }
+    if (pidFd >= 0) {
+        ::close(pidFd);
+        pidFd = -1;
+    }
+
+    QObject::disconnect(childSignalConnection);
+    if (timeoutTimer) {
+        timeoutTimer->stop();
+        timeoutTimer->deleteLater();
+        timeoutTimer = nullptr;
+    }
+}
+
+ProcessLauncher::ProcessLauncher(const QString &program, const QStringList &arguments, QObject *parent)
+    : Operation(Operation::ExplicitStartOption, parent)
+    , d(new Private(this))
+{
+    d->program = program;
+    d->arguments = arguments;
+    d->logTag = QFileInfo(program).fileName();
+}
+
+ProcessLauncher::~ProcessLauncher()
+{
+    // Don't leave the child running, nor a zombie behind.
+    if (d->pid > 0) {
+        ::kill(d->pid, SIGKILL);
+        waitpid(d->pid, nullptr, 0);
+    }
+    d->cleanup();
+    delete d;
+}
+
+void ProcessLauncher::setLogTag(const QString &tag)
+{
+    d->logTag = tag;
+}
+
+void ProcessLauncher::setOutputObserver(const std::function<void(int channel, const QByteArray &data)> &observer)
+{
+    d->observer = observer;
+}
+
+void ProcessLauncher::setWorkingDirectory(const QString &directory)
+{
+    d->workingDirectory = directory;
+}
+
+void ProcessLauncher::setTimeout(int timeout)
+{
+    d->timeout = timeout;
+}
+
+QString ProcessLauncher::program() const
+{
+    return d->program;
+}
+
+QStringList ProcessLauncher::arguments() const
+{
+    return d->arguments;
+}
+
+int ProcessLauncher::exitCode() const
+{
+    return d->exitCode;
+}
+
+bool ProcessLauncher::isTimedOut() const
+{
+    return d->timedOut;
+}
+
+qint64 ProcessLauncher::spawnLatency() const
+{
+    return d->spawnLatency;
+}
+
+qint64 ProcessLauncher::runTime() const
+{
+    return d->runTime;
+}
+
+void ProcessLauncher::startImpl()
+{
+    QString errorMessage;
+    if (!d->spawn(&errorMessage)) {
+        qCWarning(processLauncherDC) << "Could not launch" << d->program << ":" << errorMessage;
+        setFinishedWithError(QStringLiteral(PROCESS_SPAWN_FAILED_ERROR), QStringLiteral("Could not launch %1: %2").arg(d->program, errorMessage));
+        return;
+    }
+
+    for (int channel = 0; channel < 2; ++channel) {
+        d->outputNotifiers[channel] = new QSocketNotifier(d->outputFds[channel], QSocketNotifier::Read);
+        connect(d->outputNotifiers[channel], &QSocketNotifier::activated, this, [this, channel] {
+            d->readOutput(channel);
+        });
+    }
+
+    // A pidfd becomes readable when the child exits, no SIGCHLD handling to share with anybody else.
+#ifdef SYS_pidfd_open
+    d->pidFd = syscall(SYS_pidfd_open, d->pid, 0);
+#endif
+    if (d->pidFd >= 0) {
+        d->pidNotifier = new QSocketNotifier(d->pidFd, QSocketNotifier::Read);
+        connect(d->pidNotifier, &QSocketNotifier::activated, this, [this] {
+            d->reap();
+        });
+    } else if (QSocketNotifier *notifier = childSignalNotifier()) {
+        d->childSignalConnection = connect(notifier, &QSocketNotifier::activated, this, [this] {
+            d->reap();
+        });
+    } else {
+        ::kill(d->pid, SIGKILL);
+        waitpid(d->pid, nullptr, 0);
+        d->pid = -1;
+        d->cleanup();
+        setFinishedWithError(QStringLiteral(PROCESS_SPAWN_FAILED_ERROR), QStringLiteral("Could not watch %1 for its exit").arg(d->program));
+        return;
+    }
+
+    if (d->timeout > 0) {
+        d->timeoutTimer = new QTimer;
+        d->timeoutTimer->setSingleShot(true);
+        connect(d->timeoutTimer, &QTimer::timeout, this, [this] {
+            qCWarning(processLauncherDC) << d->program << "timed out after" << d->timeout << "ms, killing it";
+            d->timedOut = true;
+            ::kill(d->pid, SIGKILL);
+        });
+        d->timeoutTimer->start(d->timeout);
+    }
+
+    // The child may have exited before the SIGCHLD handler was in place.
+    if (d->pidFd < 0) {
+        d->reap();
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef PROCESS_LAUNCHER_
+#define PROCESS_LAUNCHER_
+
+#include <QtCore/QStringList>
+
+#include <HemeraCore/Operation>
+
+#include <functional>
+
+// Error name of launches that never got to run the program.
+#define PROCESS_SPAWN_FAILED_ERROR "process_spawn_failed"
+
+/// Runs @p program through posix_spawn and logs its output to LogSink. Finishes when it exits, with an error unless it exited with 0.
+/// The child is reaped through a pidfd where the kernel has them, on SIGCHLD otherwise.
+class ProcessLauncher : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ProcessLauncher)
+
+public:
+    explicit ProcessLauncher(const QString &program, const QStringList &arguments, QObject *parent = nullptr);
+    virtual ~ProcessLauncher();
+
+    /// Tag of the output in the log, the program file name by default.
+    void setLogTag(const QString &tag);
+    /// Sees all output before it gets logged, along with its channel: 0 for standard output, 1 for standard error.
+    void setOutputObserver(const std::function<void(int channel, const QByteArray &data)> &observer);
+    /// Needs posix_spawn_file_actions_addchdir_np (glibc 2.29): the launch fails without it.
+    void setWorkingDirectory(const QString &directory);
+    /// Kills the program if it runs longer than @p timeout milliseconds.
+    void setTimeout(int timeout);
+
+    QString program() const;
+    QStringList arguments() const;
+
+    /// -1 if the program didn't run or didn't exit on its own.
+    int exitCode() const;
+    bool isTimedOut() const;
+
+    /// Microseconds it took to spawn the program.
+    qint64 spawnLatency() const;
+    /// Milliseconds from spawning the program to reaping it.
+    qint64 runTime() const;
+
+protected:
+    virtual void startImpl();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif
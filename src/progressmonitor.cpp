@@ -0,0 +1,79 @@
+#include "progressmonitor.h"
+
+#include "progressreporter.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QTimer>
+
+#define PROGRESS_POLL_INTERVAL 250
+
+class ProgressMonitor::Private
+{
+public:
+    Private()
+        : timer(nullptr)
+        , offset(0)
+    {}
+
+    QTimer *timer;
+    qint64 offset;
+    QByteArray pending;
+};
+
+ProgressMonitor::ProgressMonitor(QObject *parent)
+    : QObject(parent)
+    , d(new Private)
+{
+    d->timer = new QTimer(this);
+    d->timer->setInterval(PROGRESS_POLL_INTERVAL);
+    connect(d->timer, &QTimer::timeout, this, &ProgressMonitor::poll);
+}
+
+ProgressMonitor::~ProgressMonitor()
+{
+    delete d;
+}
+
+void ProgressMonitor::start()
+{
+    // Whatever is already in there belongs to a previous run.
+    d->offset = QFile(QStringLiteral(PROGRESS_CHANNEL_PATH)).size();
+    d->pending.clear();
+    d->timer->start();
+}
+
+void ProgressMonitor::stop()
+{
+    poll();
+    d->timer->stop();
+}
+
+void ProgressMonitor::poll()
+{
+    QFile channel(QStringLiteral(PROGRESS_CHANNEL_PATH));
+    if (!channel.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    if (channel.size() < d->offset) {
+        // Channel has been recreated.
+        d->offset = 0;
+        d->pending.clear();
+    }
+
+    channel.seek(d->offset);
+    QByteArray data = channel.readAll();
+    d->offset += data.size();
+    d->pending.append(data);
+
+    int newline;
+    while ((newline = d->pending.indexOf('\n')) >= 0) {
+        QJsonObject message = QJsonDocument::fromJson(d->pending.left(newline)).object();
+        d->pending.remove(0, newline + 1);
+        if (!message.isEmpty()) {
+            Q_EMIT event(message);
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef PROGRESSMONITOR_H_
+#define PROGRESSMONITOR_H_
+
+#include <QtCore/QObject>
+
+class QJsonObject;
+
+class ProgressMonitor : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ProgressMonitor)
+
+public:
+    explicit ProgressMonitor(QObject *parent = nullptr);
+    virtual ~ProgressMonitor();
+
+    void start();
+    void stop();
+
+public Q_SLOTS:
+    /// Reads whatever root operations appended to the channel since the last call.
+    void poll();
+
+Q_SIGNALS:
+    void event(const QJsonObject &event);
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif
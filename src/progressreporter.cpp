@@ -0,0 +1,73 @@
+#include "progressreporter.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QLoggingCategory>
+
+Q_LOGGING_CATEGORY(progressReporterDC, "com.ispirata.Hemera.FlashUtility.Logging.ProgressReporter")
+
+class ProgressReporter::Private
+{
+public:
+    Private()
+        : total(0)
+        , lastPercentage(-1)
+    {}
+
+    QString source;
+    qint64 total;
+    int lastPercentage;
+};
+
+ProgressReporter::ProgressReporter(const QString &source)
+    : d(new Private)
+{
+    d->source = source;
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    delete d;
+}
+
+void ProgressReporter::setTotal(qint64 total)
+{
+    d->total = total;
+    d->lastPercentage = -1;
+}
+
+void ProgressReporter::setCompleted(qint64 completed, const QJsonObject &details)
+{
+    if (d->total <= 0) {
+        return;
+    }
+
+    int percentage = qBound(0, static_cast<int>((completed * 100) / d->total), 100);
+    if (percentage == d->lastPercentage) {
+        return;
+    }
+    d->lastPercentage = percentage;
+
+    qCDebug(progressReporterDC) << d->source << "at" << percentage << "%";
+    QJsonObject event = details;
+    event.insert(QStringLiteral("progress"), percentage);
+    event.insert(QStringLiteral("completed"), completed);
+    event.insert(QStringLiteral("total"), d->total);
+    sendEvent(event);
+}
+
+void ProgressReporter::sendEvent(const QJsonObject &event)
+{
+    QJsonObject message = event;
+    message.insert(QStringLiteral("source"), d->source);
+
+    // Open in append mode every time: several operations may share the channel during a run.
+    QFile channel(QStringLiteral(PROGRESS_CHANNEL_PATH));
+    if (!channel.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qCWarning(progressReporterDC) << "Could not open progress channel:" << channel.errorString();
+        return;
+    }
+
+    channel.write(QJsonDocument(message).toJson(QJsonDocument::Compact) + '\n');
+}
@@ -0,0 +1,29 @@
+#ifndef PROGRESSREPORTER_H_
+#define PROGRESSREPORTER_H_
+
+#include <QtCore/QJsonObject>
+#include <QtCore/QString>
+
+// Root operations append one JSON object per line here, FlashTool follows it through ProgressMonitor.
+#define PROGRESS_CHANNEL_PATH "/tmp/flashutility-progress"
+
+class ProgressReporter
+{
+public:
+    explicit ProgressReporter(const QString &source);
+    ~ProgressReporter();
+
+    void setTotal(qint64 total);
+    /// Reports progress on the channel whenever the completed percentage changes, along with @p details.
+    void setCompleted(qint64 completed, const QJsonObject &details = QJsonObject());
+
+    void sendEvent(const QJsonObject &event);
+
+private:
+    Q_DISABLE_COPY(ProgressReporter)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
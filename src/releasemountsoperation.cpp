@@ -0,0 +1,66 @@
+#include "releasemountsoperation.h"
+
+#include "mountmanager.h"
+#include "processlauncher.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QLoggingCategory>
+
+#include <unistd.h>
+
+#define UMOUNT_PATH "/bin/umount"
+
+Q_LOGGING_CATEGORY(releaseMountsOperationDC, "com.ispirata.Hemera.FlashUtility.Logging.ReleaseMountsOperation")
+
+class ReleaseMountsOperation::Private
+{
+public:
+    Private()
+        : pending(0)
+    {}
+
+    int pending;
+};
+
+ReleaseMountsOperation::ReleaseMountsOperation(const QString &id, QObject *parent)
+    : RootOperation(id, parent)
+    , d(new Private)
+{
+}
+
+ReleaseMountsOperation::~ReleaseMountsOperation()
+{
+    delete d;
+}
+
+void ReleaseMountsOperation::startImpl()
+{
+    // Filesystems kept mounted for a following action are left behind if the run stops before it.
+    QStringList mountPoints = MountManager::ownedMountPoints();
+    if (mountPoints.isEmpty()) {
+        setFinished();
+        return;
+    }
+
+    ::sync();
+
+    // Best effort: a mount we can't get rid of is no reason to fail the run, nor to hide its outcome.
+    d->pending = mountPoints.count();
+    for (const QString &mountPoint : mountPoints) {
+        qCInfo(releaseMountsOperationDC) << "Unmounting leftover" << mountPoint;
+        ProcessLauncher *umount = new ProcessLauncher(QStringLiteral(UMOUNT_PATH), QStringList { mountPoint }, this);
+        connect(umount, &Hemera::Operation::finished, this, [this, umount, mountPoint] {
+            if (umount->isError()) {
+                qCWarning(releaseMountsOperationDC) << "Could not unmount" << mountPoint << ":" << umount->errorMessage();
+            } else {
+                QDir().rmdir(mountPoint);
+            }
+            if (--d->pending == 0) {
+                setFinished();
+            }
+        });
+        umount->start();
+    }
+}
+
+ROOT_OPERATION_WORKER(ReleaseMountsOperation, "com.ispirata.Hemera.FlashUtility.ReleaseMountsOperation")
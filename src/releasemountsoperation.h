@@ -0,0 +1,23 @@
+#ifndef RELEASEMOUNTS_OPERATION_
+#define RELEASEMOUNTS_OPERATION_
+
+#include <HemeraCore/RootOperation>
+
+class ReleaseMountsOperation : public Hemera::RootOperation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ReleaseMountsOperation)
+
+public:
+    explicit ReleaseMountsOperation(const QString &id, QObject *parent = nullptr);
+    virtual ~ReleaseMountsOperation();
+
+protected:
+    virtual void startImpl();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif
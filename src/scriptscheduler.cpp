@@ -0,0 +1,206 @@
+#include "scriptscheduler.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QSet>
+#include <QtCore/QStringList>
+
+#include <HemeraCore/Literals>
+#include <HemeraCore/RootOperationClient>
+
+// Scripts without a concurrency class share this one, and run one at a time.
+#define DEFAULT_CONCURRENCY_CLASS "default"
+
+Q_LOGGING_CATEGORY(scriptSchedulerDC, "com.ispirata.Hemera.FlashUtility.Logging.ScriptScheduler")
+
+class ScriptScheduler::Private
+{
+public:
+    enum class State {
+        Pending,
+        Running,
+        Succeeded,
+        Failed
+    };
+
+    struct Script {
+        Script()
+            : state(State::Pending)
+            , startedAt(0)
+            , finishedAt(0)
+        {}
+
+        QString id;
+        QStringList dependsOn;
+        QString concurrencyClass;
+        QJsonObject parameters;
+        State state;
+        qint64 startedAt;
+        qint64 finishedAt;
+    };
+
+    Private(ScriptScheduler *q)
+        : q(q)
+        , running(0)
+    {}
+
+    bool isReady(const Script &script) const;
+    void schedule();
+    void launch(int index);
+    void logStatistics() const;
+
+    ScriptScheduler * const q;
+
+    QList<Script> scripts;
+    QHash<QString, int> indexes;
+    QSet<QString> busyClasses;
+    int running;
+    QElapsedTimer timer;
+    QString errorName;
+    QString errorMessage;
+};
+
+bool ScriptScheduler::Private::isReady(const Script &script) const
+{
+    if (script.state != State::Pending || busyClasses.contains(script.concurrencyClass)) {
+        return false;
+    }
+    for (const QString &dependency : script.dependsOn) {
+        if (scripts.at(indexes.value(dependency)).state != State::Succeeded) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ScriptScheduler::Private::schedule()
+{
+    // After a failure, let running scripts end but don't start anything new.
+    if (errorName.isEmpty()) {
+        for (int i = 0; i < scripts.count(); ++i) {
+            if (isReady(scripts.at(i))) {
+                launch(i);
+            }
+        }
+    }
+
+    if (running > 0) {
+        return;
+    }
+
+    logStatistics();
+
+    if (errorName.isEmpty()) {
+        for (const Script &script : scripts) {
+            if (script.state == State::Pending) {
+                // Nothing runs and nothing can start: the dependencies go round in circles.
+                q->setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                                        QStringLiteral("Script %1 can never run, check its depends_on").arg(script.id));
+                return;
+            }
+        }
+        q->setFinished();
+    } else {
+        q->setFinishedWithError(errorName, errorMessage);
+    }
+}
+
+void ScriptScheduler::Private::launch(int index)
+{
+    Script &script = scripts[index];
+    script.state = State::Running;
+    script.startedAt = timer.elapsed();
+    busyClasses.insert(script.concurrencyClass);
+    ++running;
+
+    qCInfo(scriptSchedulerDC) << "Starting script" << script.id << "in class" << script.concurrencyClass << "at" << script.startedAt << "ms";
+
+    Hemera::RootOperationClient *toolOp = new Hemera::RootOperationClient(QStringLiteral("com.ispirata.Hemera.FlashUtility.ToolOperation"),
+                                                                            script.parameters, Hemera::Operation::ExplicitStartOption, q);
+    QObject::connect(toolOp, &Hemera::Operation::finished, q, [this, index] (Hemera::Operation *operation) {
+        Script &script = scripts[index];
+        script.finishedAt = timer.elapsed();
+        script.state = operation->isError() ? State::Failed : State::Succeeded;
+        busyClasses.remove(script.concurrencyClass);
+        --running;
+
+        if (operation->isError()) {
+            qCWarning(scriptSchedulerDC) << "Script" << script.id << "failed after" << script.finishedAt - script.startedAt << "ms:"
+                                         << operation->errorMessage();
+            if (errorName.isEmpty()) {
+                errorName = operation->errorName();
+                errorMessage = operation->errorMessage();
+            }
+        } else {
+            qCInfo(scriptSchedulerDC) << "Script" << script.id << "finished in" << script.finishedAt - script.startedAt << "ms";
+        }
+
+        Q_EMIT q->scriptFinished(script.parameters, !operation->isError());
+        schedule();
+    });
+
+    Q_EMIT q->scriptStarted(script.parameters);
+    toolOp->start();
+}
+
+void ScriptScheduler::Private::logStatistics() const
+{
+    qint64 busyTime = 0;
+    for (const Script &script : scripts) {
+        if (script.state == State::Succeeded || script.state == State::Failed) {
+            qint64 duration = script.finishedAt - script.startedAt;
+            busyTime += duration;
+            qCInfo(scriptSchedulerDC) << "Script" << script.id << "waited" << script.startedAt << "ms, ran" << duration << "ms";
+        }
+    }
+
+    qCInfo(scriptSchedulerDC) << scripts.count() << "scripts took" << timer.elapsed() << "ms, for" << busyTime << "ms of script time";
+}
+
+ScriptScheduler::ScriptScheduler(const QJsonArray &scripts, int defaultTimeout, QObject *parent)
+    : Operation(Operation::ExplicitStartOption, parent)
+    , d(new Private(this))
+{
+    for (const QJsonValue &scriptValue : scripts) {
+        Private::Script script;
+        script.parameters = scriptValue.toObject();
+        script.id = script.parameters.value(QStringLiteral("id")).toString(QStringLiteral("script%1").arg(d->scripts.count()));
+        script.concurrencyClass = script.parameters.value(QStringLiteral("concurrency")).toString(QStringLiteral(DEFAULT_CONCURRENCY_CLASS));
+        for (const QJsonValue &dependency : script.parameters.value(QStringLiteral("depends_on")).toArray()) {
+            script.dependsOn.append(dependency.toString());
+        }
+        if (defaultTimeout > 0 && !script.parameters.contains(QStringLiteral("timeout"))) {
+            script.parameters.insert(QStringLiteral("timeout"), defaultTimeout);
+        }
+
+        d->indexes.insert(script.id, d->scripts.count());
+        d->scripts.append(script);
+    }
+}
+
+ScriptScheduler::~ScriptScheduler()
+{
+    delete d;
+}
+
+void ScriptScheduler::startImpl()
+{
+    if (d->indexes.count() != d->scripts.count()) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                             QStringLiteral("Script ids must be unique"));
+        return;
+    }
+    for (const Private::Script &script : d->scripts) {
+        for (const QString &dependency : script.dependsOn) {
+            if (!d->indexes.contains(dependency)) {
+                setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                                     QStringLiteral("Script %1 depends on unknown script %2").arg(script.id, dependency));
+                return;
+            }
+        }
+    }
+
+    d->timer.start();
+    d->schedule();
+}
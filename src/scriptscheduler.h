@@ -0,0 +1,33 @@
+#ifndef SCRIPT_SCHEDULER_
+#define SCRIPT_SCHEDULER_
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonObject>
+
+#include <HemeraCore/Operation>
+
+/// Runs the scripts of sysrestore.json through ToolOperation, each as soon as the scripts it depends_on are done.
+/// Scripts sharing a concurrency class run one at a time, so without ids or classes they run in order, as before.
+class ScriptScheduler : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ScriptScheduler)
+
+public:
+    /// Scripts without a timeout of their own get @p defaultTimeout seconds, or as long as they take if 0.
+    explicit ScriptScheduler(const QJsonArray &scripts, int defaultTimeout = 0, QObject *parent = nullptr);
+    virtual ~ScriptScheduler();
+
+Q_SIGNALS:
+    void scriptStarted(const QJsonObject &script);
+    void scriptFinished(const QJsonObject &script, bool success);
+
+protected:
+    virtual void startImpl();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif
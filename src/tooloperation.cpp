@@ -1,10 +1,12 @@
 #include "tooloperation.h"
 
+#include "processlauncher.h"
+
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonObject>
-#include <QtCore/QProcess>
 
 #include <HemeraCore/Literals>
 
@@ -12,12 +14,10 @@ class ToolOperation::Private
 {
 public:
     Private()
-        : process(nullptr),
-          success(false)
+        : success(false)
     {}
     QString toolPath;
     QStringList toolArgs;
-    QProcess *process;
     bool success;
 };
 
@@ -45,18 +45,15 @@ void ToolOperation::startImpl()
         return;
     }
 
-    d->process = new QProcess(this);
-
-    connect(d->process, &QProcess::readyReadStandardOutput, this, [this] () {
-        qDebug() << d->process->readAllStandardOutput();
-    });
-    connect(d->process, &QProcess::readyReadStandardError, this, [this] () {
-        qDebug() << d->process->readAllStandardError();
-    });
-    QObject::connect(d->process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-                     this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        d->success = ((exitStatus == QProcess::NormalExit) && (exitCode == 0));
-        if (d->success) {
+    ProcessLauncher *launcher = new ProcessLauncher(d->toolPath, d->toolArgs, this);
+    launcher->setLogTag(QFileInfo(d->toolPath).fileName());
+    QObject::connect(launcher, &Hemera::Operation::finished, this, [this, launcher] {
+        d->success = !launcher->isError();
+        qDebug() << d->toolPath << "ran for" << launcher->runTime() << "ms";
+        if (launcher->isTimedOut()) {
+            setFinishedWithError(QStringLiteral("tool_execution_timeout"),
+                                 QStringLiteral("%1 did not finish in time").arg(d->toolPath));
+        } else if (d->success) {
             setFinished();
         } else {
             setFinishedWithError(QStringLiteral("tool_execution_failed"),
@@ -64,8 +61,15 @@ void ToolOperation::startImpl()
                                  return;
         }
     });
+
+    // In seconds. A hung script would otherwise hold up the whole flashing forever.
+    int timeout = parameters().value(QStringLiteral("timeout")).toInt(0);
+    if (timeout > 0) {
+        launcher->setTimeout(timeout * 1000);
+    }
+
     qDebug() << "Launching: " << d->toolPath << " " << d->toolArgs;
-    d->process->start(d->toolPath, d->toolArgs);
+    launcher->start();
 }
 
 ROOT_OPERATION_WORKER(ToolOperation, "com.ispirata.Hemera.FlashUtility.ToolOperation")
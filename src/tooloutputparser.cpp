@@ -0,0 +1,253 @@
+#include "tooloutputparser.h"
+
+#include "progressreporter.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QRegExp>
+
+#define MAX_PENDING_OUTPUT 4096
+
+Q_LOGGING_CATEGORY(toolOutputParserDC, "com.ispirata.Hemera.FlashUtility.Logging.ToolOutputParser")
+
+namespace {
+
+// ubiformat: flashing eraseblock 12 -- 4 % complete
+class UbiformatParser : public ToolOutputParser
+{
+public:
+    UbiformatParser(const QString &source)
+        : ToolOutputParser(source)
+        , m_pattern(QStringLiteral("eraseblock (\\d+) -- +(\\d+) % complete"))
+        , m_lastEraseblock(-1)
+        , m_eraseblocks(0)
+    {}
+
+protected:
+    virtual QString unit() const
+    {
+        return QStringLiteral("eraseblocks");
+    }
+
+    virtual bool parseLine(const QByteArray &line, qint64 *completed, qint64 *total, qint64 *processed)
+    {
+        if (m_pattern.indexIn(QString::fromLatin1(line)) < 0) {
+            return false;
+        }
+
+        // Formatting and flashing go through the eraseblocks again, the percentage restarts along with them.
+        int eraseblock = m_pattern.cap(1).toInt();
+        if (eraseblock != m_lastEraseblock) {
+            m_lastEraseblock = eraseblock;
+            ++m_eraseblocks;
+        }
+        *completed = m_pattern.cap(2).toLongLong();
+        *total = 100;
+        *processed = m_eraseblocks;
+        return true;
+    }
+
+private:
+    QRegExp m_pattern;
+    int m_lastEraseblock;
+    qint64 m_eraseblocks;
+};
+
+// flash_erase: Erasing 128 Kibyte @ 1e0000 -- 15 % complete
+class FlashEraseParser : public ToolOutputParser
+{
+public:
+    FlashEraseParser(const QString &source)
+        : ToolOutputParser(source)
+        , m_pattern(QStringLiteral("Erasing (\\d+) Kibyte @ ([0-9a-fA-F]+) -- +(\\d+) % complete"))
+        , m_erased(0)
+    {}
+
+protected:
+    virtual QString unit() const
+    {
+        return QStringLiteral("bytes");
+    }
+
+    virtual bool parseLine(const QByteArray &line, qint64 *completed, qint64 *total, qint64 *processed)
+    {
+        if (m_pattern.indexIn(QString::fromLatin1(line)) < 0) {
+            return false;
+        }
+
+        m_erased += m_pattern.cap(1).toLongLong() * 1024;
+        *completed = m_pattern.cap(3).toLongLong();
+        *total = 100;
+        *processed = m_erased;
+        return true;
+    }
+
+private:
+    QRegExp m_pattern;
+    qint64 m_erased;
+};
+
+// nandwrite: Writing data to block 42 at offset 0x540000
+class NandwriteParser : public ToolOutputParser
+{
+public:
+    NandwriteParser(const QString &source)
+        : ToolOutputParser(source)
+        , m_pattern(QStringLiteral("Writing data to block \\d+ at offset 0x([0-9a-fA-F]+)"))
+        , m_firstOffset(-1)
+    {}
+
+protected:
+    virtual QString unit() const
+    {
+        return QStringLiteral("bytes");
+    }
+
+    virtual bool parseLine(const QByteArray &line, qint64 *completed, qint64 *total, qint64 *processed)
+    {
+        Q_UNUSED(total)
+
+        if (m_pattern.indexIn(QString::fromLatin1(line)) < 0) {
+            return false;
+        }
+
+        // Offsets are on the device, and skipped bad blocks count as written: close enough.
+        qint64 offset = m_pattern.cap(1).toLongLong(nullptr, 16);
+        if (m_firstOffset < 0) {
+            m_firstOffset = offset;
+        }
+        *completed = offset - m_firstOffset;
+        *processed = *completed;
+        return true;
+    }
+
+private:
+    QRegExp m_pattern;
+    qint64 m_firstOffset;
+};
+
+// kobs-ng -v: one "Writing" (or "Writting") line per FCB, DBBT and boot stream copy.
+class KobsParser : public ToolOutputParser
+{
+public:
+    KobsParser(const QString &source)
+        : ToolOutputParser(source)
+        , m_pattern(QStringLiteral("Writt?ing "))
+        , m_writes(0)
+    {}
+
+protected:
+    virtual QString unit() const
+    {
+        return QStringLiteral("structures");
+    }
+
+    virtual bool parseLine(const QByteArray &line, qint64 *completed, qint64 *total, qint64 *processed)
+    {
+        Q_UNUSED(total)
+
+        if (m_pattern.indexIn(QString::fromLatin1(line)) < 0) {
+            return false;
+        }
+
+        *completed = ++m_writes;
+        *processed = m_writes;
+        return true;
+    }
+
+private:
+    QRegExp m_pattern;
+    qint64 m_writes;
+};
+
+}
+
+class ToolOutputParser::Private
+{
+public:
+    Private(const QString &source)
+        : reporter(source)
+        , total(0)
+        , reportedTotal(-1)
+    {}
+
+    ProgressReporter reporter;
+    // Standard output and error, so that an error doesn't cut a progress line in two.
+    QByteArray pending[2];
+    qint64 total;
+    qint64 reportedTotal;
+    QElapsedTimer timer;
+};
+
+ToolOutputParser *ToolOutputParser::create(const QString &tool, const QString &source)
+{
+    if (tool == QStringLiteral("ubiformat")) {
+        return new UbiformatParser(source);
+    } else if (tool == QStringLiteral("flash_erase")) {
+        return new FlashEraseParser(source);
+    } else if (tool == QStringLiteral("nandwrite")) {
+        return new NandwriteParser(source);
+    } else if (tool == QStringLiteral("kobs-ng")) {
+        return new KobsParser(source);
+    }
+
+    qCDebug(toolOutputParserDC) << "No progress can be read from" << tool;
+    return nullptr;
+}
+
+ToolOutputParser::ToolOutputParser(const QString &source)
+    : d(new Private(source))
+{
+}
+
+ToolOutputParser::~ToolOutputParser()
+{
+    delete d;
+}
+
+void ToolOutputParser::setTotal(qint64 total)
+{
+    d->total = total;
+}
+
+void ToolOutputParser::feed(int channel, const QByteArray &data)
+{
+    if (!d->timer.isValid()) {
+        d->timer.start();
+    }
+    QByteArray &pending = d->pending[channel == 1 ? 1 : 0];
+    pending.append(data);
+
+    int start = 0;
+    for (int i = 0; i < pending.size(); ++i) {
+        char c = pending.at(i);
+        if (c != '\n' && c != '\r') {
+            continue;
+        }
+
+        QByteArray line = pending.mid(start, i - start);
+        start = i + 1;
+
+        qint64 completed = 0;
+        qint64 processed = 0;
+        if (line.isEmpty() || !parseLine(line, &completed, &d->total, &processed) || d->total <= 0) {
+            continue;
+        }
+
+        if (d->total != d->reportedTotal) {
+            d->reporter.setTotal(d->total);
+            d->reportedTotal = d->total;
+        }
+
+        qint64 elapsed = qMax(Q_INT64_C(1), d->timer.elapsed());
+        d->reporter.setCompleted(completed, QJsonObject { { QStringLiteral("unit"), unit() },
+                                                          { QStringLiteral("processed"), processed },
+                                                          { QStringLiteral("throughput"), (processed * 1000) / elapsed } });
+    }
+
+    pending.remove(0, start);
+    // A tool that never ends its lines is not going to tell us anything.
+    if (pending.size() > MAX_PENDING_OUTPUT) {
+        pending.clear();
+    }
+}
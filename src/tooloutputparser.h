@@ -0,0 +1,36 @@
+#ifndef TOOLOUTPUTPARSER_H_
+#define TOOLOUTPUTPARSER_H_
+
+#include <QtCore/QString>
+
+/// Turns the progress a flashing tool prints into progress events on the channel, as native operations report it.
+class ToolOutputParser
+{
+public:
+    /// Parser for the output of @p tool, reporting as @p source. nullptr if nothing is known about @p tool.
+    static ToolOutputParser *create(const QString &tool, const QString &source);
+    virtual ~ToolOutputParser();
+
+    /// For tools that don't print how much there is to do, in the unit of what they do print.
+    void setTotal(qint64 total);
+
+    /// Parses whatever complete lines @p data brings on @p channel, each channel being split into lines on its own.
+    /// Progress bars redraw with \r, so that ends a line as well.
+    void feed(int channel, const QByteArray &data);
+
+protected:
+    explicit ToolOutputParser(const QString &source);
+
+    /// What processed counts, for throughput.
+    virtual QString unit() const = 0;
+    /// Extracts progress from @p line, leaving @p total alone if the line doesn't tell. False if there's no progress in it.
+    virtual bool parseLine(const QByteArray &line, qint64 *completed, qint64 *total, qint64 *processed) = 0;
+
+private:
+    Q_DISABLE_COPY(ToolOutputParser)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
@@ -1,9 +1,10 @@
 #include "ubiattachdetachoperation.h"
 
+#include "processlauncher.h"
+
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QFile>
 #include <QtCore/QJsonObject>
-#include <QtCore/QProcess>
 #include <QtCore/QTimer>
 
 #include <HemeraCore/Literals>
@@ -43,7 +44,7 @@ void UBIAttachDetachOperation::startImpl()
     QString parentDevice = parameters().value(QStringLiteral("parent_device")).toString();
     d->parentMTD = QString(parentDevice).remove(QStringLiteral("/dev/mtd")).toInt(&validParentMTD);
 
-    QProcess *mtdProcess;
+    ProcessLauncher *mtdProcess;
 
     if (!validParentMTD) {
         setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()), QStringLiteral("Unable to detect a valid MTD device from %1").arg(parentDevice));
@@ -56,28 +57,19 @@ void UBIAttachDetachOperation::startImpl()
         mtdProcess = attachMTD(d->parentMTD);
     }
 
-    connect(mtdProcess, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished), this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        if ((exitStatus == QProcess::NormalExit) && (exitCode == 0)) {
+    connect(mtdProcess, &Hemera::Operation::finished, this, [this, mtdProcess] {
+        if (!mtdProcess->isError()) {
             setFinished();
         } else {
-            qCWarning(ubiUpdateLog) << "Error: failed to attach/detach MTD: " << d->parentMTD << " exit status: " << exitStatus << ", code: " << exitCode;
+            qCWarning(ubiUpdateLog) << "Error: failed to attach/detach MTD: " << d->parentMTD << ":" << mtdProcess->errorMessage() << ", code: " << mtdProcess->exitCode();
             setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Failed to attach/detach MTD (%1)").arg(d->parentMTD));
         }
     });
 }
 
-QProcess *UBIAttachDetachOperation::attachMTD(int mtd)
+ProcessLauncher *UBIAttachDetachOperation::attachMTD(int mtd)
 {
-    QProcess *ubiAttach = new QProcess(this);
-    ubiAttach->setProgram(QStringLiteral(UBIATTACH_PATH));
-    ubiAttach->setArguments(QStringList { QStringLiteral("-m"), QString::number(mtd) });
-
-    connect(ubiAttach, &QProcess::readyReadStandardOutput, ubiAttach, [ubiAttach] () {
-        qCDebug(ubiUpdateLog) << "attach vol: " << ubiAttach->readAllStandardOutput();
-    });
-    connect(ubiAttach, &QProcess::readyReadStandardError, ubiAttach, [ubiAttach] () {
-        qCDebug(ubiUpdateLog) << "attach vol: " << ubiAttach->readAllStandardError();
-    });
+    ProcessLauncher *ubiAttach = new ProcessLauncher(QStringLiteral(UBIATTACH_PATH), QStringList { QStringLiteral("-m"), QString::number(mtd) }, this);
 
     QTimer::singleShot(0, ubiAttach, [ubiAttach]() {
         qCDebug(ubiUpdateLog) << "Launching: " UBIATTACH_PATH " " << ubiAttach->arguments();
@@ -87,18 +79,9 @@ QProcess *UBIAttachDetachOperation::attachMTD(int mtd)
     return ubiAttach;
 }
 
-QProcess *UBIAttachDetachOperation::detachMTD(int mtd)
+ProcessLauncher *UBIAttachDetachOperation::detachMTD(int mtd)
 {
-    QProcess *ubiDetach = new QProcess(this);
-    ubiDetach->setProgram(QStringLiteral(UBIDETACH_PATH));
-    ubiDetach->setArguments(QStringList { QStringLiteral("-m"), QString::number(mtd) });
-
-    connect(ubiDetach, &QProcess::readyReadStandardOutput, ubiDetach, [ubiDetach] () {
-        qCDebug(ubiUpdateLog) << "detach vol: " << ubiDetach->readAllStandardOutput();
-    });
-    connect(ubiDetach, &QProcess::readyReadStandardError, ubiDetach, [ubiDetach] () {
-        qCDebug(ubiUpdateLog) << "detach vol: " << ubiDetach->readAllStandardError();
-    });
+    ProcessLauncher *ubiDetach = new ProcessLauncher(QStringLiteral(UBIDETACH_PATH), QStringList { QStringLiteral("-m"), QString::number(mtd) }, this);
 
     QTimer::singleShot(0, ubiDetach, [ubiDetach]() {
         qCDebug(ubiUpdateLog) << "Launching: " UBIDETACH_PATH " " << ubiDetach->arguments();
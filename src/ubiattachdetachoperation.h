@@ -3,7 +3,7 @@
 
 #include <HemeraCore/RootOperation>
 
-class QProcess;
+class ProcessLauncher;
 
 class UBIAttachDetachOperation : public Hemera::RootOperation
 {
@@ -21,8 +21,8 @@ private:
     class Private;
     Private * const d;
 
-    QProcess *attachMTD(int mtd);
-    QProcess *detachMTD(int mtd);
+    ProcessLauncher *attachMTD(int mtd);
+    ProcessLauncher *detachMTD(int mtd);
 };
 
 #endif
@@ -1,28 +1,454 @@
 #include "ubiformatoperation.h"
 
+#include "badblockmap.h"
+#include "crc32.h"
+#include "processlauncher.h"
+#include "progressreporter.h"
+#include "tooloutputparser.h"
+
 #include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QFile>
 #include <QtCore/QJsonObject>
-#include <QtCore/QProcess>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QtEndian>
 
 #include <HemeraCore/Literals>
 
+#include <mtd/mtd-user.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <functional>
+
 #define UBIFORMAT_PATH "/usr/sbin/ubiformat"
 
+#define UBI_EC_HDR_MAGIC 0x55424923
+#define UBI_EC_HDR_SIZE 64
+#define UBI_EC_HDR_SIZE_CRC (UBI_EC_HDR_SIZE - 4)
+#define UBI_VID_HDR_SIZE 64
+#define UBI_VERSION 1
+
+// How many image PEBs the reader may prepare ahead of the one being written.
+#define IMAGE_READ_AHEAD 4
+// Per-PEB timings are summed up and sent this often (ms), independently of the progress percentage.
+#define TIMING_REPORT_INTERVAL 250
+
+namespace {
+
+// Erase counter header, as laid out on flash (all fields big endian).
+struct UbiEcHeader {
+    quint32 magic;
+    quint8 version;
+    quint8 padding1[3];
+    quint64 ec;
+    quint32 vidHdrOffset;
+    quint32 dataOffset;
+    quint32 imageSeq;
+    quint8 padding2[32];
+    quint32 hdrCrc;
+} __attribute__((packed));
+
+static_assert(sizeof(UbiEcHeader) == UBI_EC_HDR_SIZE, "UBI EC header must be 64 bytes");
+
+qint64 readMtdAttribute(const QString &device, const QString &attribute)
+{
+    QFile attributeFile(QStringLiteral("/sys/class/mtd/%1/%2").arg(device.mid(device.lastIndexOf(QLatin1Char('/')) + 1), attribute));
+    if (!attributeFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return -1;
+    }
+
+    bool ok;
+    qint64 value = attributeFile.readAll().trimmed().toLongLong(&ok);
+    return ok ? value : -1;
+}
+
+void setEraseCounter(char *peb, quint64 ec)
+{
+    UbiEcHeader *header = reinterpret_cast<UbiEcHeader *>(peb);
+    header->ec = qToBigEndian(ec);
+    header->hdrCrc = qToBigEndian(Crc32::update(0xFFFFFFFF, header, UBI_EC_HDR_SIZE_CRC));
+}
+
+// Reads the UBI image PEB by PEB in its own thread, so the next PEB is ready as soon as the current one is written.
+class ImageReader : public QThread
+{
+public:
+    ImageReader(const QString &path, int pebSize)
+        : m_path(path)
+        , m_pebSize(pebSize)
+        , m_finished(false)
+        , m_failed(false)
+    {}
+
+    void run() Q_DECL_OVERRIDE
+    {
+        QFile image(m_path);
+        bool failed = !image.open(QIODevice::ReadOnly);
+
+        while (!failed && !image.atEnd()) {
+            QByteArray peb(m_pebSize, Qt::Uninitialized);
+            if (image.read(peb.data(), m_pebSize) != m_pebSize) {
+                failed = true;
+                break;
+            }
+
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.size() >= IMAGE_READ_AHEAD) {
+                m_notFull.wait(&m_mutex);
+            }
+            m_queue.enqueue(peb);
+            m_notEmpty.wakeAll();
+        }
+
+        QMutexLocker locker(&m_mutex);
+        m_failed = failed;
+        m_finished = true;
+        m_notEmpty.wakeAll();
+    }
+
+    /// Returns the next PEB of the image, or an empty array once it is over.
+    QByteArray takePeb(bool *failed)
+    {
+        QMutexLocker locker(&m_mutex);
+        while (m_queue.isEmpty() && !m_finished) {
+            m_notEmpty.wait(&m_mutex);
+        }
+        *failed = m_failed;
+        if (m_queue.isEmpty()) {
+            return QByteArray();
+        }
+        QByteArray peb = m_queue.dequeue();
+        m_notFull.wakeAll();
+        return peb;
+    }
+
+private:
+    QString m_path;
+    int m_pebSize;
+    QMutex m_mutex;
+    QWaitCondition m_notEmpty;
+    QWaitCondition m_notFull;
+    QQueue<QByteArray> m_queue;
+    bool m_finished;
+    bool m_failed;
+};
+
+// Runs the whole format, so that the worker's event loop keeps going meanwhile.
+class FormatThread : public QThread
+{
+public:
+    explicit FormatThread(const std::function<void()> &work)
+        : m_work(work)
+    {}
+
+    void run() Q_DECL_OVERRIDE
+    {
+        m_work();
+    }
+
+private:
+    std::function<void()> m_work;
+};
+
+}
+
 class UBIFormatOperation::Private
 {
 public:
     Private()
         : subpageSize(0)
-        , process(nullptr)
+        , fd(-1)
+        , badBlocks(nullptr)
+        , formatThread(nullptr)
+        , formatSucceeded(false)
     {}
 
+    bool format(QString *errorMessage);
+    bool scan(QString *errorMessage);
+    bool erasePeb(int peb);
+    bool writePeb(int peb, const QByteArray &data);
+
     QString device;
     QString image;
     int subpageSize;
-    QProcess *process;
+
+    int fd;
+    BadBlockMap *badBlocks;
+    mtd_info_user meminfo;
+    // Erase counter of each PEB, -1 for bad blocks.
+    QVector<qint64> eraseCounters;
+
+    QThread *formatThread;
+    bool formatSucceeded;
+    QString formatError;
 };
 
+bool UBIFormatOperation::Private::scan(QString *errorMessage)
+{
+    int pebCount = meminfo.size / meminfo.erasesize;
+    eraseCounters.fill(-2, pebCount);
+
+    badBlocks = new BadBlockMap(device);
+    if (!badBlocks->isValid()) {
+        *errorMessage = badBlocks->errorString();
+        return false;
+    }
+
+    qint64 ecSum = 0;
+    int ecCount = 0;
+    QElapsedTimer timer;
+    timer.start();
+
+    for (int peb = 0; peb < pebCount; ++peb) {
+        off_t offset = (off_t) peb * meminfo.erasesize;
+        if (badBlocks->isBad(peb)) {
+            eraseCounters[peb] = -1;
+            continue;
+        }
+
+        UbiEcHeader header;
+        if (pread(fd, &header, sizeof(header), offset) != (ssize_t) sizeof(header)) {
+            // Unreadable headers (e.g. ECC errors) just lose their counter.
+            continue;
+        }
+
+        if (qFromBigEndian(header.magic) == UBI_EC_HDR_MAGIC &&
+            qFromBigEndian(header.hdrCrc) == Crc32::update(0xFFFFFFFF, &header, UBI_EC_HDR_SIZE_CRC)) {
+            eraseCounters[peb] = qFromBigEndian(header.ec);
+            ecSum += eraseCounters.at(peb);
+            ++ecCount;
+        }
+    }
+
+    // PEBs without a valid header get the mean erase counter, as ubiformat does.
+    qint64 meanEc = ecCount > 0 ? ecSum / ecCount : 0;
+    for (qint64 &ec : eraseCounters) {
+        if (ec == -2) {
+            ec = meanEc;
+        }
+    }
+
+    qDebug() << "Scanned" << pebCount << "PEBs in" << timer.elapsed() << "ms:" << badBlocks->badBlockCount() << "bad," << ecCount
+             << "with a valid erase counter, mean erase counter" << meanEc;
+    return true;
+}
+
+bool UBIFormatOperation::Private::erasePeb(int peb)
+{
+    erase_info_user eraseInfo;
+    eraseInfo.start = peb * meminfo.erasesize;
+    eraseInfo.length = meminfo.erasesize;
+    return ioctl(fd, MEMERASE, &eraseInfo) == 0;
+}
+
+bool UBIFormatOperation::Private::writePeb(int peb, const QByteArray &data)
+{
+    // Trailing empty pages are left erased.
+    int length = data.size();
+    while (length > 0 && static_cast<quint8>(data.at(length - 1)) == 0xFF) {
+        --length;
+    }
+    length = ((length + meminfo.writesize - 1) / meminfo.writesize) * meminfo.writesize;
+    if (length == 0) {
+        return true;
+    }
+
+    return pwrite(fd, data.constData(), length, (off_t) peb * meminfo.erasesize) == length;
+}
+
+bool UBIFormatOperation::Private::format(QString *errorMessage)
+{
+    fd = ::open(device.toLatin1().constData(), O_RDWR);
+    if (fd < 0) {
+        *errorMessage = QStringLiteral("Could not open MTD device %1: %2").arg(device, QString::fromLatin1(strerror(errno)));
+        return false;
+    }
+
+    if (ioctl(fd, MEMGETINFO, &meminfo) != 0) {
+        *errorMessage = QStringLiteral("Could not get MTD information for %1").arg(device);
+        return false;
+    }
+
+    if (!scan(errorMessage)) {
+        return false;
+    }
+
+    int pebCount = eraseCounters.size();
+    int goodPebs = pebCount - eraseCounters.count(-1);
+
+    // Without an image, every PEB just gets an erase counter header.
+    QByteArray emptyPeb(meminfo.writesize, '\xFF');
+    // Like ubiformat, put the VID header at the MTD's subpage offset unless told otherwise: the kernel computes the same
+    // offset when attaching and refuses EC headers that disagree with it.
+    int vidHdrOffset = subpageSize;
+    if (vidHdrOffset <= 0) {
+        qint64 mtdSubpageSize = readMtdAttribute(device, QStringLiteral("subpagesize"));
+        vidHdrOffset = mtdSubpageSize > 0 ? mtdSubpageSize : meminfo.writesize;
+    }
+    qDebug() << "Using VID header offset" << vidHdrOffset << "on" << device;
+    UbiEcHeader *emptyHeader = reinterpret_cast<UbiEcHeader *>(emptyPeb.data());
+    memset(emptyHeader, 0, sizeof(UbiEcHeader));
+    emptyHeader->magic = qToBigEndian<quint32>(UBI_EC_HDR_MAGIC);
+    emptyHeader->version = UBI_VERSION;
+    emptyHeader->vidHdrOffset = qToBigEndian<quint32>(vidHdrOffset);
+    emptyHeader->dataOffset = qToBigEndian<quint32>(((vidHdrOffset + UBI_VID_HDR_SIZE + meminfo.writesize - 1) / meminfo.writesize) * meminfo.writesize);
+    quint32 imageSeq = 0;
+    QFile random(QStringLiteral("/dev/urandom"));
+    if (random.open(QIODevice::ReadOnly)) {
+        random.read(reinterpret_cast<char *>(&imageSeq), sizeof(imageSeq));
+    }
+    emptyHeader->imageSeq = qToBigEndian(imageSeq);
+
+    ImageReader *reader = nullptr;
+    qint64 imagePebs = 0;
+    if (!image.isEmpty()) {
+        qint64 imageSize = QFile(image).size();
+        if (imageSize % meminfo.erasesize != 0) {
+            *errorMessage = QStringLiteral("Image size is not a multiple of the eraseblock size");
+            return false;
+        }
+        imagePebs = imageSize / meminfo.erasesize;
+        if (imagePebs > goodPebs) {
+            *errorMessage = QStringLiteral("Image needs %1 PEBs, but only %2 are good").arg(imagePebs).arg(goodPebs);
+            return false;
+        }
+        reader = new ImageReader(image, meminfo.erasesize);
+        reader->start();
+    }
+
+    ProgressReporter progress(device);
+    progress.setTotal(pebCount);
+
+    qint64 eraseTime = 0;
+    qint64 writeTime = 0;
+    qint64 maxEraseTime = 0;
+    qint64 maxWriteTime = 0;
+    int formattedPebs = 0;
+    bool success = true;
+    QElapsedTimer timer;
+    QElapsedTimer reportTimer;
+    reportTimer.start();
+    int windowPebs = 0;
+    qint64 windowEraseTime = 0;
+    qint64 windowWriteTime = 0;
+    qint64 windowMaxEraseTime = 0;
+    qint64 windowMaxWriteTime = 0;
+    auto reportTiming = [&] (int peb) {
+        progress.sendEvent(QJsonObject { { QStringLiteral("peb"), peb },
+                                         { QStringLiteral("pebs"), windowPebs },
+                                         { QStringLiteral("erase_us"), windowEraseTime / windowPebs },
+                                         { QStringLiteral("write_us"), windowWriteTime / windowPebs },
+                                         { QStringLiteral("max_erase_us"), windowMaxEraseTime },
+                                         { QStringLiteral("max_write_us"), windowMaxWriteTime },
+                                         { QStringLiteral("average_erase_us"), eraseTime / formattedPebs },
+                                         { QStringLiteral("average_write_us"), writeTime / formattedPebs } });
+        reportTimer.start();
+        windowPebs = 0;
+        windowEraseTime = 0;
+        windowWriteTime = 0;
+        windowMaxEraseTime = 0;
+        windowMaxWriteTime = 0;
+    };
+
+    int lastPeb = -1;
+    for (int peb = 0; peb < pebCount && success; ++peb) {
+        if (eraseCounters.at(peb) < 0) {
+            progress.setCompleted(peb + 1);
+            continue;
+        }
+
+        timer.start();
+        if (!erasePeb(peb)) {
+            qWarning() << "Failed to erase PEB" << peb << ", marking it bad:" << strerror(errno);
+            if (!badBlocks->markBad(peb)) {
+                qWarning() << "PEB" << peb << "is left unformatted, but not marked bad:" << badBlocks->errorString();
+            }
+            if (imagePebs > --goodPebs) {
+                *errorMessage = QStringLiteral("Not enough good PEBs left for the image");
+                success = false;
+            }
+            continue;
+        }
+        qint64 pebEraseTime = timer.nsecsElapsed() / 1000;
+
+        QByteArray data;
+        if (reader && formattedPebs < imagePebs) {
+            bool failed;
+            data = reader->takePeb(&failed);
+            if (failed || data.isEmpty()) {
+                *errorMessage = QStringLiteral("Could not read from image file %1").arg(image);
+                success = false;
+                break;
+            }
+            if (formattedPebs == 0) {
+                // All PEBs must agree with the image on sequence number and header offsets.
+                const UbiEcHeader *imageHeader = reinterpret_cast<const UbiEcHeader *>(data.constData());
+                emptyHeader->vidHdrOffset = imageHeader->vidHdrOffset;
+                emptyHeader->dataOffset = imageHeader->dataOffset;
+                emptyHeader->imageSeq = imageHeader->imageSeq;
+            }
+        } else {
+            data = emptyPeb;
+        }
+        setEraseCounter(data.data(), eraseCounters.at(peb) + 1);
+
+        timer.start();
+        if (!writePeb(peb, data)) {
+            *errorMessage = QStringLiteral("Failed to write PEB %1: %2").arg(peb).arg(QString::fromLatin1(strerror(errno)));
+            success = false;
+            break;
+        }
+        qint64 pebWriteTime = timer.nsecsElapsed() / 1000;
+
+        ++formattedPebs;
+        eraseTime += pebEraseTime;
+        writeTime += pebWriteTime;
+        maxEraseTime = qMax(maxEraseTime, pebEraseTime);
+        maxWriteTime = qMax(maxWriteTime, pebWriteTime);
+
+        progress.setCompleted(peb + 1);
+
+        ++windowPebs;
+        windowEraseTime += pebEraseTime;
+        windowWriteTime += pebWriteTime;
+        windowMaxEraseTime = qMax(windowMaxEraseTime, pebEraseTime);
+        windowMaxWriteTime = qMax(windowMaxWriteTime, pebWriteTime);
+        lastPeb = peb;
+        if (reportTimer.elapsed() >= TIMING_REPORT_INTERVAL) {
+            reportTiming(peb);
+        }
+    }
+    if (windowPebs > 0) {
+        reportTiming(lastPeb);
+    }
+
+    if (reader) {
+        // Unblock the reader if we bailed out early.
+        bool failed;
+        while (!reader->takePeb(&failed).isEmpty()) {
+        }
+        reader->wait();
+        delete reader;
+    }
+
+    if (formattedPebs > 0) {
+        qDebug() << "Formatted" << formattedPebs << "PEBs," << imagePebs << "from image. Erase: average" << eraseTime / formattedPebs
+                 << "us, max" << maxEraseTime << "us. Write: average" << writeTime / formattedPebs << "us, max" << maxWriteTime << "us.";
+    }
+
+    return success;
+}
+
 UBIFormatOperation::UBIFormatOperation(const QString &id, QObject *parent)
     : RootOperation(id, parent)
     , d(new Private)
@@ -31,6 +457,14 @@ UBIFormatOperation::UBIFormatOperation(const QString &id, QObject *parent)
 
 UBIFormatOperation::~UBIFormatOperation()
 {
+    if (d->formatThread) {
+        d->formatThread->wait();
+        delete d->formatThread;
+    }
+    if (d->fd >= 0) {
+        ::close(d->fd);
+    }
+    delete d->badBlocks;
     delete d;
 }
 
@@ -54,7 +488,21 @@ void UBIFormatOperation::startImpl()
         return;
     }
 
-    d->process = new QProcess(this);
+    if (parameters().value(QStringLiteral("native")).toBool(true)) {
+        d->formatThread = new FormatThread([this] {
+            d->formatSucceeded = d->format(&d->formatError);
+        });
+        connect(d->formatThread, &QThread::finished, this, [this] {
+            if (!d->formatSucceeded) {
+                qWarning() << d->formatError;
+                setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), d->formatError);
+                return;
+            }
+            setFinished();
+        }, Qt::QueuedConnection);
+        d->formatThread->start();
+        return;
+    }
 
     QStringList args;
     args << d->device;
@@ -72,15 +520,13 @@ void UBIFormatOperation::startImpl()
     // Non-interactive.
     args << QStringLiteral("-y");
 
-    connect(d->process, &QProcess::readyReadStandardOutput, this, [this] () {
-        qDebug() << d->process->readAllStandardOutput();
-    });
-    connect(d->process, &QProcess::readyReadStandardError, this, [this] () {
-        qDebug() << d->process->readAllStandardError();
+    QSharedPointer<ToolOutputParser> parser(ToolOutputParser::create(QStringLiteral("ubiformat"), d->device));
+    ProcessLauncher *launcher = new ProcessLauncher(QStringLiteral(UBIFORMAT_PATH), args, this);
+    launcher->setOutputObserver([parser] (int channel, const QByteArray &data) {
+        parser->feed(channel, data);
     });
-    QObject::connect(d->process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-                     this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        if ((exitStatus == QProcess::NormalExit) && (exitCode == 0)) {
+    QObject::connect(launcher, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        if (!operation->isError()) {
             setFinished();
         } else {
             setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Failed to format MTD."));
@@ -88,7 +534,7 @@ void UBIFormatOperation::startImpl()
     });
 
     qDebug() << "Launching: " UBIFORMAT_PATH " " << args;
-    d->process->start(QStringLiteral(UBIFORMAT_PATH), args);
+    launcher->start();
 }
 
 ROOT_OPERATION_WORKER(UBIFormatOperation, "com.ispirata.Hemera.FlashUtility.UBIFormatOperation")
@@ -1,17 +1,37 @@
 #include "ubiupdatevoloperation.h"
 
+#include "compressedimage.h"
+#include "logsink.h"
+#include "processlauncher.h"
+#include "progressreporter.h"
+
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QFile>
+#include <QtCore/QJsonArray>
 #include <QtCore/QJsonObject>
 #include <QtCore/QProcess>
 #include <QtCore/QTimer>
 
 #include <HemeraCore/Literals>
 
+#include <mtd/ubi-user.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
 #define UBIATTACH_PATH "/usr/sbin/ubiattach"
 #define UBIDETACH_PATH "/usr/sbin/ubidetach"
 #define UBIMKVOL_PATH "/usr/sbin/ubimkvol"
-#define UBIUPDATEVOL_PATH "/usr/sbin/ubiupdatevol"
+#define UBIRSVOL_PATH "/usr/sbin/ubirsvol"
+
+#define VOLUME_WRITE_CHUNK_SIZE (128 * 1024)
+
+// Data type hint of LEB changes: the kernel ignores it since 2012, and its UAPI header no longer names the values.
+// Older kernels expect 3, "unknown".
+#define UBI_DTYPE_UNKNOWN 3
 
 Q_LOGGING_CATEGORY(ubiUpdateLog, "com.ispirata.Hemera.FlashUtility.Logging.UBIUpdateVolOperation")
 
@@ -27,6 +47,31 @@ public:
     bool immutable;
     bool validParentMTD;
     bool needToDetachMTD;
+    // Set on the first failure: the operation only waits for the MTD to be detached from then on.
+    bool failing;
+
+    // Volumes handled in this attach session, the fields above describe the current one.
+    QList<QJsonObject> volumes;
+    int currentVolume;
+    bool resizeVolumes;
+
+    CompressedImage *source;
+    ProgressReporter *progress;
+    QProcess *decompressor;
+    QFile *imageFile;
+    int volumeFd;
+    qint64 imageSize;
+    qint64 writtenBytes;
+
+    // Delta updates: only LEBs differing from the volume contents are replaced, atomically.
+    bool deltaUpdate;
+    qint64 lebSize;
+    int reservedLebs;
+    int currentLeb;
+    QByteArray lebBuffer;
+    int changedLebs;
+    int unchangedLebs;
+    int unmappedLebs;
 
     Private()
         : parentMTD(-1)
@@ -34,9 +79,208 @@ public:
         , immutable(false)
         , validParentMTD(false)
         , needToDetachMTD(false)
+        , failing(false)
+        , currentVolume(0)
+        , resizeVolumes(false)
+        , source(nullptr)
+        , progress(nullptr)
+        , decompressor(nullptr)
+        , imageFile(nullptr)
+        , volumeFd(-1)
+        , imageSize(-1)
+        , writtenBytes(0)
+        , deltaUpdate(false)
+        , lebSize(0)
+        , reservedLebs(0)
+        , currentLeb(0)
+        , changedLebs(0)
+        , unchangedLebs(0)
+        , unmappedLebs(0)
     {}
+
+    ~Private()
+    {
+        if (volumeFd >= 0) {
+            ::close(volumeFd);
+        }
+        delete source;
+        delete progress;
+        delete imageFile;
+    }
+
+    void loadVolume(const QJsonObject &volume);
+    int reservedEraseBlocks(int sizeInMiB, int *requestedEraseBlocks) const;
+    QByteArray volumeAttribute(const QString &attribute) const;
+
+    bool beginDeltaUpdate();
+    bool appendDeltaData(const char *data, qint64 size);
+    bool finishDeltaUpdate();
+    bool commitLeb(const QByteArray &data);
 };
 
+void UBIUpdateVolOperation::Private::loadVolume(const QJsonObject &volume)
+{
+    device = volume.value(QStringLiteral("target")).toString();
+    image = volume.value(QStringLiteral("source")).toString();
+    name = volume.value(QStringLiteral("name")).toString();
+    sizeInMiB = volume.value(QStringLiteral("size")).toInt();
+    immutable = volume.value(QStringLiteral("immutable")).toBool();
+    deltaUpdate = volume.value(QStringLiteral("update_mode")).toString() == QStringLiteral("delta");
+}
+
+QByteArray UBIUpdateVolOperation::Private::volumeAttribute(const QString &attribute) const
+{
+    QFile attributeFile(QStringLiteral("/sys/class/ubi/%1/%2").arg(device.mid(device.lastIndexOf(QLatin1Char('/')) + 1), attribute));
+    if (!attributeFile.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    return attributeFile.readAll().trimmed();
+}
+
+bool UBIUpdateVolOperation::Private::beginDeltaUpdate()
+{
+    // Atomic LEB change is only available on dynamic volumes.
+    if (volumeAttribute(QStringLiteral("type")) != "dynamic") {
+        qCInfo(ubiUpdateLog) << device << "is not a dynamic volume, falling back to a full update";
+        return false;
+    }
+
+    lebSize = volumeAttribute(QStringLiteral("usable_eb_size")).toLongLong();
+    reservedLebs = volumeAttribute(QStringLiteral("reserved_ebs")).toInt();
+    if (lebSize <= 0 || reservedLebs <= 0 || imageSize > lebSize * reservedLebs) {
+        qCInfo(ubiUpdateLog) << "Cannot compare" << image << "with" << device << ", falling back to a full update";
+        return false;
+    }
+
+    currentLeb = 0;
+    changedLebs = 0;
+    unchangedLebs = 0;
+    unmappedLebs = 0;
+    lebBuffer.clear();
+    lebBuffer.reserve(lebSize);
+    return true;
+}
+
+bool UBIUpdateVolOperation::Private::appendDeltaData(const char *data, qint64 size)
+{
+    while (size > 0) {
+        qint64 chunk = qMin(size, lebSize - lebBuffer.size());
+        lebBuffer.append(data, chunk);
+        data += chunk;
+        size -= chunk;
+
+        if (lebBuffer.size() == lebSize) {
+            if (!commitLeb(lebBuffer)) {
+                return false;
+            }
+            lebBuffer.clear();
+        }
+    }
+
+    return true;
+}
+
+bool UBIUpdateVolOperation::Private::finishDeltaUpdate()
+{
+    if (!lebBuffer.isEmpty() && !commitLeb(lebBuffer)) {
+        return false;
+    }
+
+    // Anything past the end of the image must read back as empty, as after a full update.
+    for (; currentLeb < reservedLebs; ++currentLeb) {
+        int32_t lnum = currentLeb;
+        int mapped = ioctl(volumeFd, UBI_IOCEBISMAP, &lnum);
+        if (mapped < 0) {
+            qCWarning(ubiUpdateLog) << "Error: could not check LEB" << lnum << "of" << device << ":" << strerror(errno);
+            return false;
+        } else if (mapped > 0) {
+            if (ioctl(volumeFd, UBI_IOCEBUNMAP, &lnum) != 0) {
+                qCWarning(ubiUpdateLog) << "Error: could not unmap LEB" << lnum << "of" << device << ":" << strerror(errno);
+                return false;
+            }
+            ++unmappedLebs;
+        }
+    }
+
+    qCInfo(ubiUpdateLog) << "Delta update of" << device << ":" << changedLebs << "LEBs changed," << unchangedLebs << "unchanged,"
+                         << unmappedLebs << "unmapped.";
+    return true;
+}
+
+bool UBIUpdateVolOperation::Private::commitLeb(const QByteArray &data)
+{
+    // Unmapped LEBs read back as 0xFF, so an empty LEB in the image compares equal to them.
+    QByteArray existing(static_cast<int>(lebSize), Qt::Uninitialized);
+    if (pread(volumeFd, existing.data(), lebSize, currentLeb * lebSize) != lebSize) {
+        qCWarning(ubiUpdateLog) << "Error: could not read LEB" << currentLeb << "of" << device << ":" << strerror(errno);
+        return false;
+    }
+
+    QByteArray padded = data;
+    if (padded.size() < lebSize) {
+        padded.append(QByteArray(static_cast<int>(lebSize) - padded.size(), '\xFF'));
+    }
+
+    int32_t lnum = currentLeb++;
+    if (padded == existing) {
+        ++unchangedLebs;
+        return true;
+    }
+
+    if (padded.count('\xFF') == padded.size()) {
+        if (ioctl(volumeFd, UBI_IOCEBUNMAP, &lnum) != 0) {
+            qCWarning(ubiUpdateLog) << "Error: could not unmap LEB" << lnum << "of" << device << ":" << strerror(errno);
+            return false;
+        }
+        ++unmappedLebs;
+        return true;
+    }
+
+    ubi_leb_change_req request;
+    memset(&request, 0, sizeof(request));
+    request.lnum = lnum;
+    request.bytes = data.size();
+    request.dtype = UBI_DTYPE_UNKNOWN;
+    if (ioctl(volumeFd, UBI_IOCEBCH, &request) != 0) {
+        qCWarning(ubiUpdateLog) << "Error: could not start change of LEB" << lnum << "of" << device << ":" << strerror(errno);
+        return false;
+    }
+
+    qint64 written = 0;
+    while (written < data.size()) {
+        ssize_t result = ::write(volumeFd, data.constData() + written, data.size() - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qCWarning(ubiUpdateLog) << "Error: could not write LEB" << lnum << "of" << device << ":" << strerror(errno);
+            return false;
+        }
+        written += result;
+    }
+
+    ++changedLebs;
+    return true;
+}
+
+int UBIUpdateVolOperation::Private::reservedEraseBlocks(int sizeInMiB, int *requestedEraseBlocks) const
+{
+    QString sysfsPath = QStringLiteral("/sys/class/ubi/%1/").arg(device.mid(device.lastIndexOf(QLatin1Char('/')) + 1));
+    QFile reservedFile(sysfsPath + QStringLiteral("reserved_ebs"));
+    QFile usableFile(sysfsPath + QStringLiteral("usable_eb_size"));
+    if (!reservedFile.open(QIODevice::ReadOnly) || !usableFile.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+
+    qint64 usableSize = usableFile.readAll().trimmed().toLongLong();
+    if (usableSize <= 0) {
+        return -1;
+    }
+
+    *requestedEraseBlocks = ((qint64) sizeInMiB * 1024 * 1024 + usableSize - 1) / usableSize;
+    return reservedFile.readAll().trimmed().toInt();
+}
+
 UBIUpdateVolOperation::UBIUpdateVolOperation(const QString &id, QObject *parent)
     : RootOperation(id, parent)
     , d(new Private)
@@ -50,38 +294,61 @@ UBIUpdateVolOperation::~UBIUpdateVolOperation()
 
 void UBIUpdateVolOperation::startImpl()
 {
-    bool validParentMTD;
-
-    d->device = parameters().value(QStringLiteral("target")).toString();
-    d->image = parameters().value(QStringLiteral("source")).toString();
-    d->name = parameters().value(QStringLiteral("name")).toString();
     QString parentDevice = parameters().value(QStringLiteral("parent_device")).toString();
     d->parentMTD = QString(parentDevice).remove(QStringLiteral("/dev/mtd")).toInt(&d->validParentMTD);
-    d->sizeInMiB = parameters().value(QStringLiteral("size")).toInt();
-    d->immutable = parameters().value(QStringLiteral("immutable")).toBool();
 
-    if (d->sizeInMiB < 1) {
-        qCWarning(ubiUpdateLog) << "Error: size in MiB cannot be less than 1, size: " << d->sizeInMiB;
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Size in MiB cannot be less than 1"));
-        return;
+    if (parameters().contains(QStringLiteral("volumes"))) {
+        // A whole volume table: created or resized as needed and filled within a single attach.
+        for (const QJsonValue &volumeValue : parameters().value(QStringLiteral("volumes")).toArray()) {
+            d->volumes.append(volumeValue.toObject());
+        }
+        d->resizeVolumes = true;
+    } else {
+        d->volumes.append(parameters());
     }
 
-    if (!d->image.isEmpty() && !QFile::exists(d->image)) {
-        qCWarning(ubiUpdateLog) << "Image file does not exists: " << d->image;
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Image file does not exist"));
+    if (d->volumes.isEmpty()) {
+        qCWarning(ubiUpdateLog) << "Error: no volumes specified";
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("No UBI volumes specified"));
         return;
-
-    } else if (d->image.isEmpty()) {
-        qCDebug(ubiUpdateLog) << "An empty volume will be created.";
     }
 
-    if (!d->device.contains(QLatin1Char('_'))) {
-        qCWarning(ubiUpdateLog) << "Error: specified parent UBI volume is not valid. device: " << d->device;
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Specified UBI volume is not valid"));
-        return;
+    for (const QJsonObject &volume : d->volumes) {
+        d->loadVolume(volume);
+
+        if (d->sizeInMiB < 1) {
+            qCWarning(ubiUpdateLog) << "Error: size in MiB cannot be less than 1, size: " << d->sizeInMiB;
+            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Size in MiB cannot be less than 1"));
+            return;
+        }
+
+        if (!d->image.isEmpty() && !QFile::exists(d->image)) {
+            qCWarning(ubiUpdateLog) << "Image file does not exists: " << d->image;
+            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Image file does not exist"));
+            return;
+
+        } else if (d->image.isEmpty()) {
+            qCDebug(ubiUpdateLog) << "An empty volume will be created.";
+        }
+
+        if (!d->device.contains(QLatin1Char('_'))) {
+            qCWarning(ubiUpdateLog) << "Error: specified parent UBI volume is not valid. device: " << d->device;
+            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Specified UBI volume is not valid"));
+            return;
+        }
+
+        QString parentUBI = d->device.split(QLatin1Char('_')).first();
+        if (!d->parentUBI.isEmpty() && parentUBI != d->parentUBI) {
+            qCWarning(ubiUpdateLog) << "Error: all volumes must belong to " << d->parentUBI << ", device: " << d->device;
+            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("UBI volumes belong to different devices"));
+            return;
+        }
+        d->parentUBI = parentUBI;
     }
 
-    d->parentUBI = d->device.split(QLatin1Char('_')).first();
+    d->currentVolume = 0;
+    d->loadVolume(d->volumes.first());
+
     if (!QFile::exists(d->parentUBI)) {
         qCDebug(ubiUpdateLog) << d->parentUBI << " doesn't exists. Need to attach it.";
 
@@ -92,11 +359,12 @@ void UBIUpdateVolOperation::startImpl()
         }
 
         d->needToDetachMTD = true;
-        connect(attachMTD(d->parentMTD), static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished), this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-            if ((exitStatus == QProcess::NormalExit) && (exitCode == 0)) {
+        ProcessLauncher *ubiAttach = attachMTD(d->parentMTD);
+        connect(ubiAttach, &Hemera::Operation::finished, this, [this, ubiAttach] {
+            if (!ubiAttach->isError()) {
                 prepareVolume();
             } else {
-                qCWarning(ubiUpdateLog) << "Error: failed to attach MTD: " << d->parentMTD << " exit status: " << exitStatus << ", code: " << exitCode;
+                qCWarning(ubiUpdateLog) << "Error: failed to attach MTD: " << d->parentMTD << ":" << ubiAttach->errorMessage() << ", code: " << ubiAttach->exitCode();
                 setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Failed to attach MTD"));
                 return;
             }
@@ -109,28 +377,45 @@ void UBIUpdateVolOperation::startImpl()
 
 void UBIUpdateVolOperation::prepareVolume()
 {
+    bool ok;
+    int volID = QString(d->device).remove(d->parentUBI + QLatin1Char('_')).toInt(&ok);
+    if (!ok) {
+        qWarning(ubiUpdateLog) << "Error: invalid UBI volume ID: device: " << d->device << " parent UBI: " << d->parentUBI;
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Invalid UBI volume ID"));
+        return;
+    }
+
     if (QFile::exists(d->device)) {
-        qCDebug(ubiUpdateLog) << "No need to create UBI volume";
-        doUpdateVol();
-    } else {
-        bool ok;
-        int volID = QString(d->device).remove(d->parentUBI + QLatin1Char('_')).toInt(&ok);
-        if (!ok) {
-            qWarning(ubiUpdateLog) << "Error: invalid UBI volume ID: device: " << d->device << " parent UBI: " << d->parentUBI;
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Invalid UBI volume ID"));
+        int requestedEraseBlocks = 0;
+        int reservedEraseBlocks = d->resizeVolumes ? d->reservedEraseBlocks(d->sizeInMiB, &requestedEraseBlocks) : -1;
+        if (reservedEraseBlocks < 0 || reservedEraseBlocks == requestedEraseBlocks) {
+            qCDebug(ubiUpdateLog) << "No need to create UBI volume";
+            doUpdateVol();
             return;
         }
-        connect(mkVolume(d->parentUBI, volID, d->name, d->sizeInMiB, d->immutable), static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished), this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-            if ((exitStatus == QProcess::NormalExit) && (exitCode == 0)) {
+
+        qCInfo(ubiUpdateLog) << "Resizing " << d->device << " from " << reservedEraseBlocks << " to " << requestedEraseBlocks << " LEBs";
+        ProcessLauncher *ubiRsVol = rsVolume(d->parentUBI, volID, d->sizeInMiB);
+        connect(ubiRsVol, &Hemera::Operation::finished, this, [this, ubiRsVol] {
+            if (!ubiRsVol->isError()) {
+                qCDebug(ubiUpdateLog) << "UBI volume succesfully resized";
+                d->deltaUpdate = false;
+                doUpdateVol();
+            } else {
+                qWarning(ubiUpdateLog) << "Failed to resize UBI volume: " << d->device << ":" << ubiRsVol->errorMessage() << ", code: " << ubiRsVol->exitCode();
+                failVolumeUpdate(QStringLiteral("Failed to resize UBI volume"));
+            }
+        });
+    } else {
+        ProcessLauncher *ubiMkVol = mkVolume(d->parentUBI, volID, d->name, d->sizeInMiB, d->immutable);
+        connect(ubiMkVol, &Hemera::Operation::finished, this, [this, ubiMkVol] {
+            if (!ubiMkVol->isError()) {
                 qCDebug(ubiUpdateLog) << "UBI volume succesfully created";
+                d->deltaUpdate = false;
                 doUpdateVol();
             } else {
-                qWarning(ubiUpdateLog) << "Failed to create UBI volume: " << d->device << " exit status: " << exitStatus << ", code: " << exitCode;
-                if (d->needToDetachMTD) {
-                    connect(detachMTD(d->parentMTD), static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished), this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-                        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Failed to create UBI volume"));
-                    });
-                }
+                qWarning(ubiUpdateLog) << "Failed to create UBI volume: " << d->device << ":" << ubiMkVol->errorMessage() << ", code: " << ubiMkVol->exitCode();
+                failVolumeUpdate(QStringLiteral("Failed to create UBI volume"));
             }
         });
     }
@@ -138,54 +423,251 @@ void UBIUpdateVolOperation::prepareVolume()
 
 void UBIUpdateVolOperation::doUpdateVol()
 {
-    QProcess *ubiUpdateVol = new QProcess(this);
+    delete d->progress;
+    delete d->source;
+    d->source = nullptr;
+    d->progress = new ProgressReporter(d->device);
 
-    connect(ubiUpdateVol, &QProcess::readyReadStandardOutput, ubiUpdateVol, [ubiUpdateVol] () {
-        qCDebug(ubiUpdateLog) << "update vol: " << ubiUpdateVol->readAllStandardOutput();
+    if (d->image.isEmpty()) {
+        // A zero-sized update just wipes the volume.
+        d->deltaUpdate = false;
+        if (beginVolumeUpdate(0)) {
+            finishVolumeUpdate();
+        }
+        return;
+    }
+
+    d->source = new CompressedImage(d->image);
+    d->imageSize = d->volumes.at(d->currentVolume).value(QStringLiteral("image_size")).toDouble(d->source->uncompressedSize());
+
+    if (!d->source->isCompressed()) {
+        if (!beginVolumeUpdate(d->imageSize)) {
+            return;
+        }
+
+        delete d->imageFile;
+        d->imageFile = new QFile(d->image);
+        if (!d->imageFile->open(QIODevice::ReadOnly)) {
+            failVolumeUpdate(QStringLiteral("Could not open image file"));
+            return;
+        }
+        streamFile();
+    } else if (d->imageSize < 0) {
+        // UBI needs to know the size upfront: decompress once just to count the bytes.
+        qCInfo(ubiUpdateLog) << d->image << "does not declare its uncompressed size, measuring it.";
+        streamImage(true);
+    } else {
+        streamImage(false);
+    }
+}
+
+void UBIUpdateVolOperation::streamFile()
+{
+    // One chunk per event loop iteration, like the decompressor output, so the worker stays responsive.
+    QByteArray buffer(VOLUME_WRITE_CHUNK_SIZE, Qt::Uninitialized);
+    qint64 readBytes = d->imageFile->read(buffer.data(), buffer.size());
+    if (readBytes < 0) {
+        qCWarning(ubiUpdateLog) << "Error: could not read " << d->image << ": " << d->imageFile->errorString();
+        failVolumeUpdate(QStringLiteral("Could not read image file"));
+        return;
+    }
+
+    if (readBytes == 0) {
+        delete d->imageFile;
+        d->imageFile = nullptr;
+        finishVolumeUpdate();
+        return;
+    }
+
+    if (writeVolumeData(buffer.constData(), readBytes)) {
+        QTimer::singleShot(0, this, [this] { streamFile(); });
+    }
+}
+
+void UBIUpdateVolOperation::streamImage(bool measureOnly)
+{
+    d->decompressor = new QProcess(this);
+    d->decompressor->setProgram(d->source->decompressorProgram());
+    d->decompressor->setArguments(d->source->decompressorArguments());
+
+    if (measureOnly) {
+        d->imageSize = 0;
+    } else if (!beginVolumeUpdate(d->imageSize)) {
+        return;
+    }
+
+    QProcess *decompressor = d->decompressor;
+    connect(decompressor, &QProcess::readyReadStandardOutput, this, [this, decompressor, measureOnly] () {
+        if (isFinished() || d->failing) {
+            decompressor->readAllStandardOutput();
+            return;
+        }
+        QByteArray data = decompressor->readAllStandardOutput();
+        if (measureOnly) {
+            d->imageSize += data.size();
+        } else if (!writeVolumeData(data.constData(), data.size())) {
+            decompressor->kill();
+        }
     });
-    connect(ubiUpdateVol, &QProcess::readyReadStandardError, ubiUpdateVol, [ubiUpdateVol] () {
-        qCDebug(ubiUpdateLog) << "update vol: " << ubiUpdateVol->readAllStandardError();
+    LogSink::instance()->attachErrors(decompressor, QStringLiteral("decompress"));
+    connect(decompressor, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished), this,
+            [this, decompressor, measureOnly] (int exitCode, QProcess::ExitStatus exitStatus) {
+        decompressor->deleteLater();
+        if (isFinished() || d->failing) {
+            return;
+        }
+        if ((exitStatus != QProcess::NormalExit) || (exitCode != 0)) {
+            qCWarning(ubiUpdateLog) << "Error: failed to decompress " << d->image << " exit status: " << exitStatus << ", code: " << exitCode;
+            failVolumeUpdate(QStringLiteral("Failed to decompress image"));
+            return;
+        }
+
+        // Drain anything left in the pipe before the process went away.
+        QByteArray data = decompressor->readAllStandardOutput();
+        if (measureOnly) {
+            d->imageSize += data.size();
+            qCInfo(ubiUpdateLog) << d->image << "uncompressed size is" << d->imageSize;
+            streamImage(false);
+        } else if (writeVolumeData(data.constData(), data.size())) {
+            finishVolumeUpdate();
+        }
     });
 
-    connect(ubiUpdateVol, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished), this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        if ((exitStatus == QProcess::NormalExit) && (exitCode == 0)) {
-            qCDebug(ubiUpdateLog) << "update vol succesfully finished";
-            if (d->needToDetachMTD) {
-                connect(detachMTD(d->parentMTD), static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished), this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-                    if (!((exitStatus == QProcess::NormalExit) && (exitCode == 0))) {
-                        qCWarning(ubiUpdateLog) << "Error: failed to detach MTD: " << d->parentMTD << " exit status: " << exitStatus << ", code: " << exitCode;
-                    }
-                    setFinished();
-                });
-            } else {
-                setFinished();
+    qCDebug(ubiUpdateLog) << "Launching: " << decompressor->program() << " " << decompressor->arguments();
+    decompressor->start();
+}
+
+bool UBIUpdateVolOperation::beginVolumeUpdate(qint64 size)
+{
+    d->volumeFd = ::open(d->device.toLatin1().constData(), O_RDWR);
+    if (d->volumeFd < 0) {
+        qCWarning(ubiUpdateLog) << "Error: could not open " << d->device << ": " << strerror(errno);
+        failVolumeUpdate(QStringLiteral("Could not open UBI volume"));
+        return false;
+    }
+
+    d->writtenBytes = 0;
+    d->progress->setTotal(size);
+    d->progress->setCompleted(0);
+
+    if (d->deltaUpdate) {
+        d->deltaUpdate = d->beginDeltaUpdate();
+        if (d->deltaUpdate) {
+            qCInfo(ubiUpdateLog) << "Delta updating " << d->device << " with " << size << " bytes from " << d->image;
+            return true;
+        }
+    }
+
+    int64_t bytes = size;
+    if (ioctl(d->volumeFd, UBI_IOCVOLUP, &bytes) != 0) {
+        qCWarning(ubiUpdateLog) << "Error: could not start update of " << d->device << " with " << size << " bytes: " << strerror(errno);
+        failVolumeUpdate(QStringLiteral("Could not start UBI volume update"));
+        return false;
+    }
+
+    qCInfo(ubiUpdateLog) << "Updating " << d->device << " with " << size << " bytes from " << d->image;
+    return true;
+}
+
+bool UBIUpdateVolOperation::writeVolumeData(const char *data, qint64 size)
+{
+    if (d->writtenBytes + size > d->imageSize) {
+        failVolumeUpdate(QStringLiteral("Image is larger than its declared size"));
+        return false;
+    }
+
+    if (d->deltaUpdate) {
+        if (!d->appendDeltaData(data, size)) {
+            failVolumeUpdate(QStringLiteral("Failed to delta update UBI volume"));
+            return false;
+        }
+        d->writtenBytes += size;
+        d->progress->setCompleted(d->writtenBytes);
+        return true;
+    }
+
+    qint64 written = 0;
+    while (written < size) {
+        ssize_t result = ::write(d->volumeFd, data + written, size - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-        } else {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Failed to update UBI volume"));
+            qCWarning(ubiUpdateLog) << "Error: write to " << d->device << " failed: " << strerror(errno);
+            failVolumeUpdate(QStringLiteral("Failed to update UBI volume"));
+            return false;
         }
-    });
+        written += result;
+    }
 
-    if (d->image.isEmpty()) {
-        qCDebug(ubiUpdateLog) << "Launching: " UBIUPDATEVOL_PATH " " << d->device;
-        ubiUpdateVol->start(QStringLiteral(UBIUPDATEVOL_PATH), QStringList { d->device });
+    d->writtenBytes += size;
+    d->progress->setCompleted(d->writtenBytes);
+    return true;
+}
+
+void UBIUpdateVolOperation::finishVolumeUpdate()
+{
+    if (d->writtenBytes != d->imageSize) {
+        qCWarning(ubiUpdateLog) << "Error: written " << d->writtenBytes << " bytes out of " << d->imageSize;
+        failVolumeUpdate(QStringLiteral("Image is smaller than its declared size"));
+        return;
+    }
+
+    if (d->deltaUpdate && !d->finishDeltaUpdate()) {
+        failVolumeUpdate(QStringLiteral("Failed to delta update UBI volume"));
+        return;
+    }
+
+    ::close(d->volumeFd);
+    d->volumeFd = -1;
+
+    qCDebug(ubiUpdateLog) << "update vol succesfully finished";
+    if (++d->currentVolume < d->volumes.count()) {
+        d->loadVolume(d->volumes.at(d->currentVolume));
+        prepareVolume();
+        return;
+    }
+
+    if (d->needToDetachMTD) {
+        ProcessLauncher *ubiDetach = detachMTD(d->parentMTD);
+        connect(ubiDetach, &Hemera::Operation::finished, this, [this, ubiDetach] {
+            if (ubiDetach->isError()) {
+                qCWarning(ubiUpdateLog) << "Error: failed to detach MTD: " << d->parentMTD << ":" << ubiDetach->errorMessage() << ", code: " << ubiDetach->exitCode();
+            }
+            setFinished();
+        });
     } else {
-        qCDebug(ubiUpdateLog) << "Launching: " UBIUPDATEVOL_PATH " " << d->device << " " << d->image;
-        ubiUpdateVol->start(QStringLiteral(UBIUPDATEVOL_PATH), QStringList { d->device, d->image });
+        setFinished();
     }
 }
 
-QProcess *UBIUpdateVolOperation::attachMTD(int mtd)
+void UBIUpdateVolOperation::failVolumeUpdate(const QString &message)
 {
-    QProcess *ubiAttach = new QProcess(this);
-    ubiAttach->setProgram(QStringLiteral(UBIATTACH_PATH));
-    ubiAttach->setArguments(QStringList { QStringLiteral("-m"), QString::number(mtd) });
+    if (d->failing) {
+        return;
+    }
+    d->failing = true;
 
-    connect(ubiAttach, &QProcess::readyReadStandardOutput, ubiAttach, [ubiAttach] () {
-        qCDebug(ubiUpdateLog) << "attach vol: " << ubiAttach->readAllStandardOutput();
-    });
-    connect(ubiAttach, &QProcess::readyReadStandardError, ubiAttach, [ubiAttach] () {
-        qCDebug(ubiUpdateLog) << "attach vol: " << ubiAttach->readAllStandardError();
-    });
+    if (d->volumeFd >= 0) {
+        // The volume is left marked as corrupted by the interrupted update.
+        ::close(d->volumeFd);
+        d->volumeFd = -1;
+    }
+
+    if (d->needToDetachMTD) {
+        d->needToDetachMTD = false;
+        connect(detachMTD(d->parentMTD), &Hemera::Operation::finished, this, [this, message] {
+            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), message);
+        });
+        return;
+    }
+
+    setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()), message);
+}
+
+ProcessLauncher *UBIUpdateVolOperation::attachMTD(int mtd)
+{
+    ProcessLauncher *ubiAttach = new ProcessLauncher(QStringLiteral(UBIATTACH_PATH), QStringList { QStringLiteral("-m"), QString::number(mtd) }, this);
 
     QTimer::singleShot(0, ubiAttach, [ubiAttach]() {
         qCDebug(ubiUpdateLog) << "Launching: " UBIATTACH_PATH " " << ubiAttach->arguments();
@@ -195,18 +677,9 @@ QProcess *UBIUpdateVolOperation::attachMTD(int mtd)
     return ubiAttach;
 }
 
-QProcess *UBIUpdateVolOperation::detachMTD(int mtd)
+ProcessLauncher *UBIUpdateVolOperation::detachMTD(int mtd)
 {
-    QProcess *ubiDetach = new QProcess(this);
-    ubiDetach->setProgram(QStringLiteral(UBIDETACH_PATH));
-    ubiDetach->setArguments(QStringList { QStringLiteral("-m"), QString::number(mtd) });
-
-    connect(ubiDetach, &QProcess::readyReadStandardOutput, ubiDetach, [ubiDetach] () {
-        qCDebug(ubiUpdateLog) << "detach vol: " << ubiDetach->readAllStandardOutput();
-    });
-    connect(ubiDetach, &QProcess::readyReadStandardError, ubiDetach, [ubiDetach] () {
-        qCDebug(ubiUpdateLog) << "detach vol: " << ubiDetach->readAllStandardError();
-    });
+    ProcessLauncher *ubiDetach = new ProcessLauncher(QStringLiteral(UBIDETACH_PATH), QStringList { QStringLiteral("-m"), QString::number(mtd) }, this);
 
     QTimer::singleShot(0, ubiDetach, [ubiDetach]() {
         qCDebug(ubiUpdateLog) << "Launching: " UBIDETACH_PATH " " << ubiDetach->arguments();
@@ -216,24 +689,17 @@ QProcess *UBIUpdateVolOperation::detachMTD(int mtd)
     return ubiDetach;
 }
 
-QProcess *UBIUpdateVolOperation::mkVolume(const QString &parentUBI, int volID, const QString &name, int sizeInMiB, bool immutable)
+ProcessLauncher *UBIUpdateVolOperation::mkVolume(const QString &parentUBI, int volID, const QString &name, int sizeInMiB, bool immutable)
 {
     QString label = name.isEmpty() ? QStringLiteral("vol%1").arg(volID) : name;
 
-    QProcess *ubiMkVol = new QProcess(this);
-    ubiMkVol->setProgram(QStringLiteral(UBIMKVOL_PATH));
-    ubiMkVol->setArguments(QStringList { parentUBI,
-                                         QStringLiteral("-N"), label,
-                                         QStringLiteral("-n"), QString::number(volID),
-                                         QStringLiteral("-s"), QString::number(sizeInMiB) + QStringLiteral("MiB"),
-                                         QStringLiteral("-t"), immutable ? QStringLiteral("static") : QStringLiteral("dynamic")});
-
-    connect(ubiMkVol, &QProcess::readyReadStandardOutput, ubiMkVol, [ubiMkVol] () {
-        qCDebug(ubiUpdateLog) << "mk vol: " << ubiMkVol->readAllStandardOutput();
-    });
-    connect(ubiMkVol, &QProcess::readyReadStandardError, ubiMkVol, [ubiMkVol] () {
-        qCDebug(ubiUpdateLog) << "mk vol: " << ubiMkVol->readAllStandardError();
-    });
+    ProcessLauncher *ubiMkVol = new ProcessLauncher(QStringLiteral(UBIMKVOL_PATH),
+                                                    QStringList { parentUBI,
+                                                                  QStringLiteral("-N"), label,
+                                                                  QStringLiteral("-n"), QString::number(volID),
+                                                                  QStringLiteral("-s"), QString::number(sizeInMiB) + QStringLiteral("MiB"),
+                                                                  QStringLiteral("-t"), immutable ? QStringLiteral("static") : QStringLiteral("dynamic")},
+                                                    this);
 
     QTimer::singleShot(0, ubiMkVol, [ubiMkVol]() {
         qCDebug(ubiUpdateLog) << "Launching: " UBIMKVOL_PATH " " << ubiMkVol->arguments();
@@ -243,4 +709,20 @@ QProcess *UBIUpdateVolOperation::mkVolume(const QString &parentUBI, int volID, c
     return ubiMkVol;
 }
 
+ProcessLauncher *UBIUpdateVolOperation::rsVolume(const QString &parentUBI, int volID, int sizeInMiB)
+{
+    ProcessLauncher *ubiRsVol = new ProcessLauncher(QStringLiteral(UBIRSVOL_PATH),
+                                                    QStringList { parentUBI,
+                                                                  QStringLiteral("-n"), QString::number(volID),
+                                                                  QStringLiteral("-s"), QString::number(sizeInMiB) + QStringLiteral("MiB")},
+                                                    this);
+
+    QTimer::singleShot(0, ubiRsVol, [ubiRsVol]() {
+        qCDebug(ubiUpdateLog) << "Launching: " UBIRSVOL_PATH " " << ubiRsVol->arguments();
+        ubiRsVol->start();
+    });
+
+    return ubiRsVol;
+}
+
 ROOT_OPERATION_WORKER(UBIUpdateVolOperation, "com.ispirata.Hemera.FlashUtility.UBIUpdateVolOperation")
@@ -3,7 +3,7 @@
 
 #include <HemeraCore/RootOperation>
 
-class QProcess;
+class ProcessLauncher;
 
 class UBIUpdateVolOperation : public Hemera::RootOperation
 {
@@ -21,11 +21,18 @@ private:
     class Private;
     Private * const d;
 
-    QProcess *attachMTD(int mtd);
-    QProcess *detachMTD(int mtd);
-    QProcess *mkVolume(const QString &parentUBI, int volID, const QString &label, int sizeInMiB, bool immutable);
+    ProcessLauncher *attachMTD(int mtd);
+    ProcessLauncher *detachMTD(int mtd);
+    ProcessLauncher *mkVolume(const QString &parentUBI, int volID, const QString &label, int sizeInMiB, bool immutable);
+    ProcessLauncher *rsVolume(const QString &parentUBI, int volID, int sizeInMiB);
     void prepareVolume();
     void doUpdateVol();
+    void streamFile();
+    void streamImage(bool measureOnly);
+    bool beginVolumeUpdate(qint64 size);
+    bool writeVolumeData(const char *data, qint64 size);
+    void finishVolumeUpdate();
+    void failVolumeUpdate(const QString &message);
 };
 
 #endif
@@ -1,5 +1,7 @@
 #include "ubootenvbackupoperation.h"
 
+#include "ubootenvironment.h"
+
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
 #include <QtCore/QJsonObject>
@@ -10,7 +12,7 @@
 #include <HemeraCore/Literals>
 
 #define FW_PRINTENV_PATH "/usr/sbin/fw_printenv"
-#define FW_ENV_CONFIG "/etc/fw_env.config"
+#define RAW_BACKUP_PATH "/tmp/u-boot_backup.bin"
 
 UBootEnvBackupOperation::UBootEnvBackupOperation(const QString &id, QObject *parent)
     : RootOperation(id, parent)
@@ -23,15 +25,27 @@ UBootEnvBackupOperation::~UBootEnvBackupOperation()
 
 void UBootEnvBackupOperation::startImpl()
 {
-    if (!QFile::exists(QStringLiteral(FW_PRINTENV_PATH))) {
+    if (!QFile::exists(QStringLiteral(FW_ENV_CONFIG))) {
         setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                             QStringLiteral("Error: " FW_PRINTENV_PATH " is not installed."));
+                             QStringLiteral("Error: Cannot read u-boot environment config."));
         return;
     }
 
-    if (!QFile::exists(QStringLiteral(FW_ENV_CONFIG))) {
+    // The blobs as they are on flash can be restored in a single write, the text dump only variable by variable.
+    UBootEnvironment environment;
+    bool rawBackup = environment.load() && environment.saveRawBackup(QStringLiteral(RAW_BACKUP_PATH));
+    if (!rawBackup) {
+        qWarning() << "Could not back up the raw u-boot environment:" << environment.errorString();
+        QFile::remove(QStringLiteral(RAW_BACKUP_PATH));
+    }
+
+    if (!QFile::exists(QStringLiteral(FW_PRINTENV_PATH))) {
+        if (rawBackup) {
+            setFinished();
+            return;
+        }
         setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                             QStringLiteral("Error: Cannot read u-boot environment config."));
+                             QStringLiteral("Error: " FW_PRINTENV_PATH " is not installed."));
         return;
     }
 
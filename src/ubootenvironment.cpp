@@ -0,0 +1,654 @@
+#include "ubootenvironment.h"
+
+#include "crc32.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QPair>
+#include <QtCore/QtEndian>
+
+#include <mtd/mtd-user.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// Flag values of redundant environments on NOR, where a single byte can be cleared without erasing.
+#define ENV_REDUND_OBSOLETE 0
+#define ENV_REDUND_ACTIVE 1
+
+Q_LOGGING_CATEGORY(ubootEnvironmentDC, "com.ispirata.Hemera.FlashUtility.Logging.UBootEnvironment")
+
+namespace {
+
+struct EnvCopy
+{
+    EnvCopy()
+        : offset(0)
+        , envSize(0)
+        , sectorSize(0)
+        , sectorCount(0)
+        , mtd(false)
+        , mtdType(0)
+        , valid(false)
+        , flags(0)
+    {}
+
+    QString device;
+    qint64 offset;
+    qint64 envSize;
+    qint64 sectorSize;
+    int sectorCount;
+    bool mtd;
+    int mtdType;
+    bool valid;
+    quint8 flags;
+};
+
+}
+
+class UBootEnvironment::Private
+{
+public:
+    Private()
+        : current(0)
+    {}
+
+    bool parseConfig();
+    bool probe(EnvCopy &copy);
+    bool openConfig();
+    /// Start offsets of the erase blocks holding @p copy, skipping bad ones on NAND.
+    bool blocks(int fd, const EnvCopy &copy, QList<qint64> *blockOffsets);
+    bool readCopy(EnvCopy &copy, QByteArray *data);
+    bool writeCopy(const EnvCopy &copy, const QByteArray &data);
+
+    int headerSize() const;
+    bool usesFlagScheme() const;
+    bool isValid(const QByteArray &data) const;
+    int selectCurrent() const;
+    void parseVariables(const QByteArray &data);
+    QByteArray serialize(quint8 flags) const;
+
+    QString configPath;
+    QString errorString;
+    QList<EnvCopy> copies;
+    int current;
+    QList<QByteArray> contents;
+    QList< QPair< QByteArray, QByteArray > > variables;
+    QList< QPair< QByteArray, QByteArray > > storedVariables;
+};
+
+bool UBootEnvironment::Private::parseConfig()
+{
+    QFile config(configPath);
+    if (!config.open(QIODevice::ReadOnly)) {
+        errorString = QStringLiteral("Cannot read u-boot environment config %1").arg(configPath);
+        return false;
+    }
+
+    // device offset env_size [sector_size [sector_count]], one line per copy
+    while (!config.atEnd() && copies.count() < 2) {
+        QByteArray line = config.readLine();
+        int comment = line.indexOf('#');
+        if (comment >= 0) {
+            line.truncate(comment);
+        }
+        QList<QByteArray> fields = line.simplified().split(' ');
+        if (fields.count() < 3 || fields.first().isEmpty()) {
+            continue;
+        }
+
+        EnvCopy copy;
+        bool ok[4] = { true, true, true, true };
+        copy.device = QString::fromLatin1(fields.at(0));
+        copy.offset = fields.at(1).toLongLong(&ok[0], 0);
+        copy.envSize = fields.at(2).toLongLong(&ok[1], 0);
+        copy.sectorSize = fields.count() > 3 ? fields.at(3).toLongLong(&ok[2], 0) : 0;
+        copy.sectorCount = fields.count() > 4 ? fields.at(4).toInt(&ok[3], 0) : 0;
+        if (!ok[0] || !ok[1] || !ok[2] || !ok[3] || copy.envSize <= 6) {
+            errorString = QStringLiteral("Invalid line in %1: %2").arg(configPath, QString::fromLatin1(line.trimmed()));
+            return false;
+        }
+        copies.append(copy);
+    }
+
+    if (copies.isEmpty()) {
+        errorString = QStringLiteral("No environment configured in %1").arg(configPath);
+        return false;
+    }
+    if (copies.count() == 2 && copies.at(0).envSize != copies.at(1).envSize) {
+        errorString = QStringLiteral("Redundant environments in %1 differ in size").arg(configPath);
+        return false;
+    }
+
+    return true;
+}
+
+bool UBootEnvironment::Private::probe(EnvCopy &copy)
+{
+    int fd = ::open(copy.device.toLatin1().constData(), O_RDONLY);
+    if (fd < 0) {
+        errorString = QStringLiteral("Could not open %1: %2").arg(copy.device, QString::fromLatin1(strerror(errno)));
+        return false;
+    }
+
+    mtd_info_user meminfo;
+    copy.mtd = ioctl(fd, MEMGETINFO, &meminfo) == 0;
+    ::close(fd);
+
+    if (copy.mtd) {
+        copy.mtdType = meminfo.type;
+        if (copy.sectorSize <= 0) {
+            copy.sectorSize = meminfo.erasesize;
+        }
+    } else if (copy.sectorSize <= 0) {
+        copy.sectorSize = copy.envSize;
+    }
+    if (copy.sectorCount <= 0) {
+        copy.sectorCount = (copy.envSize + copy.sectorSize - 1) / copy.sectorSize;
+    }
+
+    return true;
+}
+
+bool UBootEnvironment::Private::openConfig()
+{
+    copies.clear();
+    if (!parseConfig()) {
+        return false;
+    }
+    for (EnvCopy &copy : copies) {
+        if (!probe(copy)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool UBootEnvironment::Private::blocks(int fd, const EnvCopy &copy, QList<qint64> *blockOffsets)
+{
+    qint64 firstBlock = copy.offset - (copy.offset % copy.sectorSize);
+    int needed = ((copy.offset - firstBlock) + copy.envSize + copy.sectorSize - 1) / copy.sectorSize;
+
+    // Like fw_env, bad blocks are skipped within the sectors reserved for the copy.
+    for (int i = 0; i < qMax(needed, copy.sectorCount) && blockOffsets->count() < needed; ++i) {
+        loff_t blockOffset = firstBlock + i * copy.sectorSize;
+        if (copy.mtdType == MTD_NANDFLASH || copy.mtdType == MTD_MLCNANDFLASH) {
+            int result = ioctl(fd, MEMGETBADBLOCK, &blockOffset);
+            if (result < 0) {
+                errorString = QStringLiteral("Could not check for bad blocks on %1: %2").arg(copy.device, QString::fromLatin1(strerror(errno)));
+                return false;
+            } else if (result > 0) {
+                qCInfo(ubootEnvironmentDC) << "Skipping bad block at" << blockOffset << "of" << copy.device;
+                continue;
+            }
+        }
+        blockOffsets->append(blockOffset);
+    }
+
+    if (blockOffsets->count() < needed) {
+        errorString = QStringLiteral("Too many bad blocks in the environment of %1").arg(copy.device);
+        return false;
+    }
+    return true;
+}
+
+bool UBootEnvironment::Private::readCopy(EnvCopy &copy, QByteArray *data)
+{
+    int fd = ::open(copy.device.toLatin1().constData(), O_RDONLY);
+    if (fd < 0) {
+        errorString = QStringLiteral("Could not open %1: %2").arg(copy.device, QString::fromLatin1(strerror(errno)));
+        return false;
+    }
+
+    QList<qint64> blockOffsets;
+    if (copy.mtd && !blocks(fd, copy, &blockOffsets)) {
+        ::close(fd);
+        return false;
+    }
+
+    QByteArray buffer;
+    if (copy.mtd) {
+        buffer.resize(blockOffsets.count() * copy.sectorSize);
+        for (int i = 0; i < blockOffsets.count(); ++i) {
+            if (pread(fd, buffer.data() + i * copy.sectorSize, copy.sectorSize, blockOffsets.at(i)) != copy.sectorSize) {
+                errorString = QStringLiteral("Could not read %1: %2").arg(copy.device, QString::fromLatin1(strerror(errno)));
+                ::close(fd);
+                return false;
+            }
+        }
+        buffer = buffer.mid(copy.offset % copy.sectorSize, copy.envSize);
+    } else {
+        buffer.resize(copy.envSize);
+        if (pread(fd, buffer.data(), copy.envSize, copy.offset) != copy.envSize) {
+            errorString = QStringLiteral("Could not read %1: %2").arg(copy.device, QString::fromLatin1(strerror(errno)));
+            ::close(fd);
+            return false;
+        }
+    }
+    ::close(fd);
+
+    copy.valid = isValid(buffer);
+    copy.flags = copies.count() > 1 ? static_cast<quint8>(buffer.at(4)) : 0;
+    *data = buffer;
+    return true;
+}
+
+bool UBootEnvironment::Private::writeCopy(const EnvCopy &copy, const QByteArray &data)
+{
+    int fd = ::open(copy.device.toLatin1().constData(), O_RDWR | O_SYNC);
+    if (fd < 0) {
+        errorString = QStringLiteral("Could not open %1 for writing: %2").arg(copy.device, QString::fromLatin1(strerror(errno)));
+        return false;
+    }
+
+    if (!copy.mtd) {
+        bool written = pwrite(fd, data.constData(), data.size(), copy.offset) == data.size() && fsync(fd) == 0;
+        if (!written) {
+            errorString = QStringLiteral("Could not write %1: %2").arg(copy.device, QString::fromLatin1(strerror(errno)));
+        }
+        ::close(fd);
+        return written;
+    }
+
+    QList<qint64> blockOffsets;
+    if (!blocks(fd, copy, &blockOffsets)) {
+        ::close(fd);
+        return false;
+    }
+
+    // Erase blocks are usually larger than the environment: keep whatever else they hold.
+    QByteArray buffer(blockOffsets.count() * copy.sectorSize, '\xFF');
+    qint64 inBlockOffset = copy.offset % copy.sectorSize;
+    if (inBlockOffset != 0 || data.size() % copy.sectorSize != 0) {
+        for (int i = 0; i < blockOffsets.count(); ++i) {
+            if (pread(fd, buffer.data() + i * copy.sectorSize, copy.sectorSize, blockOffsets.at(i)) != copy.sectorSize) {
+                errorString = QStringLiteral("Could not read %1: %2").arg(copy.device, QString::fromLatin1(strerror(errno)));
+                ::close(fd);
+                return false;
+            }
+        }
+    }
+    buffer.replace(inBlockOffset, data.size(), data);
+
+    for (int i = 0; i < blockOffsets.count(); ++i) {
+        erase_info_user eraseInfo;
+        eraseInfo.start = blockOffsets.at(i);
+        eraseInfo.length = copy.sectorSize;
+        // Like fw_setenv: NOR parts may have the sector locked, parts without locking just fail the ioctl.
+        ioctl(fd, MEMUNLOCK, &eraseInfo);
+        if (ioctl(fd, MEMERASE, &eraseInfo) != 0) {
+            errorString = QStringLiteral("Could not erase %1 at %2: %3").arg(copy.device).arg(blockOffsets.at(i)).arg(QString::fromLatin1(strerror(errno)));
+            ::close(fd);
+            return false;
+        }
+        if (pwrite(fd, buffer.constData() + i * copy.sectorSize, copy.sectorSize, blockOffsets.at(i)) != copy.sectorSize) {
+            errorString = QStringLiteral("Could not write %1 at %2: %3").arg(copy.device).arg(blockOffsets.at(i)).arg(QString::fromLatin1(strerror(errno)));
+            ::close(fd);
+            return false;
+        }
+        ioctl(fd, MEMLOCK, &eraseInfo);
+    }
+
+    ::close(fd);
+    return true;
+}
+
+int UBootEnvironment::Private::headerSize() const
+{
+    // CRC, plus the flags byte of redundant environments.
+    return copies.count() > 1 ? 5 : 4;
+}
+
+bool UBootEnvironment::Private::usesFlagScheme() const
+{
+    return copies.first().mtd && copies.first().mtdType == MTD_NORFLASH;
+}
+
+bool UBootEnvironment::Private::isValid(const QByteArray &data) const
+{
+    int header = headerSize();
+    if (data.size() != copies.first().envSize) {
+        return false;
+    }
+    quint32 storedCrc = qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(data.constData()));
+    return storedCrc == Crc32::checksum(data.constData() + header, data.size() - header);
+}
+
+int UBootEnvironment::Private::selectCurrent() const
+{
+    // Same choice U-Boot makes when both copies are intact.
+    if (copies.count() < 2) {
+        return 0;
+    }
+
+    const EnvCopy &first = copies.at(0);
+    const EnvCopy &second = copies.at(1);
+    if (!first.valid && second.valid) {
+        return 1;
+    } else if (!first.valid || !second.valid) {
+        return 0;
+    } else if (usesFlagScheme()) {
+        return (second.flags == ENV_REDUND_ACTIVE && first.flags != ENV_REDUND_ACTIVE) ? 1 : 0;
+    } else if (first.flags == 0xFF && second.flags == 0) {
+        return 1;
+    } else if (second.flags == 0xFF && first.flags == 0) {
+        return 0;
+    }
+    return second.flags > first.flags ? 1 : 0;
+}
+
+void UBootEnvironment::Private::parseVariables(const QByteArray &data)
+{
+    variables.clear();
+
+    int position = headerSize();
+    while (position < data.size() && data.at(position) != '\0') {
+        int end = data.indexOf('\0', position);
+        if (end < 0) {
+            end = data.size();
+        }
+        QByteArray entry = data.mid(position, end - position);
+        int separator = entry.indexOf('=');
+        if (separator > 0) {
+            variables.append(qMakePair(entry.left(separator), entry.mid(separator + 1)));
+        }
+        position = end + 1;
+    }
+
+    storedVariables = variables;
+}
+
+QByteArray UBootEnvironment::Private::serialize(quint8 flags) const
+{
+    int header = headerSize();
+    qint64 envSize = copies.first().envSize;
+
+    QByteArray data(header, '\0');
+    for (const QPair< QByteArray, QByteArray > &variable : variables) {
+        data.append(variable.first).append('=').append(variable.second).append('\0');
+    }
+    if (data.size() + 1 > envSize) {
+        return QByteArray();
+    }
+    // The environment ends with an empty string, and the rest is padding.
+    data.append(QByteArray(envSize - data.size(), '\0'));
+
+    if (header == 5) {
+        data[4] = static_cast<char>(flags);
+    }
+    qToLittleEndian<quint32>(Crc32::checksum(data.constData() + header, envSize - header), reinterpret_cast<uchar *>(data.data()));
+    return data;
+}
+
+UBootEnvironment::UBootEnvironment(const QString &configPath)
+    : d(new Private)
+{
+    d->configPath = configPath;
+}
+
+UBootEnvironment::~UBootEnvironment()
+{
+    delete d;
+}
+
+bool UBootEnvironment::load()
+{
+    d->contents.clear();
+    d->variables.clear();
+
+    if (!d->openConfig()) {
+        return false;
+    }
+
+    for (EnvCopy &copy : d->copies) {
+        QByteArray data;
+        if (!d->readCopy(copy, &data)) {
+            return false;
+        }
+        d->contents.append(data);
+    }
+
+    d->current = d->selectCurrent();
+    if (!d->copies.at(d->current).valid) {
+        // fw_setenv would fall back to its built-in default environment, which we don't have.
+        d->errorString = QStringLiteral("No valid u-boot environment found");
+        return false;
+    }
+
+    d->parseVariables(d->contents.at(d->current));
+    qCDebug(ubootEnvironmentDC) << "Loaded" << d->variables.count() << "variables from copy" << d->current << "on" << d->copies.at(d->current).device;
+    return true;
+}
+
+QString UBootEnvironment::errorString() const
+{
+    return d->errorString;
+}
+
+bool UBootEnvironment::isRedundant() const
+{
+    return d->copies.count() > 1;
+}
+
+QStringList UBootEnvironment::names() const
+{
+    QStringList result;
+    for (const QPair< QByteArray, QByteArray > &variable : d->variables) {
+        result.append(QString::fromUtf8(variable.first));
+    }
+    return result;
+}
+
+bool UBootEnvironment::contains(const QString &name) const
+{
+    QByteArray key = name.toUtf8();
+    for (const QPair< QByteArray, QByteArray > &variable : d->variables) {
+        if (variable.first == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QString UBootEnvironment::value(const QString &name) const
+{
+    QByteArray key = name.toUtf8();
+    for (const QPair< QByteArray, QByteArray > &variable : d->variables) {
+        if (variable.first == key) {
+            return QString::fromUtf8(variable.second);
+        }
+    }
+    return QString();
+}
+
+void UBootEnvironment::setValue(const QString &name, const QString &value)
+{
+    QByteArray key = name.toUtf8();
+    for (int i = 0; i < d->variables.count(); ++i) {
+        if (d->variables.at(i).first == key) {
+            if (value.isEmpty()) {
+                d->variables.removeAt(i);
+            } else {
+                d->variables[i].second = value.toUtf8();
+            }
+            return;
+        }
+    }
+
+    // New variables go at the end, as fw_setenv does.
+    if (!value.isEmpty()) {
+        d->variables.append(qMakePair(key, value.toUtf8()));
+    }
+}
+
+int UBootEnvironment::modifiedCount() const
+{
+    QHash< QByteArray, QByteArray > stored;
+    for (const QPair< QByteArray, QByteArray > &variable : d->storedVariables) {
+        stored.insert(variable.first, variable.second);
+    }
+
+    int count = 0;
+    for (const QPair< QByteArray, QByteArray > &variable : d->variables) {
+        QHash< QByteArray, QByteArray >::iterator it = stored.find(variable.first);
+        if (it == stored.end()) {
+            ++count;
+            continue;
+        }
+        if (it.value() != variable.second) {
+            ++count;
+        }
+        stored.erase(it);
+    }
+
+    // Whatever is left was removed.
+    return count + stored.count();
+}
+
+bool UBootEnvironment::save()
+{
+    if (d->copies.isEmpty()) {
+        d->errorString = QStringLiteral("The u-boot environment was not loaded");
+        return false;
+    }
+
+    if (!isRedundant()) {
+        QByteArray data = d->serialize(0);
+        if (data.isEmpty()) {
+            d->errorString = QStringLiteral("The u-boot environment does not fit in %1 bytes").arg(d->copies.first().envSize);
+            return false;
+        }
+        if (!d->writeCopy(d->copies.first(), data)) {
+            return false;
+        }
+        d->contents[0] = data;
+        d->storedVariables = d->variables;
+        return true;
+    }
+
+    // The stale copy takes over first, so that an interruption at any point leaves one valid environment behind.
+    int stale = 1 - d->current;
+    quint8 currentFlags = d->copies.at(d->current).flags;
+    bool flagScheme = d->usesFlagScheme();
+
+    QByteArray staleData = d->serialize(flagScheme ? ENV_REDUND_ACTIVE : static_cast<quint8>(currentFlags + 1));
+    QByteArray currentData = d->serialize(flagScheme ? ENV_REDUND_OBSOLETE : static_cast<quint8>(currentFlags + 2));
+    if (staleData.isEmpty()) {
+        d->errorString = QStringLiteral("The u-boot environment does not fit in %1 bytes").arg(d->copies.first().envSize);
+        return false;
+    }
+
+    if (!d->writeCopy(d->copies.at(stale), staleData)) {
+        return false;
+    }
+    d->copies[stale].valid = true;
+    d->copies[stale].flags = static_cast<quint8>(staleData.at(4));
+    d->contents[stale] = staleData;
+    d->current = stale;
+
+    if (!d->writeCopy(d->copies.at(1 - stale), currentData)) {
+        return false;
+    }
+    d->copies[1 - stale].valid = true;
+    d->copies[1 - stale].flags = static_cast<quint8>(currentData.at(4));
+    d->contents[1 - stale] = currentData;
+    d->storedVariables = d->variables;
+    // With counters, the copy written last is the newest one.
+    if (!flagScheme) {
+        d->current = 1 - stale;
+    }
+
+    return true;
+}
+
+bool UBootEnvironment::saveRawBackup(const QString &path) const
+{
+    if (d->contents.isEmpty()) {
+        d->errorString = QStringLiteral("The u-boot environment was not loaded");
+        return false;
+    }
+
+    QByteArray payload;
+    for (const QByteArray &data : d->contents) {
+        payload.append(data);
+    }
+
+    QByteArray header(UBOOT_ENV_RAW_BACKUP_MAGIC);
+    header.resize(header.size() + 12);
+    uchar *fields = reinterpret_cast<uchar *>(header.data()) + header.size() - 12;
+    qToLittleEndian<quint32>(d->contents.count(), fields);
+    qToLittleEndian<quint32>(d->copies.first().envSize, fields + 4);
+    qToLittleEndian<quint32>(Crc32::checksum(payload.constData(), payload.size()), fields + 8);
+
+    QFile backupFile(path);
+    if (!backupFile.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        backupFile.write(header) != header.size() || backupFile.write(payload) != payload.size() || !backupFile.flush()) {
+        d->errorString = QStringLiteral("Could not write %1: %2").arg(path, backupFile.errorString());
+        return false;
+    }
+
+    return true;
+}
+
+bool UBootEnvironment::restoreRawBackup(const QString &path)
+{
+    QFile backupFile(path);
+    if (!backupFile.open(QIODevice::ReadOnly)) {
+        d->errorString = QStringLiteral("Could not read %1: %2").arg(path, backupFile.errorString());
+        return false;
+    }
+    QByteArray backup = backupFile.readAll();
+
+    if (!d->openConfig()) {
+        return false;
+    }
+
+    int headerSize = sizeof(UBOOT_ENV_RAW_BACKUP_MAGIC) - 1 + 12;
+    if (backup.size() < headerSize || !backup.startsWith(UBOOT_ENV_RAW_BACKUP_MAGIC)) {
+        d->errorString = QStringLiteral("%1 is not a u-boot environment backup").arg(path);
+        return false;
+    }
+    const uchar *fields = reinterpret_cast<const uchar *>(backup.constData()) + headerSize - 12;
+
+    int copyCount = qFromLittleEndian<quint32>(fields);
+    qint64 envSize = qFromLittleEndian<quint32>(fields + 4);
+    QByteArray payload = backup.mid(headerSize);
+    // The backup must come from this very layout, or the blobs would be written over something else.
+    if (copyCount != d->copies.count() || envSize != d->copies.first().envSize || payload.size() != copyCount * envSize) {
+        d->errorString = QStringLiteral("%1 does not match the environment layout in %2").arg(path, d->configPath);
+        return false;
+    }
+    if (qFromLittleEndian<quint32>(fields + 8) != Crc32::checksum(payload.constData(), payload.size())) {
+        d->errorString = QStringLiteral("%1 is corrupted").arg(path);
+        return false;
+    }
+
+    d->contents.clear();
+    for (int i = 0; i < copyCount; ++i) {
+        d->contents.append(payload.mid(i * envSize, envSize));
+        d->copies[i].valid = d->isValid(d->contents.last());
+        d->copies[i].flags = copyCount > 1 ? static_cast<quint8>(d->contents.last().at(4)) : 0;
+    }
+
+    d->current = d->selectCurrent();
+    if (!d->copies.at(d->current).valid) {
+        d->errorString = QStringLiteral("%1 holds no valid u-boot environment").arg(path);
+        return false;
+    }
+
+    // The copy that will be current goes last, so an interruption leaves at least one of them intact.
+    for (int i = 0; i < copyCount; ++i) {
+        int index = (d->current + 1 + i) % copyCount;
+        if (!d->writeCopy(d->copies.at(index), d->contents.at(index))) {
+            return false;
+        }
+    }
+
+    d->parseVariables(d->contents.at(d->current));
+    return true;
+}
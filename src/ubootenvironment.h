@@ -0,0 +1,47 @@
+#ifndef UBOOTENVIRONMENT_H_
+#define UBOOTENVIRONMENT_H_
+
+#include <QtCore/QStringList>
+
+#define FW_ENV_CONFIG "/etc/fw_env.config"
+// The environment blobs as they are on flash, with a header and a CRC over all of them.
+#define UBOOT_ENV_RAW_BACKUP_MAGIC "HFUENV01"
+
+/// Reads and writes the U-Boot environment the way fw_printenv and fw_setenv do, without a process per variable.
+class UBootEnvironment
+{
+public:
+    explicit UBootEnvironment(const QString &configPath = QStringLiteral(FW_ENV_CONFIG));
+    ~UBootEnvironment();
+
+    /// Parses the config and reads every copy of the environment, picking the current one.
+    bool load();
+    QString errorString() const;
+
+    bool isRedundant() const;
+
+    QStringList names() const;
+    bool contains(const QString &name) const;
+    QString value(const QString &name) const;
+    /// Like fw_setenv, an empty @p value removes the variable.
+    void setValue(const QString &name, const QString &value);
+
+    /// Variables added, removed or changed since the environment was read or last written.
+    int modifiedCount() const;
+
+    /// Writes the environment back, each copy exactly once, the stale one first.
+    bool save();
+
+    /// Stores every copy of the environment exactly as read by load() into @p path.
+    bool saveRawBackup(const QString &path) const;
+    /// Validates the raw backup in @p path and writes its copies back as they are. Doesn't need a valid environment on flash.
+    bool restoreRawBackup(const QString &path);
+
+private:
+    Q_DISABLE_COPY(UBootEnvironment)
+
+    class Private;
+    Private * const d;
+};
+
+#endif
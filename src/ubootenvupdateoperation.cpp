@@ -1,29 +1,63 @@
 #include "ubootenvupdateoperation.h"
 
+#include "processlauncher.h"
+#include "progressreporter.h"
+#include "ubootenvironment.h"
+
 #include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QFile>
 #include <QtCore/QJsonObject>
-#include <QtCore/QProcess>
 #include <QtCore/QStringList>
 
 #include <HemeraCore/Literals>
 
 #define FW_SETENV_PATH "/usr/sbin/fw_setenv"
-#define FW_ENV_CONFIG "/etc/fw_env.config"
 
 class UBootEnvUpdateOperation::Private
 {
 public:
     Private()
-        : process(nullptr),
-          success(false)
+        : success(false)
     {}
     QHash<QString, QString> updates;
     QHash<QString, QString>::iterator keyValueIterator;
-    QProcess *process;
     bool success;
+
+    bool updateNative(QString *errorMessage);
 };
 
+bool UBootEnvUpdateOperation::Private::updateNative(QString *errorMessage)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    UBootEnvironment environment;
+    if (!environment.load()) {
+        *errorMessage = environment.errorString();
+        return false;
+    }
+
+    for (QHash<QString, QString>::const_iterator i = updates.constBegin(); i != updates.constEnd(); ++i) {
+        environment.setValue(i.key(), i.value());
+    }
+
+    // Setting variables to what they already are is common, and not worth an erase cycle.
+    int modified = environment.modifiedCount();
+    if (modified > 0 && !environment.save()) {
+        *errorMessage = environment.errorString();
+        return false;
+    }
+
+    ProgressReporter(QStringLiteral("u-boot_env")).sendEvent(QJsonObject { { QStringLiteral("modified_variables"), modified } });
+    if (modified == 0) {
+        qDebug() << "All" << updates.count() << "u-boot variables are already up to date, not writing the environment";
+    } else {
+        qDebug() << "Updated" << modified << "of" << updates.count() << "u-boot variables in" << timer.elapsed() << "ms";
+    }
+    return true;
+}
+
 UBootEnvUpdateOperation::UBootEnvUpdateOperation(const QString &id, QObject *parent)
     : RootOperation(id, parent)
     , d(new Private)
@@ -43,12 +77,54 @@ void UBootEnvUpdateOperation::startVarUpdate(const QString &key, const QString &
         args << value;
     }
 
+    ProcessLauncher *launcher = new ProcessLauncher(QStringLiteral(FW_SETENV_PATH), args, this);
+    QObject::connect(launcher, &Hemera::Operation::finished, this, [this] (Hemera::Operation *operation) {
+        d->success = !operation->isError();
+        operation->deleteLater();
+        d->keyValueIterator++;
+
+        //TODO: this is highly inefficient, we should just send to fw_setenv -s a tab separated input
+        if (d->success && (d->keyValueIterator != d->updates.end())) {
+            startVarUpdate(d->keyValueIterator.key(), d->keyValueIterator.value());
+        } else if (d->success && (d->keyValueIterator == d->updates.end())) {
+            setFinished();
+        } else {
+            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                                 QStringLiteral("Failed to update environment var."));
+                                 return;
+        }
+    });
+
     qDebug() << "Launching: " FW_SETENV_PATH " " << args;
-    d->process->start(QStringLiteral(FW_SETENV_PATH), args);
+    launcher->start();
 }
 
 void UBootEnvUpdateOperation::startImpl()
 {
+    // A raw backup goes back in one validated write, replacing whatever was set since: only on request, or if there is
+    // nothing valid to merge into. Otherwise, or if it's missing or doesn't check out, the text backup follows.
+    QString rawFile = parameters().value(QStringLiteral("raw_file")).toString();
+    bool replace = parameters().value(QStringLiteral("replace_environment")).toBool(false);
+    if (!replace && !rawFile.isEmpty()) {
+        UBootEnvironment current;
+        replace = !current.load();
+        if (replace) {
+            qDebug() << "Current u-boot environment is not usable:" << current.errorString();
+        }
+    }
+    if (replace && !rawFile.isEmpty() && QFile::exists(rawFile)) {
+        QElapsedTimer timer;
+        timer.start();
+
+        UBootEnvironment environment;
+        if (environment.restoreRawBackup(rawFile)) {
+            qDebug() << "Restored the u-boot environment from" << rawFile << "in" << timer.elapsed() << "ms";
+            setFinished();
+            return;
+        }
+        qWarning() << "Could not restore" << rawFile << ":" << environment.errorString();
+    }
+
     if (parameters().contains(QStringLiteral("environment"))) {
         QJsonObject ubootEnvUpdate = parameters().value(QStringLiteral("environment")).toObject();
         for (QJsonObject::const_iterator i = ubootEnvUpdate.constBegin(); i != ubootEnvUpdate.constEnd(); ++i) {
@@ -71,52 +147,36 @@ void UBootEnvUpdateOperation::startImpl()
         }
     }
 
-    if (!QFile::exists(QStringLiteral(FW_SETENV_PATH))) {
-        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
-                             QStringLiteral("Error: " FW_SETENV_PATH " is not installed."));
-        return;
-    }
-
     if (!QFile::exists(QStringLiteral(FW_ENV_CONFIG))) {
         setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
                              QStringLiteral("Error: Cannot read u-boot environment config."));
         return;
     }
 
+    if (d->updates.isEmpty()) {
+        qWarning() << "No variables to update! I guess something is wrong...";
+        setFinished();
+        return;
+    }
 
-    d->process = new QProcess(this);
-
-    connect(d->process, &QProcess::readyReadStandardOutput, this, [this] () {
-        qDebug() << d->process->readAllStandardOutput();
-    });
-    connect(d->process, &QProcess::readyReadStandardError, this, [this] () {
-        qDebug() << d->process->readAllStandardError();
-    });
-    QObject::connect(d->process, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-                     this, [this] (int exitCode, QProcess::ExitStatus exitStatus) {
-        d->success = ((exitStatus == QProcess::NormalExit) && (exitCode == 0));
-        d->keyValueIterator++;
-
-        //TODO: this is highly inefficient, we should just send to fw_setenv -s a tab separated input
-        if (d->success && (d->keyValueIterator != d->updates.end())) {
-            startVarUpdate(d->keyValueIterator.key(), d->keyValueIterator.value());
-        } else if (d->success && (d->keyValueIterator == d->updates.end())) {
+    // Loading and writing the environment once beats a fw_setenv run, and a full flash write, per variable.
+    if (parameters().value(QStringLiteral("native")).toBool(true)) {
+        QString errorMessage;
+        if (d->updateNative(&errorMessage)) {
             setFinished();
-        } else {
-            setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                                 QStringLiteral("Failed to update environment var."));
-                                 return;
+            return;
         }
-    });
-
-    if (!d->updates.isEmpty()) {
-        d->keyValueIterator = d->updates.begin();
-        startVarUpdate(d->keyValueIterator.key(), d->keyValueIterator.value());
+        qWarning() << "Could not update the u-boot environment natively:" << errorMessage << "falling back to " FW_SETENV_PATH;
+    }
 
-    } else {
-        qWarning() << "No variables to update! I guess something is wrong...";
-        setFinished();
+    if (!QFile::exists(QStringLiteral(FW_SETENV_PATH))) {
+        setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::unhandledRequest()),
+                             QStringLiteral("Error: " FW_SETENV_PATH " is not installed."));
+        return;
     }
+
+    d->keyValueIterator = d->updates.begin();
+    startVarUpdate(d->keyValueIterator.key(), d->keyValueIterator.value());
 }
 
 ROOT_OPERATION_WORKER(UBootEnvUpdateOperation, "com.ispirata.Hemera.FlashUtility.UBootEnvUpdateOperation")
@@ -0,0 +1,109 @@
+#include "udevsettleoperation.h"
+
+#include "processlauncher.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFileInfo>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QTimer>
+
+#define UDEVADM_PATH "/usr/bin/udevadm"
+
+Q_LOGGING_CATEGORY(udevSettleOperationDC, "com.ispirata.Hemera.FlashUtility.Logging.UdevSettleOperation")
+
+class UdevSettleOperation::Private
+{
+public:
+    Private(UdevSettleOperation *q)
+        : q(q)
+        , timeout(0)
+        , replacedDelay(0)
+    {}
+
+    void trigger();
+    void settle();
+    void fallBack();
+
+    UdevSettleOperation * const q;
+
+    QString device;
+    int timeout;
+    int replacedDelay;
+    QElapsedTimer elapsed;
+};
+
+void UdevSettleOperation::Private::trigger()
+{
+    // Writing a filesystem image doesn't always generate an event: make sure udev rescans the device.
+    QString canonicalPath = QFileInfo(device).canonicalFilePath();
+    QString sysname = QFileInfo(canonicalPath.isEmpty() ? device : canonicalPath).fileName();
+
+    ProcessLauncher *udevadm = new ProcessLauncher(QStringLiteral(UDEVADM_PATH),
+                                                   QStringList { QStringLiteral("trigger"), QStringLiteral("--action=change"),
+                                                                 QStringLiteral("--sysname-match=%1").arg(sysname) }, q);
+    QObject::connect(udevadm, &Hemera::Operation::finished, q, [this, udevadm] {
+        if (udevadm->errorName() == QStringLiteral(PROCESS_SPAWN_FAILED_ERROR)) {
+            fallBack();
+            return;
+        }
+        if (udevadm->isError()) {
+            qCWarning(udevSettleOperationDC) << "Could not trigger a change event for" << device << ":" << udevadm->errorMessage();
+        }
+        settle();
+    });
+    udevadm->start();
+}
+
+void UdevSettleOperation::Private::settle()
+{
+    ProcessLauncher *udevadm = new ProcessLauncher(QStringLiteral(UDEVADM_PATH),
+                                                   QStringList { QStringLiteral("settle"), QStringLiteral("--timeout=%1").arg(qMax(1, timeout / 1000)) }, q);
+    QObject::connect(udevadm, &Hemera::Operation::finished, q, [this, udevadm] {
+        if (udevadm->errorName() == QStringLiteral(PROCESS_SPAWN_FAILED_ERROR)) {
+            fallBack();
+            return;
+        }
+        // Not being able to settle is no worse than the fixed delay running out: carry on anyway.
+        if (udevadm->isError()) {
+            qCWarning(udevSettleOperationDC) << "udev did not settle within" << timeout << "ms";
+        }
+        qCInfo(udevSettleOperationDC) << "udev settled in" << elapsed.elapsed() << "ms, the fixed delay was" << replacedDelay << "ms";
+        q->setFinished();
+    });
+    udevadm->start();
+}
+
+void UdevSettleOperation::Private::fallBack()
+{
+    // Without udevadm, the fixed delay is all we can go by.
+    qint64 remaining = qMax(Q_INT64_C(0), replacedDelay - elapsed.elapsed());
+    qCWarning(udevSettleOperationDC) << "Could not run " UDEVADM_PATH ", waiting" << remaining << "ms instead";
+    QTimer::singleShot(remaining, q, [this] {
+        q->setFinished();
+    });
+}
+
+UdevSettleOperation::UdevSettleOperation(const QString &device, int timeout, int replacedDelay, QObject *parent)
+    : Operation(parent)
+    , d(new Private(this))
+{
+    d->device = device;
+    d->timeout = timeout;
+    d->replacedDelay = replacedDelay;
+}
+
+UdevSettleOperation::~UdevSettleOperation()
+{
+    delete d;
+}
+
+void UdevSettleOperation::startImpl()
+{
+    d->elapsed.start();
+
+    if (d->device.isEmpty()) {
+        d->settle();
+    } else {
+        d->trigger();
+    }
+}
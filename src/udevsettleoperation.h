@@ -0,0 +1,25 @@
+#ifndef UDEVSETTLE_OPERATION_
+#define UDEVSETTLE_OPERATION_
+
+#include <HemeraCore/Operation>
+
+/// Finishes once udev processed all pending events, after synthesizing a change event for @p device if given.
+/// @p replacedDelay is the fixed delay this used to be: it is reported along with the settle time, and waited for instead if udevadm can't run.
+class UdevSettleOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(UdevSettleOperation)
+
+public:
+    explicit UdevSettleOperation(const QString &device, int timeout, int replacedDelay, QObject *parent = nullptr);
+    virtual ~UdevSettleOperation();
+
+protected:
+    virtual void startImpl();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif